@@ -0,0 +1,219 @@
+/*  AMF decoding benchmark
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with RTMPDump; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+/* usage: amfbench [keyframes]
+ *
+ * Decodes an onStatus invoke and an onMetaData with two strict arrays
+ * of keyframes entries, once with AMF_Decode + AMF_Reset and once into
+ * a 4KB stack arena like HandleInvoke and HandleMetadata do. Reports
+ * the time and the malloc/realloc/calloc calls per message.
+ *
+ * The calls are counted by wrapping those functions at link time, see
+ * the Makefile, so this needs a linker that supports --wrap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../librtmp/amf.h"
+
+static unsigned long nAllocs, nAllocBytes;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+  nAllocs++;
+  nAllocBytes += size;
+  return __real_malloc(size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+  nAllocs++;
+  nAllocBytes += size;
+  return __real_realloc(ptr, size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+  nAllocs++;
+  nAllocBytes += nmemb * size;
+  return __real_calloc(nmemb, size);
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static char *
+encodeName(char *p, char *end, const char *name)
+{
+  int len = strlen(name);
+
+  p = AMF_EncodeInt16(p, end, len);
+  memcpy(p, name, len);
+  return p + len;
+}
+
+static char *
+encodeObjectEnd(char *p, char *end)
+{
+  p = AMF_EncodeInt16(p, end, 0);
+  *p++ = AMF_OBJECT_END;
+  return p;
+}
+
+static char *
+encodeStrictArray(char *p, char *end, const char *name, int n, double step)
+{
+  int i;
+
+  p = encodeName(p, end, name);
+  *p++ = AMF_STRICT_ARRAY;
+  p = AMF_EncodeInt32(p, end, n);
+  for (i = 0; i < n; i++)
+    p = AMF_EncodeNumber(p, end, i * step);
+  return p;
+}
+
+static int
+buildStatus(char *buf, int size)
+{
+  static const AVal name = AVC("onStatus"), level = AVC("level"),
+    status = AVC("status"), code = AVC("code"),
+    start = AVC("NetStream.Play.Start"), desc = AVC("description"),
+    started = AVC("Started playing");
+  char *p = buf, *end = buf + size;
+
+  p = AMF_EncodeString(p, end, &name);
+  p = AMF_EncodeNumber(p, end, 0);
+  *p++ = AMF_NULL;
+  *p++ = AMF_OBJECT;
+  p = AMF_EncodeNamedString(p, end, &level, &status);
+  p = AMF_EncodeNamedString(p, end, &code, &start);
+  p = AMF_EncodeNamedString(p, end, &desc, &started);
+  p = encodeObjectEnd(p, end);
+  return p - buf;
+}
+
+static int
+buildMetadata(char *buf, int size, int nKeyframes)
+{
+  static const AVal name = AVC("onMetaData"), duration = AVC("duration"),
+    width = AVC("width");
+  char *p = buf, *end = buf + size;
+
+  p = AMF_EncodeString(p, end, &name);
+  *p++ = AMF_ECMA_ARRAY;
+  p = AMF_EncodeInt32(p, end, 3);
+  p = AMF_EncodeNamedNumber(p, end, &duration, 3600);
+  p = AMF_EncodeNamedNumber(p, end, &width, 640);
+  p = encodeName(p, end, "keyframes");
+  *p++ = AMF_OBJECT;
+  p = encodeStrictArray(p, end, "times", nKeyframes, 2.0);
+  p = encodeStrictArray(p, end, "filepositions", nKeyframes, 1000.0);
+  p = encodeObjectEnd(p, end);
+  p = encodeObjectEnd(p, end);
+  return p - buf;
+}
+
+static void
+bench(const char *name, const char *buf, int size, int iterations)
+{
+  AMFObject obj;
+  unsigned long allocs, bytes;
+  double t0, heapUs, arenaUs;
+  int i;
+
+  allocs = nAllocs;
+  bytes = nAllocBytes;
+  t0 = now();
+  for (i = 0; i < iterations; i++)
+    {
+      if (AMF_Decode(&obj, buf, size, false) < 0)
+	{
+	  fprintf(stderr, "%s: decode failed\n", name);
+	  exit(1);
+	}
+      AMF_Reset(&obj);
+    }
+  heapUs = (now() - t0) / iterations;
+  printf("%-10s malloc: %6.1f allocs %8lu bytes %8.2fus", name,
+	 (double)(nAllocs - allocs) / iterations,
+	 (nAllocBytes - bytes) / iterations, heapUs);
+
+  allocs = nAllocs;
+  bytes = nAllocBytes;
+  t0 = now();
+  for (i = 0; i < iterations; i++)
+    {
+      AMFArena arena;
+      char ab[4096];
+
+      AMFArena_Init(&arena, ab, sizeof(ab));
+      if (AMF_DecodeArena(&obj, buf, size, false, &arena) < 0)
+	{
+	  fprintf(stderr, "%s: arena decode failed\n", name);
+	  exit(1);
+	}
+      AMFArena_Free(&arena);
+    }
+  arenaUs = (now() - t0) / iterations;
+  printf(" | arena: %6.1f allocs %8lu bytes %8.2fus\n",
+	 (double)(nAllocs - allocs) / iterations,
+	 (nAllocBytes - bytes) / iterations, arenaUs);
+}
+
+int
+main(int argc, char **argv)
+{
+  int nKeyframes = argc > 1 ? atoi(argv[1]) : 100;
+  char status[512], *meta;
+  int size, metaSize;
+
+  if (nKeyframes < 0)
+    {
+      fprintf(stderr, "usage: %s [keyframes]\n", argv[0]);
+      return 1;
+    }
+
+  size = buildStatus(status, sizeof(status));
+  metaSize = 128 + nKeyframes * 2 * 9;
+  meta = malloc(metaSize);
+  metaSize = buildMetadata(meta, metaSize, nKeyframes);
+
+  printf("per message, %d keyframes\n", nKeyframes);
+  bench("onStatus", status, size, 100000);
+  bench("onMetaData", meta, metaSize, nKeyframes >= 10000 ? 20 : 200);
+
+  free(meta);
+  return 0;
+}
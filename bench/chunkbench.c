@@ -0,0 +1,219 @@
+/*  RTMP chunk stream parsing benchmark
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with RTMPDump; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+/* usage: chunkbench [chunksize [runs]]
+ *
+ * A writer thread feeds a synthetic plain chunk stream of NMSG
+ * audio/video messages through a socketpair into RTMP_ReadPacket.
+ * Reports the reader thread's CPU time per chunk, median of runs, so
+ * that the per-chunk header cost is not hidden behind memcpy.
+ * Also checks that m_nBytesCopied + m_nBytesDirect account for every
+ * byte of the stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "../librtmp/rtmp.h"
+#include "../librtmp/log.h"
+
+#define NMSG	20000
+#define MAXRUNS	101
+
+typedef struct
+{
+  int fd;
+  unsigned char *data;
+  long len;
+} Feed;
+
+/* Build NMSG messages on alternating audio/video channels, each chunked
+ * at chunkSize and filled with its sequence number. Stores the number
+ * of chunks in *nChunks.
+ */
+static long
+buildStream(unsigned char *out, int chunkSize, long *nChunks)
+{
+  long total = 0;
+  int i;
+
+  *nChunks = 0;
+  srand(1);
+  for (i = 0; i < NMSG; i++)
+    {
+      int len = (i & 1) ? 200 + rand() % 400 : 2000 + rand() % 8000;
+      int cs = (i & 1) ? 4 : 6;
+      int o = 0, pos = 0;
+
+      out[o++] = cs;
+      out[o++] = 0;
+      out[o++] = 0;
+      out[o++] = 40;
+      out[o++] = len >> 16;
+      out[o++] = len >> 8;
+      out[o++] = len;
+      out[o++] = (i & 1) ? RTMP_PACKET_TYPE_AUDIO : RTMP_PACKET_TYPE_VIDEO;
+      out[o++] = 1;
+      out[o++] = 0;
+      out[o++] = 0;
+      out[o++] = 0;
+      while (pos < len)
+	{
+	  int n = len - pos < chunkSize ? len - pos : chunkSize;
+	  if (pos)
+	    out[o++] = 0xc0 | cs;
+	  memset(out + o, i, n);
+	  o += n;
+	  pos += n;
+	  (*nChunks)++;
+	}
+      out += o;
+      total += o;
+    }
+  return total;
+}
+
+static void *
+feedThread(void *arg)
+{
+  Feed *f = arg;
+  long w = 0;
+
+  while (w < f->len)
+    {
+      long n = f->len - w > 262144 ? 262144 : f->len - w;
+      n = write(f->fd, f->data + w, n);
+      if (n <= 0)
+	break;
+      w += n;
+    }
+  shutdown(f->fd, SHUT_WR);
+  return NULL;
+}
+
+static double
+cpuTime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* returns reader CPU ns for the whole stream */
+static double
+readRun(unsigned char *stream, long len, int chunkSize)
+{
+  RTMP r;
+  RTMPPacket packet = { 0 };
+  pthread_t t;
+  Feed f;
+  int sv[2], n = 0;
+  double t0, t1;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+      perror("socketpair");
+      exit(1);
+    }
+  memset(&r, 0, sizeof(r));
+  RTMP_Init(&r);
+  r.m_sb.sb_socket = sv[0];
+  r.m_inChunkSize = chunkSize;
+
+  f.fd = sv[1];
+  f.data = stream;
+  f.len = len;
+  pthread_create(&t, NULL, feedThread, &f);
+
+  t0 = cpuTime();
+  while (n < NMSG && RTMP_ReadPacket(&r, &packet))
+    {
+      if (!RTMPPacket_IsReady(&packet))
+	continue;
+      if (packet.m_body[0] != (char)n)
+	{
+	  fprintf(stderr, "corrupt message %d\n", n);
+	  exit(1);
+	}
+      n++;
+      RTMPPacket_Free(&packet);
+    }
+  t1 = cpuTime();
+
+  if (n != NMSG)
+    {
+      fprintf(stderr, "short read: %d of %d messages\n", n, NMSG);
+      exit(1);
+    }
+  if (r.m_nBytesCopied + r.m_nBytesDirect != (uint64_t) len)
+    {
+      fprintf(stderr, "byte counters off: %llu copied + %llu direct != %ld\n",
+	      (unsigned long long) r.m_nBytesCopied,
+	      (unsigned long long) r.m_nBytesDirect, len);
+      exit(1);
+    }
+  RTMP_Close(&r);
+  pthread_join(t, NULL);
+  close(sv[1]);
+  return t1 - t0;
+}
+
+static int
+cmpDouble(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char **argv)
+{
+  int chunkSize = argc > 1 ? atoi(argv[1]) : RTMP_DEFAULT_CHUNKSIZE;
+  int runs = argc > 2 ? atoi(argv[2]) : 15;
+  double ns[MAXRUNS];
+  unsigned char *stream;
+  long len, nChunks;
+  int i;
+
+  if (chunkSize < 1 || runs < 1 || runs > MAXRUNS)
+    {
+      fprintf(stderr, "usage: %s [chunksize [runs]]\n", argv[0]);
+      return 1;
+    }
+  debuglevel = LOGCRIT;
+
+  /* worst case is a 1-byte continuation header per byte of body */
+  stream = malloc(NMSG * (12 + 2 * 10000L));
+  len = buildStream(stream, chunkSize, &nChunks);
+
+  for (i = 0; i < runs; i++)
+    ns[i] = readRun(stream, len, chunkSize) / nChunks;
+  qsort(ns, runs, sizeof(double), cmpDouble);
+  printf("%d-byte chunks: %ld chunks, %.1f ns/chunk reader CPU "
+	 "(median of %d, min %.1f, max %.1f)\n", chunkSize, nChunks,
+	 ns[runs / 2], runs, ns[0], ns[runs - 1]);
+
+  free(stream);
+  return 0;
+}
@@ -0,0 +1,281 @@
+/*  RTMPE read/write throughput benchmark
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with RTMPDump; see the file COPYING.  If not, write to
+ *  the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *  http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+/* usage: rtmpebench [chunksize [msgsize]]
+ *
+ * Read side: a writer thread feeds a pre-encrypted chunk stream of
+ * NMSG audio/video messages through a socketpair into RTMP_ReadPacket,
+ * with Link.rc4keyIn set as after an RTMPE handshake.
+ * Write side: NSEND messages of msgsize bytes go through
+ * RTMP_SendPacket with Link.rc4keyOut set, into a socket that another
+ * thread drains.
+ * Both report MB/s, best of RUNS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <openssl/rc4.h>
+
+#include "../librtmp/rtmp.h"
+#include "../librtmp/log.h"
+
+#define NMSG	20000
+#define NSEND	4000
+#define RUNS	3
+
+static const unsigned char key[16] = "0123456789abcdef";
+
+typedef struct
+{
+  int fd;
+  unsigned char *data;
+  long len;
+} Feed;
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Build NMSG messages on alternating audio/video channels, each chunked
+ * at chunkSize and filled with its sequence number, then RC4 the lot.
+ */
+static long
+buildStream(unsigned char *out, int chunkSize)
+{
+  RC4_KEY k;
+  long total = 0;
+  int i;
+
+  RC4_set_key(&k, sizeof(key), key);
+  srand(1);
+  for (i = 0; i < NMSG; i++)
+    {
+      int len = (i & 1) ? 200 + rand() % 400 : 2000 + rand() % 8000;
+      int cs = (i & 1) ? 4 : 6;
+      int o = 0, pos = 0;
+
+      out[o++] = cs;
+      out[o++] = 0;
+      out[o++] = 0;
+      out[o++] = 40;
+      out[o++] = len >> 16;
+      out[o++] = len >> 8;
+      out[o++] = len;
+      out[o++] = (i & 1) ? RTMP_PACKET_TYPE_AUDIO : RTMP_PACKET_TYPE_VIDEO;
+      out[o++] = 1;
+      out[o++] = 0;
+      out[o++] = 0;
+      out[o++] = 0;
+      while (pos < len)
+	{
+	  int n = len - pos < chunkSize ? len - pos : chunkSize;
+	  if (pos)
+	    out[o++] = 0xc0 | cs;
+	  memset(out + o, i, n);
+	  o += n;
+	  pos += n;
+	}
+      RC4(&k, o, out, out);
+      out += o;
+      total += o;
+    }
+  return total;
+}
+
+static void *
+feedThread(void *arg)
+{
+  Feed *f = arg;
+  long w = 0;
+
+  while (w < f->len)
+    {
+      long n = f->len - w > 262144 ? 262144 : f->len - w;
+      n = write(f->fd, f->data + w, n);
+      if (n <= 0)
+	break;
+      w += n;
+    }
+  shutdown(f->fd, SHUT_WR);
+  return NULL;
+}
+
+static void *
+drainThread(void *arg)
+{
+  int fd = *(int *)arg;
+  char buf[65536];
+
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  return NULL;
+}
+
+static double
+readRun(unsigned char *stream, long len, int chunkSize)
+{
+  RTMP r;
+  RTMPPacket packet = { 0 };
+  RC4_KEY kin;
+  pthread_t t;
+  Feed f;
+  int sv[2], n = 0;
+  long bytes = 0;
+  double t0, t1;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+      perror("socketpair");
+      exit(1);
+    }
+  memset(&r, 0, sizeof(r));
+  RTMP_Init(&r);
+  r.m_sb.sb_socket = sv[0];
+  r.m_inChunkSize = chunkSize;
+  RC4_set_key(&kin, sizeof(key), key);
+  r.Link.rc4keyIn = &kin;
+
+  f.fd = sv[1];
+  f.data = stream;
+  f.len = len;
+  pthread_create(&t, NULL, feedThread, &f);
+
+  t0 = now();
+  while (n < NMSG && RTMP_ReadPacket(&r, &packet))
+    {
+      if (!RTMPPacket_IsReady(&packet))
+	continue;
+      if (packet.m_body[0] != (char)n)
+	{
+	  fprintf(stderr, "corrupt message %d\n", n);
+	  exit(1);
+	}
+      bytes += packet.m_nBodySize;
+      n++;
+      RTMPPacket_Free(&packet);
+    }
+  t1 = now();
+
+  if (n != NMSG)
+    {
+      fprintf(stderr, "short read: %d of %d messages\n", n, NMSG);
+      exit(1);
+    }
+  r.Link.rc4keyIn = NULL;
+  RTMP_Close(&r);
+  pthread_join(t, NULL);
+  close(sv[1]);
+  return bytes / 1e6 / (t1 - t0);
+}
+
+static double
+writeRun(int msgSize)
+{
+  RTMP r;
+  RTMPPacket packet = { 0 };
+  RC4_KEY kout;
+  pthread_t t;
+  char *body;
+  int sv[2], i;
+  double t0, t1;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+      perror("socketpair");
+      exit(1);
+    }
+  memset(&r, 0, sizeof(r));
+  RTMP_Init(&r);
+  r.m_sb.sb_socket = sv[0];
+  r.m_outChunkSize = msgSize;
+  RC4_set_key(&kout, sizeof(key), key);
+  r.Link.rc4keyOut = &kout;
+  pthread_create(&t, NULL, drainThread, &sv[1]);
+
+  body = calloc(1, RTMP_MAX_HEADER_SIZE + msgSize);
+  packet.m_nChannel = 6;
+  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  packet.m_packetType = RTMP_PACKET_TYPE_VIDEO;
+  packet.m_nInfoField2 = 1;
+  packet.m_body = body + RTMP_MAX_HEADER_SIZE;
+  packet.m_nBodySize = msgSize;
+
+  t0 = now();
+  for (i = 0; i < NSEND; i++)
+    if (!RTMP_SendPacket(&r, &packet, false))
+      {
+	fprintf(stderr, "send failed\n");
+	exit(1);
+      }
+  t1 = now();
+
+  r.Link.rc4keyOut = NULL;
+  RTMP_Close(&r);
+  pthread_join(t, NULL);
+  close(sv[1]);
+  free(body);
+  return (double)NSEND * msgSize / 1e6 / (t1 - t0);
+}
+
+int
+main(int argc, char **argv)
+{
+  int chunkSize = argc > 1 ? atoi(argv[1]) : 4096;
+  int msgSize = argc > 2 ? atoi(argv[2]) : 300000;
+  double best, mbs;
+  unsigned char *stream;
+  long len;
+  int i;
+
+  if (chunkSize < 1 || msgSize < 1)
+    {
+      fprintf(stderr, "usage: %s [chunksize [msgsize]]\n", argv[0]);
+      return 1;
+    }
+  debuglevel = LOGCRIT;
+
+  /* worst case is a 1-byte continuation header per byte of body */
+  stream = malloc(NMSG * (12 + 2 * 10000L));
+  len = buildStream(stream, chunkSize);
+
+  best = 0;
+  for (i = 0; i < RUNS; i++)
+    if ((mbs = readRun(stream, len, chunkSize)) > best)
+      best = mbs;
+  printf("read,  %d-byte chunks: %.1f MB/s\n", chunkSize, best);
+
+  best = 0;
+  for (i = 0; i < RUNS; i++)
+    if ((mbs = writeRun(msgSize)) > best)
+      best = mbs;
+  printf("write, %d-byte msgs: %.1f MB/s\n", msgSize, best);
+
+  free(stream);
+  return 0;
+}
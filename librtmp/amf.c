@@ -25,14 +25,57 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "amf.h"
 #include "log.h"
 #include "bytes.h"
 
 static const AMFObjectProperty AMFProp_Invalid = { {0, 0}, AMF_INVALID };
+
+/* a number array seen as an object has o_num 0, so nothing else of the
+ * object is read; p_array must also fit in what p_object takes up */
+#define AMF_STATIC_ASSERT(name, cond)	typedef char name[(cond) ? 1 : -1]
+AMF_STATIC_ASSERT(amf_array_num,
+		  offsetof(AMFObjectProperty, p_vu.p_array.a_zero) ==
+		  offsetof(AMFObjectProperty, p_vu.p_object.o_num));
+AMF_STATIC_ASSERT(amf_array_size,
+		  sizeof(((AMFObjectProperty *) 0)->p_vu.p_array) <=
+		  sizeof(AMFObject));
 static const AVal AV_empty = { 0, 0 };
 
+static int DecodeProp(AMFObjectProperty * prop, const char *pBuffer,
+		      int nSize, int bDecodeName, AMFArena * arena);
+static int DecodeObject(AMFObject * obj, const char *pBuffer, int nSize,
+			bool bDecodeName, AMFArena * arena);
+static int DecodeArray(AMFObject * obj, const char *pBuffer, int nSize,
+		       int nArrayLen, bool bDecodeName, AMFArena * arena);
+static int DecodeAMF3Prop(AMFObjectProperty * prop, const char *pBuffer,
+			  int nSize, int bDecodeName, AMFArena * arena);
+static int DecodeAMF3Object(AMFObject * obj, const char *pBuffer, int nSize,
+			    bool bAMFData, AMFArena * arena);
+static void AddProp(AMFObject * obj, const AMFObjectProperty * prop,
+		    AMFArena * arena);
+static void *ArenaAlloc(AMFArena * arena, int size);
+
+#define AMF_INDEX_MIN	16	/* smaller objects are searched linearly */
+
+/* Name index: open addressing over the property names, a slot holds the
+ * property number + 1 and 0 when empty. The header is made by the
+ * decoder, the table only on the first lookup by name. AMF_AddProp marks
+ * it dirty by setting i_num to -1, and it is rebuilt on the next lookup,
+ * as it is when o_num was changed by hand.
+ */
+typedef struct AMFIndex
+{
+  AMFArena *i_arena;
+  int i_num;
+  int i_size;
+  int *i_slots;
+} AMFIndex;
+
+static AMFIndex *NewIndex(AMFArena * arena);
+
 /* Data is Big-Endian */
 unsigned short
 AMF_DecodeInt16(const char *data)
@@ -170,8 +213,7 @@ AMF_EncodeInt32(char *output, char *outend, int nVal)
 char *
 AMF_EncodeString(char *output, char *outend, const AVal * bv)
 {
-  if ((bv->av_len < 65536 && output + 1 + 2 + bv->av_len > outend) ||
-	output + 1 + 4 + bv->av_len > outend)
+  if (output + AMF_STRING_SIZE(bv->av_len) > outend)
     return NULL;
 
   if (bv->av_len < 65536)
@@ -347,6 +389,19 @@ AMFProp_GetObject(AMFObjectProperty * prop, AMFObject * obj)
   *obj = prop->p_vu.p_object;
 }
 
+/* the values of a strict array of numbers, NULL for anything else */
+double *
+AMFProp_GetNumberArray(AMFObjectProperty * prop, int *count)
+{
+  if (prop->p_type != AMF_STRICT_ARRAY)
+    {
+      *count = 0;
+      return NULL;
+    }
+  *count = prop->p_vu.p_array.a_num;
+  return prop->p_vu.p_array.a_vals;
+}
+
 int
 AMFProp_IsValid(AMFObjectProperty * prop)
 {
@@ -359,7 +414,7 @@ AMFProp_Encode(AMFObjectProperty * prop, char *pBuffer, char *pBufEnd)
   if (prop->p_type == AMF_INVALID)
     return NULL;
 
-  if (prop->p_type != AMF_NULL && pBuffer + prop->p_name.av_len + 2 + 1 >= pBufEnd)
+  if (prop->p_type != AMF_NULL && pBuffer + prop->p_name.av_len + 2 + 1 > pBufEnd)
     return NULL;
 
   if (prop->p_type != AMF_NULL && prop->p_name.av_len)
@@ -385,7 +440,7 @@ AMFProp_Encode(AMFObjectProperty * prop, char *pBuffer, char *pBufEnd)
       break;
 
     case AMF_NULL:
-      if (pBuffer+1 >= pBufEnd)
+      if (pBuffer+1 > pBufEnd)
         return NULL;
       *pBuffer++ = AMF_NULL;
       break;
@@ -394,6 +449,19 @@ AMFProp_Encode(AMFObjectProperty * prop, char *pBuffer, char *pBufEnd)
       pBuffer = AMF_Encode(&prop->p_vu.p_object, pBuffer, pBufEnd);
       break;
 
+    case AMF_STRICT_ARRAY:
+      {
+	int i;
+	if (pBuffer + 5 + prop->p_vu.p_array.a_num * 9 > pBufEnd)
+	  return NULL;
+	*pBuffer++ = AMF_STRICT_ARRAY;
+	pBuffer = AMF_EncodeInt32(pBuffer, pBufEnd, prop->p_vu.p_array.a_num);
+	for (i = 0; i < prop->p_vu.p_array.a_num; i++)
+	  pBuffer = AMF_EncodeNumber(pBuffer, pBufEnd,
+				     prop->p_vu.p_array.a_vals[i]);
+	break;
+      }
+
     default:
       Log(LOGERROR, "%s, invalid type. %d", __FUNCTION__, prop->p_type);
       pBuffer = NULL;
@@ -402,6 +470,35 @@ AMFProp_Encode(AMFObjectProperty * prop, char *pBuffer, char *pBufEnd)
   return pBuffer;
 }
 
+/* exactly what AMFProp_Encode writes, -1 for types it can't encode */
+int
+AMFProp_EncodedSize(AMFObjectProperty * prop)
+{
+  int n = 0, size;
+
+  if (prop->p_type != AMF_NULL && prop->p_name.av_len)
+    n = 2 + prop->p_name.av_len;
+
+  switch (prop->p_type)
+    {
+    case AMF_NUMBER:
+      return n + AMF_NUMBER_SIZE;
+    case AMF_BOOLEAN:
+      return n + AMF_BOOLEAN_SIZE;
+    case AMF_STRING:
+      return n + AMF_STRING_SIZE(prop->p_vu.p_aval.av_len);
+    case AMF_NULL:
+      return 1;
+    case AMF_OBJECT:
+      size = AMF_EncodedSize(&prop->p_vu.p_object);
+      return size < 0 ? -1 : n + size;
+    case AMF_STRICT_ARRAY:
+      return n + 5 + prop->p_vu.p_array.a_num * AMF_NUMBER_SIZE;
+    default:
+      return -1;
+    }
+}
+
 #define AMF3_INTEGER_MAX	268435455
 #define AMF3_INTEGER_MIN	-268435456
 
@@ -474,9 +571,9 @@ AMF3ReadString(const char *data, AVal * str)
   return len;
 }
 
-int
-AMF3Prop_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
-		int bDecodeName)
+static int
+DecodeAMF3Prop(AMFObjectProperty * prop, const char *pBuffer, int nSize,
+	       int bDecodeName, AMFArena * arena)
 {
   int nOriginalSize = nSize;
   AMF3DataType type;
@@ -573,7 +670,8 @@ AMF3Prop_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
       }
     case AMF3_OBJECT:
       {
-	int nRes = AMF3_Decode(&prop->p_vu.p_object, pBuffer, nSize, true);
+	int nRes = DecodeAMF3Object(&prop->p_vu.p_object, pBuffer, nSize, true,
+				    arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -592,8 +690,52 @@ AMF3Prop_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
 }
 
 int
-AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
-	       int bDecodeName)
+AMF3Prop_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
+		int bDecodeName)
+{
+  return DecodeAMF3Prop(prop, pBuffer, nSize, bDecodeName, NULL);
+}
+
+/* Keyframe indexes are strict arrays of tens of thousands of numbers.
+ * Those are kept as one double[] instead of a property per element. */
+static bool
+IsNumberArray(const char *data, int nSize, unsigned int n)
+{
+  unsigned int i;
+
+  if (!n || n > (unsigned int) nSize / 9)
+    return false;
+  for (i = 0; i < n; i++, data += 9)
+    if (*data != AMF_NUMBER)
+      return false;
+  return true;
+}
+
+static void
+DecodeNumbers(double *vals, const char *data, unsigned int n)
+{
+  unsigned int i;
+
+#if __FLOAT_WORD_ORDER == __BYTE_ORDER && \
+  (__BYTE_ORDER == __BIG_ENDIAN || defined(__GNUC__))
+  for (i = 0; i < n; i++, data += 9)
+    {
+      uint64_t v;
+      memcpy(&v, data + 1, 8);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+      v = __builtin_bswap64(v);
+#endif
+      memcpy(&vals[i], &v, 8);
+    }
+#else
+  for (i = 0; i < n; i++, data += 9)
+    vals[i] = AMF_DecodeNumber(data + 1);
+#endif
+}
+
+static int
+DecodeProp(AMFObjectProperty * prop, const char *pBuffer, int nSize,
+	   int bDecodeName, AMFArena * arena)
 {
   int nOriginalSize = nSize;
 
@@ -664,7 +806,7 @@ AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
       }
     case AMF_OBJECT:
       {
-	int nRes = AMF_Decode(&prop->p_vu.p_object, pBuffer, nSize, true);
+	int nRes = DecodeObject(&prop->p_vu.p_object, pBuffer, nSize, true, arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -692,7 +834,8 @@ AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
 	nSize -= 4;
 
 	/* next comes the rest, mixed array has a final 0x000009 mark and names, so its an object */
-	int nRes = AMF_Decode(&prop->p_vu.p_object, pBuffer + 4, nSize, true);
+	int nRes = DecodeObject(&prop->p_vu.p_object, pBuffer + 4, nSize, true,
+				arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -709,8 +852,22 @@ AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
 	unsigned int nArrayLen = AMF_DecodeInt32(pBuffer);
 	nSize -= 4;
 
-	int nRes = AMF_DecodeArray(&prop->p_vu.p_object, pBuffer + 4, nSize,
-				   nArrayLen, false);
+	if (IsNumberArray(pBuffer + 4, nSize, nArrayLen))
+	  {
+	    double *vals = arena ? ArenaAlloc(arena, nArrayLen * 8)
+	      : malloc(nArrayLen * 8);
+	    if (!vals)
+	      return -1;
+	    DecodeNumbers(vals, pBuffer + 4, nArrayLen);
+	    prop->p_vu.p_array.a_zero = 0;
+	    prop->p_vu.p_array.a_num = nArrayLen;
+	    prop->p_vu.p_array.a_vals = vals;
+	    nSize -= nArrayLen * 9;
+	    break;
+	  }
+
+	int nRes = DecodeArray(&prop->p_vu.p_object, pBuffer + 4, nSize,
+			       nArrayLen, false, arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -760,7 +917,8 @@ AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
       }
     case AMF_AVMPLUS:
       {
-	int nRes = AMF3_Decode(&prop->p_vu.p_object, pBuffer, nSize, true);
+	int nRes = DecodeAMF3Object(&prop->p_vu.p_object, pBuffer, nSize, true,
+				    arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -776,6 +934,13 @@ AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
   return nOriginalSize - nSize;
 }
 
+int
+AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer, int nSize,
+	       int bDecodeName)
+{
+  return DecodeProp(prop, pBuffer, nSize, bDecodeName, NULL);
+}
+
 void
 AMFProp_Dump(AMFObjectProperty * prop)
 {
@@ -783,6 +948,9 @@ AMFProp_Dump(AMFObjectProperty * prop)
   char str[256];
   AVal name;
 
+  if (debuglevel < LOGDEBUG)
+    return;
+
   if (prop->p_type == AMF_INVALID)
     {
       Log(LOGDEBUG, "Property: INVALID");
@@ -833,6 +1001,9 @@ AMFProp_Dump(AMFObjectProperty * prop)
       snprintf(str, 255, "DATE:\ttimestamp: %.2f, UTC offset: %d",
 	       prop->p_vu.p_number, prop->p_UTCoffset);
       break;
+    case AMF_STRICT_ARRAY:
+      snprintf(str, 255, "NUMBERS:\t%d", prop->p_vu.p_array.a_num);
+      break;
     default:
       snprintf(str, 255, "INVALID TYPE 0x%02x", (unsigned char) prop->p_type);
     }
@@ -845,6 +1016,12 @@ AMFProp_Reset(AMFObjectProperty * prop)
 {
   if (prop->p_type == AMF_OBJECT)
     AMF_Reset(&prop->p_vu.p_object);
+  else if (prop->p_type == AMF_STRICT_ARRAY)
+    {
+      free(prop->p_vu.p_array.a_vals);
+      prop->p_vu.p_array.a_vals = NULL;
+      prop->p_vu.p_array.a_num = 0;
+    }
   else
     {
       prop->p_vu.p_aval.av_len = 0;
@@ -860,27 +1037,23 @@ AMF_Encode(AMFObject * obj, char *pBuffer, char *pBufEnd)
 {
   int i;
 
-  if (pBuffer+4 >= pBufEnd)
+  if (pBuffer+4 > pBufEnd)
     return NULL;
 
   *pBuffer++ = AMF_OBJECT;
 
   for (i = 0; i < obj->o_num; i++)
     {
-      char *res = AMFProp_Encode(&obj->o_props[i], pBuffer, pBufEnd);
-      if (res == NULL)
+      pBuffer = AMFProp_Encode(&obj->o_props[i], pBuffer, pBufEnd);
+      if (pBuffer == NULL)
 	{
 	  Log(LOGERROR, "AMF_Encode - failed to encode property in index %d",
 	      i);
-	  break;
-	}
-      else
-	{
-	  pBuffer = res;
+	  return NULL;
 	}
     }
 
-  if (pBuffer + 3 >= pBufEnd)
+  if (pBuffer + 3 > pBufEnd)
     return NULL;			// no room for the end marker
 
   pBuffer = AMF_EncodeInt24(pBuffer, pBufEnd, AMF_OBJECT_END);
@@ -888,28 +1061,45 @@ AMF_Encode(AMFObject * obj, char *pBuffer, char *pBufEnd)
   return pBuffer;
 }
 
+/* exactly what AMF_Encode writes, -1 if a property can't be encoded */
 int
-AMF_DecodeArray(AMFObject * obj, const char *pBuffer, int nSize,
-		int nArrayLen, bool bDecodeName)
+AMF_EncodedSize(AMFObject * obj)
+{
+  int i, n, size = 1 + 3;	/* marker, end marker */
+
+  for (i = 0; i < obj->o_num; i++)
+    {
+      n = AMFProp_EncodedSize(&obj->o_props[i]);
+      if (n < 0)
+	return -1;
+      size += n;
+    }
+  return size;
+}
+
+static int
+DecodeArray(AMFObject * obj, const char *pBuffer, int nSize,
+	    int nArrayLen, bool bDecodeName, AMFArena * arena)
 {
   int nOriginalSize = nSize;
   bool bError = false;
 
   obj->o_num = 0;
   obj->o_props = NULL;
+  obj->o_index = NULL;
   while (nArrayLen > 0)
     {
       nArrayLen--;
 
       AMFObjectProperty prop;
-      int nRes = AMFProp_Decode(&prop, pBuffer, nSize, bDecodeName);
+      int nRes = DecodeProp(&prop, pBuffer, nSize, bDecodeName, arena);
       if (nRes == -1)
 	bError = true;
       else
 	{
 	  nSize -= nRes;
 	  pBuffer += nRes;
-	  AMF_AddProp(obj, &prop);
+	  AddProp(obj, &prop, arena);
 	}
     }
   if (bError)
@@ -919,7 +1109,15 @@ AMF_DecodeArray(AMFObject * obj, const char *pBuffer, int nSize,
 }
 
 int
-AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bAMFData)
+AMF_DecodeArray(AMFObject * obj, const char *pBuffer, int nSize,
+		int nArrayLen, bool bDecodeName)
+{
+  return DecodeArray(obj, pBuffer, nSize, nArrayLen, bDecodeName, NULL);
+}
+
+static int
+DecodeAMF3Object(AMFObject * obj, const char *pBuffer, int nSize,
+		 bool bAMFData, AMFArena * arena)
 {
   int nOriginalSize = nSize;
   int32_t ref;
@@ -927,6 +1125,7 @@ AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bAMFData)
 
   obj->o_num = 0;
   obj->o_props = NULL;
+  obj->o_index = NULL;
   if (bAMFData)
     {
       if (*pBuffer != AMF3_OBJECT)
@@ -1003,7 +1202,7 @@ AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bAMFData)
 
 	  Log(LOGDEBUG, "Externalizable, TODO check");
 
-	  nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, false);
+	  nRes = DecodeAMF3Prop(&prop, pBuffer, nSize, false, arena);
 	  if (nRes == -1)
 	    Log(LOGDEBUG, "%s, failed to decode AMF3 property!",
 		__FUNCTION__);
@@ -1014,20 +1213,20 @@ AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bAMFData)
 	    }
 
 	  AMFProp_SetName(&prop, &name);
-	  AMF_AddProp(obj, &prop);
+	  AddProp(obj, &prop, arena);
 	}
       else
 	{
 	  int nRes, i;
 	  for (i = 0; i < cd.cd_num; i++)	/* non-dynamic */
 	    {
-	      nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, false);
+	      nRes = DecodeAMF3Prop(&prop, pBuffer, nSize, false, arena);
 	      if (nRes == -1)
 		Log(LOGDEBUG, "%s, failed to decode AMF3 property!",
 		    __FUNCTION__);
 
 	      AMFProp_SetName(&prop, AMF3CD_GetProp(&cd, i));
-	      AMF_AddProp(obj, &prop);
+	      AddProp(obj, &prop, arena);
 
 	      pBuffer += nRes;
 	      nSize -= nRes;
@@ -1038,8 +1237,8 @@ AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bAMFData)
 
 	      do
 		{
-		  nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, true);
-		  AMF_AddProp(obj, &prop);
+		  nRes = DecodeAMF3Prop(&prop, pBuffer, nSize, true, arena);
+		  AddProp(obj, &prop, arena);
 
 		  pBuffer += nRes;
 		  nSize -= nRes;
@@ -1050,18 +1249,27 @@ AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bAMFData)
 	    }
 	}
       Log(LOGDEBUG, "class object!");
+      free(cd.cd_props);
     }
   return nOriginalSize - nSize;
 }
 
 int
-AMF_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bDecodeName)
+AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bAMFData)
+{
+  return DecodeAMF3Object(obj, pBuffer, nSize, bAMFData, NULL);
+}
+
+static int
+DecodeObject(AMFObject * obj, const char *pBuffer, int nSize,
+	     bool bDecodeName, AMFArena * arena)
 {
   int nOriginalSize = nSize;
   bool bError = false;		/* if there is an error while decoding - try to at least find the end mark AMF_OBJECT_END */
 
   obj->o_num = 0;
   obj->o_props = NULL;
+  obj->o_index = NULL;
   while (nSize > 0)
     {
       AMFObjectProperty prop;
@@ -1083,38 +1291,253 @@ AMF_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bDecodeName)
 	  continue;
 	}
 
-      nRes = AMFProp_Decode(&prop, pBuffer, nSize, bDecodeName);
+      nRes = DecodeProp(&prop, pBuffer, nSize, bDecodeName, arena);
       if (nRes == -1)
 	bError = true;
       else
 	{
 	  nSize -= nRes;
 	  pBuffer += nRes;
-	  AMF_AddProp(obj, &prop);
+	  AddProp(obj, &prop, arena);
 	}
     }
 
   if (bError)
     return -1;
 
+  if (obj->o_num >= AMF_INDEX_MIN)
+    obj->o_index = NewIndex(arena);
+
   return nOriginalSize - nSize;
 }
 
+int
+AMF_Decode(AMFObject * obj, const char *pBuffer, int nSize, bool bDecodeName)
+{
+  return DecodeObject(obj, pBuffer, nSize, bDecodeName, NULL);
+}
+
+int
+AMF_DecodeArena(AMFObject * obj, const char *pBuffer, int nSize,
+		bool bDecodeName, AMFArena * arena)
+{
+  return DecodeObject(obj, pBuffer, nSize, bDecodeName, arena);
+}
+
 void
 AMF_AddProp(AMFObject * obj, const AMFObjectProperty * prop)
 {
+  if (obj->o_index)
+    obj->o_index->i_num = -1;
   if (!(obj->o_num & 0x0f))
     obj->o_props =
       realloc(obj->o_props, (obj->o_num + 16) * sizeof(AMFObjectProperty));
   obj->o_props[obj->o_num++] = *prop;
 }
 
+/* AMFArena */
+
+typedef struct AMFArenaBlock
+{
+  struct AMFArenaBlock *b_next;
+  size_t b_size;
+} AMFArenaBlock;
+
+#define ARENA_ALIGN(n)	(((n) + 7) & ~7)
+
+void
+AMFArena_Init(AMFArena * arena, char *buf, int size)
+{
+  arena->a_first = arena->a_buf = buf;
+  arena->a_firstsize = arena->a_size = buf ? size : 0;
+  arena->a_used = 0;
+  arena->a_blocks = NULL;
+}
+
+void
+AMFArena_Reset(AMFArena * arena)
+{
+  AMFArena_Free(arena);
+  arena->a_buf = arena->a_first;
+  arena->a_size = arena->a_firstsize;
+}
+
+void
+AMFArena_Free(AMFArena * arena)
+{
+  AMFArenaBlock *b, *next;
+  for (b = arena->a_blocks; b; b = next)
+    {
+      next = b->b_next;
+      free(b);
+    }
+  arena->a_blocks = NULL;
+  arena->a_buf = NULL;
+  arena->a_size = arena->a_used = 0;
+}
+
+static void *
+ArenaAlloc(AMFArena * arena, int size)
+{
+  char *ptr;
+
+  size = ARENA_ALIGN(size);
+  if (arena->a_used + size > arena->a_size)
+    {
+      /* each new block at least doubles what we have, a large
+       * metadata object only costs a few mallocs */
+      size_t bsize = arena->a_size * 2;
+      AMFArenaBlock *b;
+
+      if (bsize < 4096)
+	bsize = 4096;
+      if (bsize < (size_t) size)
+	bsize = size;
+      b = malloc(ARENA_ALIGN(sizeof(AMFArenaBlock)) + bsize);
+      if (!b)
+	return NULL;
+      b->b_size = bsize;
+      b->b_next = arena->a_blocks;
+      arena->a_blocks = b;
+      arena->a_buf = (char *) b + ARENA_ALIGN(sizeof(AMFArenaBlock));
+      arena->a_size = bsize;
+      arena->a_used = 0;
+    }
+  ptr = arena->a_buf + arena->a_used;
+  arena->a_used += size;
+  return ptr;
+}
+
+/* like realloc: extends ptr in place when it was the last allocation */
+static void *
+ArenaGrow(AMFArena * arena, void *ptr, int oldsize, int size)
+{
+  char *top = arena->a_buf + arena->a_used;
+  void *res;
+
+  if (ptr && (char *) ptr + ARENA_ALIGN(oldsize) == top
+      && (char *) ptr - arena->a_buf + ARENA_ALIGN(size) <= arena->a_size)
+    {
+      arena->a_used = (char *) ptr - arena->a_buf + ARENA_ALIGN(size);
+      return ptr;
+    }
+  res = ArenaAlloc(arena, size);
+  if (res && ptr)
+    memcpy(res, ptr, oldsize);
+  return res;
+}
+
+static void
+AddProp(AMFObject * obj, const AMFObjectProperty * prop, AMFArena * arena)
+{
+  int n = obj->o_num;
+
+  if (!arena)
+    {
+      AMF_AddProp(obj, prop);
+      return;
+    }
+  /* capacity doubles from 16, so it's full at 16, 32, 64, ... */
+  if (!n || (n >= 16 && !(n & (n - 1))))
+    {
+      AMFObjectProperty *props = ArenaGrow(arena, obj->o_props,
+					   n * sizeof(AMFObjectProperty),
+					   (n ? n * 2 : 16) *
+					   sizeof(AMFObjectProperty));
+      if (!props)
+	return;
+      obj->o_props = props;
+    }
+  obj->o_props[obj->o_num++] = *prop;
+}
+
 int
 AMF_CountProp(AMFObject * obj)
 {
   return obj->o_num;
 }
 
+static AMFIndex *
+NewIndex(AMFArena * arena)
+{
+  AMFIndex *idx = arena ? ArenaAlloc(arena, sizeof(AMFIndex))
+    : malloc(sizeof(AMFIndex));
+  if (idx)
+    {
+      idx->i_arena = arena;
+      idx->i_num = idx->i_size = 0;
+      idx->i_slots = NULL;
+    }
+  return idx;
+}
+
+static unsigned int
+HashName(const AVal * name)
+{
+  unsigned int h = 2166136261U;
+  int i;
+  for (i = 0; i < name->av_len; i++)
+    h = (h ^ (unsigned char) name->av_val[i]) * 16777619U;
+  return h;
+}
+
+static bool
+BuildIndex(AMFIndex * idx, AMFObject * obj)
+{
+  int size = 32, n;
+
+  while (size < obj->o_num * 2)
+    size *= 2;
+  if (!idx->i_arena)
+    free(idx->i_slots);
+  idx->i_slots = idx->i_arena ? ArenaAlloc(idx->i_arena, size * sizeof(int))
+    : malloc(size * sizeof(int));
+  if (!idx->i_slots)
+    {
+      idx->i_num = idx->i_size = 0;
+      return false;
+    }
+  memset(idx->i_slots, 0, size * sizeof(int));
+  idx->i_size = size;
+  idx->i_num = obj->o_num;
+
+  for (n = 0; n < obj->o_num; n++)
+    {
+      AVal *name = &obj->o_props[n].p_name;
+      unsigned int h = HashName(name) & (size - 1);
+      int *slot;
+      /* keep the first of duplicate names, as the linear search does */
+      while (*(slot = &idx->i_slots[h]))
+	{
+	  if (AVMATCH(&obj->o_props[*slot - 1].p_name, name))
+	    break;
+	  h = (h + 1) & (size - 1);
+	}
+      if (!*slot)
+	*slot = n + 1;
+    }
+  return true;
+}
+
+static AMFObjectProperty *
+IndexLookup(AMFObject * obj, const AVal * name)
+{
+  AMFIndex *idx = obj->o_index;
+  unsigned int h;
+  int *slot;
+
+  if (idx->i_num != obj->o_num && !BuildIndex(idx, obj))
+    return NULL;
+  h = HashName(name) & (idx->i_size - 1);
+  while (*(slot = &idx->i_slots[h]))
+    {
+      if (AVMATCH(&obj->o_props[*slot - 1].p_name, name))
+	return &obj->o_props[*slot - 1];
+      h = (h + 1) & (idx->i_size - 1);
+    }
+  return (AMFObjectProperty *) & AMFProp_Invalid;
+}
+
 AMFObjectProperty *
 AMF_GetProp(AMFObject * obj, const AVal * name, int nIndex)
 {
@@ -1126,6 +1549,12 @@ AMF_GetProp(AMFObject * obj, const AVal * name, int nIndex)
   else
     {
       int n;
+      if (obj->o_num >= AMF_INDEX_MIN && obj->o_index)
+	{
+	  AMFObjectProperty *prop = IndexLookup(obj, name);
+	  if (prop)
+	    return prop;
+	}
       for (n = 0; n < obj->o_num; n++)
 	{
 	  if (AVMATCH(&obj->o_props[n].p_name, name))
@@ -1140,6 +1569,8 @@ void
 AMF_Dump(AMFObject * obj)
 {
   int n;
+  if (debuglevel < LOGDEBUG)
+    return;
   Log(LOGDEBUG, "(object begin)");
   for (n = 0; n < obj->o_num; n++)
     {
@@ -1157,10 +1588,568 @@ AMF_Reset(AMFObject * obj)
       AMFProp_Reset(&obj->o_props[n]);
     }
   free(obj->o_props);
+  if (obj->o_index && !obj->o_index->i_arena)
+    {
+      free(obj->o_index->i_slots);
+      free(obj->o_index);
+    }
   obj->o_props = NULL;
+  obj->o_index = NULL;
   obj->o_num = 0;
 }
 
+/* AMFCursor */
+
+#define AMF_MAX_DEPTH	64
+
+static const char *SkipValue(const char *p, const char *end, int depth);
+static const char *SkipAMF3(const char *p, const char *end, int depth);
+
+/* bounds checked U29, returns the bytes used or 0 if truncated */
+static int
+ReadU29(const char *p, const char *end, uint32_t * val)
+{
+  uint32_t v = 0;
+  int i;
+
+  for (i = 0; i < 4 && p + i < end; i++)
+    {
+      unsigned char b = p[i];
+      if (i == 3)
+	{
+	  *val = (v << 8) | b;
+	  return 4;
+	}
+      v = (v << 7) | (b & 0x7f);
+      if (!(b & 0x80))
+	{
+	  *val = v;
+	  return i + 1;
+	}
+    }
+  return 0;
+}
+
+static const char *
+SkipAMF3String(const char *p, const char *end)
+{
+  uint32_t ref;
+  int n = ReadU29(p, end, &ref);
+
+  if (!n)
+    return NULL;
+  p += n;
+  if (ref & 1)
+    {
+      if ((uint32_t) (end - p) < (ref >> 1))
+	return NULL;
+      p += ref >> 1;
+    }
+  return p;
+}
+
+/* skips string keyed members up to the empty key */
+static const char *
+SkipAMF3Dynamic(const char *p, const char *end, int depth)
+{
+  uint32_t ref;
+  int n;
+
+  for (;;)
+    {
+      n = ReadU29(p, end, &ref);
+      if (!n)
+	return NULL;
+      if (ref == 1)
+	return p + n;
+      p = SkipAMF3String(p, end);
+      if (p)
+	p = SkipAMF3(p, end, depth);
+      if (!p)
+	return NULL;
+    }
+}
+
+static const char *
+SkipAMF3(const char *p, const char *end, int depth)
+{
+  uint32_t ref, i;
+  int n;
+
+  if (p >= end || depth > AMF_MAX_DEPTH)
+    return NULL;
+  switch (*p++)
+    {
+    case AMF3_UNDEFINED:
+    case AMF3_NULL:
+    case AMF3_FALSE:
+    case AMF3_TRUE:
+      return p;
+    case AMF3_INTEGER:
+      n = ReadU29(p, end, &ref);
+      return n ? p + n : NULL;
+    case AMF3_DOUBLE:
+      return end - p >= 8 ? p + 8 : NULL;
+    case AMF3_STRING:
+    case AMF3_XML_DOC:
+    case AMF3_XML:
+    case AMF3_BYTE_ARRAY:
+      return SkipAMF3String(p, end);
+    case AMF3_DATE:
+      n = ReadU29(p, end, &ref);
+      if (!n)
+	return NULL;
+      p += n;
+      if (ref & 1)
+	p = end - p >= 8 ? p + 8 : NULL;
+      return p;
+    case AMF3_ARRAY:
+      n = ReadU29(p, end, &ref);
+      if (!n)
+	return NULL;
+      p += n;
+      if (!(ref & 1))
+	return p;
+      p = SkipAMF3Dynamic(p, end, depth + 1);
+      for (i = ref >> 1; p && i; i--)
+	p = SkipAMF3(p, end, depth + 1);
+      return p;
+    case AMF3_OBJECT:
+      n = ReadU29(p, end, &ref);
+      if (!n)
+	return NULL;
+      p += n;
+      if (!(ref & 1))
+	return p;
+      /* trait references and externalizable classes can't be sized
+       * without the stream's state */
+      if (!(ref & 2) || (ref & 4))
+	return NULL;
+      p = SkipAMF3String(p, end);
+      for (i = ref >> 4; p && i; i--)
+	p = SkipAMF3String(p, end);
+      for (i = ref >> 4; p && i; i--)
+	p = SkipAMF3(p, end, depth + 1);
+      if (p && (ref & 8))
+	p = SkipAMF3Dynamic(p, end, depth + 1);
+      return p;
+    }
+  return NULL;
+}
+
+/* skips named members up to the object end marker */
+static const char *
+SkipProps(const char *p, const char *end, int depth)
+{
+  for (;;)
+    {
+      unsigned int len;
+
+      if (end - p < 3)
+	return NULL;
+      len = AMF_DecodeInt16(p);
+      if (!len && p[2] == AMF_OBJECT_END)
+	return p + 3;
+      if ((unsigned int) (end - p) <= len + 2)
+	return NULL;
+      p = SkipValue(p + 2 + len, end, depth);
+      if (!p)
+	return NULL;
+    }
+}
+
+static const char *
+SkipValue(const char *p, const char *end, int depth)
+{
+  unsigned int len, n;
+
+  if (p >= end || depth > AMF_MAX_DEPTH)
+    return NULL;
+  switch (*p++)
+    {
+    case AMF_NUMBER:
+      len = 8;
+      break;
+    case AMF_BOOLEAN:
+      len = 1;
+      break;
+    case AMF_STRING:
+      if (end - p < 2)
+	return NULL;
+      len = 2 + AMF_DecodeInt16(p);
+      break;
+    case AMF_NULL:
+    case AMF_UNDEFINED:
+    case AMF_UNSUPPORTED:
+      len = 0;
+      break;
+    case AMF_REFERENCE:
+      len = 2;
+      break;
+    case AMF_DATE:
+      len = 10;
+      break;
+    case AMF_LONG_STRING:
+    case AMF_XML_DOC:
+      if (end - p < 4)
+	return NULL;
+      len = AMF_DecodeInt32(p);
+      if (len > (unsigned int) (end - p) - 4)
+	return NULL;
+      return p + 4 + len;
+    case AMF_ECMA_ARRAY:
+      if (end - p < 4)
+	return NULL;
+      return SkipProps(p + 4, end, depth + 1);
+    case AMF_OBJECT:
+      return SkipProps(p, end, depth + 1);
+    case AMF_TYPED_OBJECT:
+      if (end - p < 2)
+	return NULL;
+      len = 2 + AMF_DecodeInt16(p);
+      if ((unsigned int) (end - p) < len)
+	return NULL;
+      return SkipProps(p + len, end, depth + 1);
+    case AMF_STRICT_ARRAY:
+      if (end - p < 4)
+	return NULL;
+      n = AMF_DecodeInt32(p);
+      p += 4;
+      /* every element takes at least a byte, so n is bounded by end */
+      while (p && n--)
+	p = SkipValue(p, end, depth + 1);
+      return p;
+    case AMF_AVMPLUS:
+      return SkipAMF3(p, end, depth + 1);
+    default:
+      return NULL;
+    }
+  if ((unsigned int) (end - p) < len)
+    return NULL;
+  return p + len;
+}
+
+/* a cursor over the top level values of a packet */
+void
+AMFCursor_Init(AMFCursor * cur, const char *pBuffer, int nSize)
+{
+  cur->c_ptr = pBuffer;
+  cur->c_end = pBuffer + (nSize > 0 ? nSize : 0);
+  cur->c_named = false;
+  cur->c_left = -1;
+}
+
+AMFDataType
+AMFCursor_Type(AMFCursor * cur)
+{
+  if (cur->c_ptr >= cur->c_end)
+    return AMF_INVALID;
+  return (unsigned char) *cur->c_ptr;
+}
+
+/* 1 on a member, 0 at the end, -1 if the buffer is malformed */
+static int
+CursorStep(AMFCursor * cur, AVal * name)
+{
+  if (name)
+    *name = AV_empty;
+  if (cur->c_named)
+    {
+      const char *p = cur->c_ptr;
+      unsigned int len;
+
+      if (cur->c_end - p < 3)
+	return -1;
+      len = AMF_DecodeInt16(p);
+      if (!len && p[2] == AMF_OBJECT_END)
+	{
+	  cur->c_ptr = cur->c_end = p + 3;
+	  return 0;
+	}
+      if ((unsigned int) (cur->c_end - p) <= len + 2)
+	return -1;
+      if (name)
+	{
+	  name->av_val = (char *) p + 2;
+	  name->av_len = len;
+	}
+      cur->c_ptr = p + 2 + len;
+      return 1;
+    }
+  if (cur->c_left >= 0)
+    {
+      if (!cur->c_left)
+	return 0;
+      cur->c_left--;
+      return cur->c_ptr < cur->c_end ? 1 : -1;
+    }
+  return cur->c_ptr < cur->c_end;
+}
+
+/* moves onto the next member, false at the end. Members of arrays
+ * and top level values have an empty name. */
+bool
+AMFCursor_Next(AMFCursor * cur, AVal * name)
+{
+  return CursorStep(cur, name) > 0;
+}
+
+bool
+AMFCursor_Skip(AMFCursor * cur)
+{
+  const char *p = SkipValue(cur->c_ptr, cur->c_end, 0);
+
+  if (!p)
+    return false;
+  cur->c_ptr = p;
+  return true;
+}
+
+/* numbers, booleans and dates; the cursor stays put on other types */
+bool
+AMFCursor_Number(AMFCursor * cur, double *val)
+{
+  const char *p = cur->c_ptr;
+  int left = cur->c_end - p;
+  uint32_t u;
+  int n;
+
+  if (left < 1)
+    return false;
+  switch (*p)
+    {
+    case AMF_NUMBER:
+      if (left < 9)
+	return false;
+      *val = AMF_DecodeNumber(p + 1);
+      cur->c_ptr = p + 9;
+      return true;
+    case AMF_BOOLEAN:
+      if (left < 2)
+	return false;
+      *val = p[1] != 0;
+      cur->c_ptr = p + 2;
+      return true;
+    case AMF_DATE:
+      if (left < 11)
+	return false;
+      *val = AMF_DecodeNumber(p + 1);
+      cur->c_ptr = p + 11;
+      return true;
+    case AMF_AVMPLUS:
+      if (left < 2)
+	return false;
+      switch (p[1])
+	{
+	case AMF3_FALSE:
+	case AMF3_TRUE:
+	  *val = p[1] == AMF3_TRUE;
+	  cur->c_ptr = p + 2;
+	  return true;
+	case AMF3_INTEGER:
+	  n = ReadU29(p + 2, cur->c_end, &u);
+	  if (!n)
+	    return false;
+	  *val = (int32_t) (u << 3) >> 3;
+	  cur->c_ptr = p + 2 + n;
+	  return true;
+	case AMF3_DOUBLE:
+	  if (left < 10)
+	    return false;
+	  *val = AMF_DecodeNumber(p + 2);
+	  cur->c_ptr = p + 10;
+	  return true;
+	}
+      break;
+    }
+  return false;
+}
+
+/* short, long and inline AMF3 strings; the cursor stays put otherwise */
+bool
+AMFCursor_String(AMFCursor * cur, AVal * str)
+{
+  const char *p = cur->c_ptr;
+  int left = cur->c_end - p;
+  uint32_t len;
+  int n;
+
+  if (left < 1)
+    return false;
+  switch (*p)
+    {
+    case AMF_STRING:
+      if (left < 3 || left - 3 < AMF_DecodeInt16(p + 1))
+	return false;
+      AMF_DecodeString(p + 1, str);
+      cur->c_ptr = p + 3 + str->av_len;
+      return true;
+    case AMF_LONG_STRING:
+      if (left < 5 || (uint32_t) (left - 5) < AMF_DecodeInt32(p + 1))
+	return false;
+      AMF_DecodeLongString(p + 1, str);
+      cur->c_ptr = p + 5 + str->av_len;
+      return true;
+    case AMF_AVMPLUS:
+      if (left < 2 || p[1] != AMF3_STRING)
+	return false;
+      n = ReadU29(p + 2, cur->c_end, &len);
+      if (!n || !(len & 1)
+	  || (uint32_t) (cur->c_end - p - 2 - n) < (len >> 1))
+	return false;
+      str->av_val = (char *) p + 2 + n;
+      str->av_len = len >> 1;
+      cur->c_ptr = str->av_val + str->av_len;
+      return true;
+    }
+  return false;
+}
+
+/* points inner at the members of the container at cur, unchecked */
+static bool
+CursorOpen(AMFCursor * cur, AMFCursor * inner)
+{
+  const char *p = cur->c_ptr;
+  int left = cur->c_end - p;
+
+  if (left < 1)
+    return false;
+  inner->c_end = cur->c_end;
+  inner->c_named = true;
+  inner->c_left = -1;
+  switch (*p)
+    {
+    case AMF_OBJECT:
+      inner->c_ptr = p + 1;
+      return true;
+    case AMF_ECMA_ARRAY:
+      if (left < 5)
+	return false;
+      inner->c_ptr = p + 5;
+      return true;
+    case AMF_TYPED_OBJECT:
+      if (left < 3 || left - 3 < AMF_DecodeInt16(p + 1))
+	return false;
+      inner->c_ptr = p + 3 + AMF_DecodeInt16(p + 1);
+      return true;
+    case AMF_STRICT_ARRAY:
+      if (left < 5)
+	return false;
+      inner->c_ptr = p + 5;
+      inner->c_named = false;
+      inner->c_left = AMF_DecodeInt32(p + 1) & 0x7fffffff;
+      return true;
+    }
+  return false;
+}
+
+/* steps into an object, ECMA array or strict array and past it */
+bool
+AMFCursor_Enter(AMFCursor * cur, AMFCursor * inner)
+{
+  const char *next;
+
+  if (!CursorOpen(cur, inner))
+    return false;
+  next = SkipValue(cur->c_ptr, cur->c_end, 0);
+  if (!next)
+    return false;
+  inner->c_end = next;
+  cur->c_ptr = next;
+  return true;
+}
+
+/* the nIndex'th of the remaining members, cur is left alone */
+bool
+AMFCursor_Get(AMFCursor * cur, int nIndex, AMFCursor * val)
+{
+  AMFCursor c = *cur;
+
+  for (;;)
+    {
+      if (!AMFCursor_Next(&c, NULL))
+	return false;
+      if (!nIndex--)
+	break;
+      if (!AMFCursor_Skip(&c))
+	return false;
+    }
+  AMFCursor_Init(val, c.c_ptr, c.c_end - c.c_ptr);
+  return true;
+}
+
+/* follows a dotted path like "info.code" from the object at cur */
+bool
+AMFCursor_Find(AMFCursor * cur, const char *path, AMFCursor * val)
+{
+  AMFCursor c = *cur, obj;
+  AVal name;
+
+  for (;;)
+    {
+      const char *dot = strchr(path, '.');
+      int len = dot ? dot - path : (int) strlen(path);
+
+      if (!AMFCursor_Enter(&c, &obj))
+	return false;
+      for (;;)
+	{
+	  if (!AMFCursor_Next(&obj, &name))
+	    return false;
+	  if (name.av_len == len && !memcmp(name.av_val, path, len))
+	    break;
+	  if (!AMFCursor_Skip(&obj))
+	    return false;
+	}
+      AMFCursor_Init(&c, obj.c_ptr, obj.c_end - obj.c_ptr);
+      if (!dot)
+	break;
+      path = dot + 1;
+    }
+  *val = c;
+  return true;
+}
+
+/* a single pass, containers are walked in place rather than skipped
+ * first. 1 if found, 0 if not, -1 on a malformed buffer. */
+static int
+SearchMembers(AMFCursor * cur, const AVal * name, AMFCursor * val,
+	      int depth)
+{
+  AMFCursor inner;
+  AVal n;
+  int rc;
+
+  if (depth > AMF_MAX_DEPTH)
+    return -1;
+  while ((rc = CursorStep(cur, &n)) > 0)
+    {
+      if (n.av_len && AVMATCH(&n, name))
+	{
+	  AMFCursor_Init(val, cur->c_ptr, cur->c_end - cur->c_ptr);
+	  return 1;
+	}
+      if (CursorOpen(cur, &inner))
+	{
+	  rc = SearchMembers(&inner, name, val, depth + 1);
+	  if (rc)
+	    return rc;
+	  cur->c_ptr = inner.c_ptr;
+	}
+      else if (!AMFCursor_Skip(cur))
+	return -1;
+    }
+  return rc;
+}
+
+/* first member called name among the remaining values, depth first */
+bool
+AMFCursor_Search(AMFCursor * cur, const AVal * name, AMFCursor * val)
+{
+  AMFCursor c = *cur;
+  return SearchMembers(&c, name, val, 0) > 0;
+}
+
 
 /* AMF3ClassDefinition */
 
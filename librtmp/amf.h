@@ -64,11 +64,18 @@ extern "C"
 #define	false	0
 
   struct AMFObjectProperty;
+  struct AMFIndex;
 
+  /* o_index is set by the decoder on objects with many properties, it
+   * makes AMF_GetProp by name a hash lookup. Objects built by hand must
+   * leave it NULL. Add properties to a decoded object with AMF_AddProp,
+   * which keeps the index in step; don't rename or replace them in place.
+   */
   typedef struct AMFObject
   {
     int o_num;
     struct AMFObjectProperty *o_props;
+    struct AMFIndex *o_index;
   } AMFObject;
 
   typedef struct AMFObjectProperty
@@ -80,6 +87,12 @@ extern "C"
       double p_number;
       AVal p_aval;
       AMFObject p_object;
+      struct
+      {
+	int a_zero;		/* overlays o_num, reads as an empty object */
+	int a_num;
+	double *a_vals;
+      } p_array;		/* AMF_STRICT_ARRAY, all numbers */
     } p_vu;
     int16_t p_UTCoffset;
   } AMFObjectProperty;
@@ -104,9 +117,35 @@ extern "C"
   bool AMF_DecodeBoolean(const char *data);
   double AMF_DecodeNumber(const char *data);
 
+  /* Bump allocator for decoding. Objects decoded into an arena are freed
+   * all at once by AMFArena_Reset or AMFArena_Free, never by AMF_Reset.
+   * buf is an optional first block owned by the caller, e.g. on the stack.
+   */
+  typedef struct AMFArena
+  {
+    char *a_buf;
+    int a_size;
+    int a_used;
+    char *a_first;
+    int a_firstsize;
+    struct AMFArenaBlock *a_blocks;
+  } AMFArena;
+
+  void AMFArena_Init(AMFArena * arena, char *buf, int size);
+  void AMFArena_Reset(AMFArena * arena);
+  void AMFArena_Free(AMFArena * arena);
+
+  /* encoded sizes, so a buffer can be sized before encoding into it */
+#define AMF_NUMBER_SIZE		9
+#define AMF_BOOLEAN_SIZE	2
+#define AMF_STRING_SIZE(len)	((len) < 65536 ? 3 + (len) : 5 + (len))
+
   char *AMF_Encode(AMFObject * obj, char *pBuffer, char *pBufEnd);
+  int AMF_EncodedSize(AMFObject * obj);
   int AMF_Decode(AMFObject * obj, const char *pBuffer, int nSize,
 		 bool bDecodeName);
+  int AMF_DecodeArena(AMFObject * obj, const char *pBuffer, int nSize,
+		      bool bDecodeName, AMFArena * arena);
   int AMF_DecodeArray(AMFObject * obj, const char *pBuffer, int nSize,
 		      int nArrayLen, bool bDecodeName);
   int AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize,
@@ -131,10 +170,12 @@ extern "C"
   bool AMFProp_GetBoolean(AMFObjectProperty * prop);
   void AMFProp_GetString(AMFObjectProperty * prop, AVal * str);
   void AMFProp_GetObject(AMFObjectProperty * prop, AMFObject * obj);
+  double *AMFProp_GetNumberArray(AMFObjectProperty * prop, int *count);
 
   bool AMFProp_IsValid(AMFObjectProperty * prop);
 
   char *AMFProp_Encode(AMFObjectProperty * prop, char *pBuffer, char *pBufEnd);
+  int AMFProp_EncodedSize(AMFObjectProperty * prop);
   int AMF3Prop_Decode(AMFObjectProperty * prop, const char *pBuffer,
 		      int nSize, bool bDecodeName);
   int AMFProp_Decode(AMFObjectProperty * prop, const char *pBuffer,
@@ -143,6 +184,32 @@ extern "C"
   void AMFProp_Dump(AMFObjectProperty * prop);
   void AMFProp_Reset(AMFObjectProperty * prop);
 
+  /* Reads values in place from an encoded buffer without building an
+   * AMFObject; strings returned point into the buffer. A cursor walks a
+   * list of values, the members of an object or the elements of a strict
+   * array. After AMFCursor_Next the member's value must be consumed by
+   * Skip, Number, String or Enter before the next call.
+   */
+  typedef struct AMFCursor
+  {
+    const char *c_ptr;
+    const char *c_end;
+    int c_named;
+    int c_left;
+  } AMFCursor;
+
+  void AMFCursor_Init(AMFCursor * cur, const char *pBuffer, int nSize);
+  AMFDataType AMFCursor_Type(AMFCursor * cur);
+  bool AMFCursor_Next(AMFCursor * cur, AVal * name);
+  bool AMFCursor_Skip(AMFCursor * cur);
+  bool AMFCursor_Number(AMFCursor * cur, double *val);
+  bool AMFCursor_String(AMFCursor * cur, AVal * str);
+  bool AMFCursor_Enter(AMFCursor * cur, AMFCursor * inner);
+  bool AMFCursor_Get(AMFCursor * cur, int nIndex, AMFCursor * val);
+  bool AMFCursor_Find(AMFCursor * cur, const char *path, AMFCursor * val);
+  bool AMFCursor_Search(AMFCursor * cur, const AVal * name,
+			AMFCursor * val);
+
   typedef struct AMF3ClassDef
   {
     AVal cd_name;
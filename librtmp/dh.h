@@ -25,6 +25,9 @@
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 #include <openssl/bn.h>
 #include <openssl/dh.h>
@@ -110,33 +113,61 @@ failed:
   return ret;
 }
 
+/* the group never changes, parse it once per process */
+static BIGNUM *dhP, *dhG, *dhQ;
+#ifndef WIN32
+static pthread_once_t dhOnce = PTHREAD_ONCE_INIT;
+#endif
+
+static void
+DHParseGroup(void)
+{
+  BIGNUM *p = NULL, *q = NULL, *g = BN_new();
+
+  if (!g || !BN_set_word(g, 2)	// base 2
+      || !BN_hex2bn(&p, P1024)	// prime P1024, see dhgroups.h
+      || !BN_hex2bn(&q, Q1024))
+    {
+      BN_free(p);
+      BN_free(q);
+      BN_free(g);
+      return;
+    }
+  dhP = p;
+  dhG = g;
+  dhQ = q;
+}
+
+static bool
+DHGroup(void)
+{
+#ifdef WIN32
+  if (!dhP)
+    DHParseGroup();
+#else
+  pthread_once(&dhOnce, DHParseGroup);
+#endif
+  return dhP != NULL;
+}
+
 static DH *
 DHInit(int nKeyBits)
 {
-  int res;
-  DH *dh = DH_new();
+  DH *dh;
+
+  if (!DHGroup())
+    return 0;
 
+  dh = DH_new();
   if (!dh)
     goto failed;
 
-  dh->p = BN_new();
-  dh->g = BN_new();
+  dh->p = BN_dup(dhP);
+  dh->g = BN_dup(dhG);
 
   if (!dh->p || !dh->g)
     goto failed;
 
-  res = BN_hex2bn(&dh->p, P1024);	// prime P1024, see dhgroups.h
-  if (!res)
-    {
-      goto failed;
-    }
-
-  res = BN_set_word(dh->g, 2);	// base 2
-  if (!res)
-    {
-      goto failed;
-    }
-
   dh->length = nKeyBits;
   return dh;
 
@@ -159,22 +190,124 @@ DHGenerateKey(DH * dh)
       if (!DH_generate_key(dh))
 	return 0;
 
-      BIGNUM *q1 = BN_new();
-      assert(BN_hex2bn(&q1, Q1024));
-
-      res = isValidPublicKey(dh->pub_key, dh->p, q1);
+      res = isValidPublicKey(dh->pub_key, dh->p, dhQ);
       if (!res)
 	{
 	  BN_free(dh->pub_key);
 	  BN_free(dh->priv_key);
 	  dh->pub_key = dh->priv_key = 0;
 	}
-
-      BN_free(q1);
     }
   return 1;
 }
 
+/* A 1024-bit exponentiation per handshake adds up when every session
+ * reconnects at once, so ready keypairs can be kept in a pool that a
+ * background thread tops up. Each keypair is handed out exactly once.
+ */
+#define DH_POOL_MAX	64
+
+#ifndef WIN32
+static DH *dhPool[DH_POOL_MAX];
+static int dhPoolCount, dhPoolSize, dhPoolRunning;
+static pthread_mutex_t dhPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dhPoolCond = PTHREAD_COND_INITIALIZER;
+
+static void *
+DHPoolThread(void *arg)
+{
+  DH *dh;
+
+  pthread_mutex_lock(&dhPoolLock);
+  for (;;)
+    {
+      while (dhPoolCount >= dhPoolSize)
+	pthread_cond_wait(&dhPoolCond, &dhPoolLock);
+      pthread_mutex_unlock(&dhPoolLock);
+
+      dh = DHInit(128);
+      if (dh && !DHGenerateKey(dh))
+	{
+	  DH_free(dh);
+	  dh = NULL;
+	}
+
+      pthread_mutex_lock(&dhPoolLock);
+      if (!dh)
+	{
+	  Log(LOGWARNING, "%s: key generation failed, pool disabled",
+	      __FUNCTION__);
+	  dhPoolSize = 0;
+	}
+      else if (dhPoolCount < dhPoolSize)
+	dhPool[dhPoolCount++] = dh;
+      else
+	DH_free(dh);
+    }
+  return NULL;
+}
+#endif
+
+/* keep up to size keypairs ready, 0 turns the pool off. The refill thread
+ * starts with the first handshake that needs a key. */
+void
+RTMP_SetDHPool(int size)
+{
+  if (size < 0)
+    size = 0;
+  if (size > DH_POOL_MAX)
+    size = DH_POOL_MAX;
+#ifndef WIN32
+  pthread_mutex_lock(&dhPoolLock);
+  dhPoolSize = size;
+  while (dhPoolCount > dhPoolSize)
+    DH_free(dhPool[--dhPoolCount]);
+  pthread_cond_signal(&dhPoolCond);
+  pthread_mutex_unlock(&dhPoolLock);
+#endif
+}
+
+/* a DH with a fresh keypair, from the pool when one is ready */
+static DH *
+DHNewKey(void)
+{
+  DH *dh = NULL;
+
+#ifndef WIN32
+  if (dhPoolSize)
+    {
+      pthread_mutex_lock(&dhPoolLock);
+      if (dhPoolSize && !dhPoolRunning)
+	{
+	  pthread_t id;
+	  pthread_attr_t attr;
+
+	  pthread_attr_init(&attr);
+	  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	  if (pthread_create(&id, &attr, DHPoolThread, NULL) == 0)
+	    dhPoolRunning = true;
+	  else
+	    dhPoolSize = 0;
+	  pthread_attr_destroy(&attr);
+	}
+      if (dhPoolCount)
+	dh = dhPool[--dhPoolCount];
+      pthread_cond_signal(&dhPoolCond);
+      pthread_mutex_unlock(&dhPoolLock);
+      if (dh)
+	return dh;
+    }
+#endif
+
+  dh = DHInit(128);		/* 1024 */
+  if (dh && !DHGenerateKey(dh))
+    {
+      DH_free(dh);
+      dh = NULL;
+    }
+  return dh;
+}
+
 // fill pubkey with the public key in BIG ENDIAN order
 // 00 00 00 00 00 x1 x2 x3 .....
 
@@ -222,18 +355,12 @@ DHComputeSharedSecretKey(DH * dh, uint8_t * pubkey, size_t nPubkeyLen,
   if (!pubkeyBn)
     return -1;
 
-  BIGNUM *q1 = BN_new();
-  assert(BN_hex2bn(&q1, Q1024));
-
-  if (!isValidPublicKey(pubkeyBn, dh->p, q1))
+  if (!isValidPublicKey(pubkeyBn, dh->p, dhQ))
     {
       BN_free(pubkeyBn);
-      BN_free(q1);
       return -1;
     }
 
-  BN_free(q1);
-
   size_t len = DH_compute_key(secret, pubkeyBn, dh);
   BN_free(pubkeyBn);
 
@@ -381,11 +381,11 @@ HandShake(RTMP * r, bool FP9HandShake)
     {
       if (encrypted)
 	{
-	  /* generate Diffie-Hellmann parameters */
-	  r->Link.dh = DHInit(128);	/* 1024 */
+	  /* generate Diffie-Hellmann keypair */
+	  r->Link.dh = DHNewKey();
 	  if (!r->Link.dh)
 	    {
-	      Log(LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
+	      Log(LOGERROR, "%s: Couldn't generate Diffie-Hellmann key!",
 		  __FUNCTION__);
 	      return false;
 	    }
@@ -393,13 +393,6 @@ HandShake(RTMP * r, bool FP9HandShake)
 	  dhposClient = getdh(clientsig, RTMP_SIG_SIZE);
 	  Log(LOGDEBUG, "%s: DH pubkey position: %d", __FUNCTION__, dhposClient);
 
-	  if (!DHGenerateKey(r->Link.dh))
-	    {
-	      Log(LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
-		  __FUNCTION__);
-	      return false;
-	    }
-
 	  if (!DHGetPublicKey
 	      (r->Link.dh, (uint8_t *) &clientsig[dhposClient], 128))
 	    {
@@ -427,6 +420,7 @@ HandShake(RTMP * r, bool FP9HandShake)
 
   if (!WriteN(r, clientsig-1, RTMP_SIG_SIZE + 1))
     return false;
+  MarkPhase(r, RTMP_PHASE_C1_SENT);
 
   if (ReadN(r, &type, 1) != 1)	/* 0x03 or 0x06 */
     return false;
@@ -578,9 +572,18 @@ HandShake(RTMP * r, bool FP9HandShake)
     __FUNCTION__);
   LogHex(LOGDEBUG, reply, RTMP_SIG_SIZE);
 #endif
+  /* C2 goes out together with connect, see RTMP_Connect1 */
+  r->m_bCorked = true;
   if (!WriteN(r, reply, RTMP_SIG_SIZE))
     return false;
 
+  if (r->Link.deferS2 && !encrypted)
+    {
+      Log(LOGDEBUG, "%s: not waiting for S2", __FUNCTION__);
+      r->m_nSkipIn = RTMP_SIG_SIZE;
+      return true;
+    }
+
   /* 2nd part of handshake */
   if (ReadN(r, serversig, RTMP_SIG_SIZE) != RTMP_SIG_SIZE)
     return false;
@@ -670,6 +673,12 @@ HandShake(RTMP * r, bool FP9HandShake)
 	      RC4(r->Link.rc4keyOut, RTMP_SIG_SIZE, (uint8_t *) buff,
 		  (uint8_t *) buff);
 	    }
+
+	  /* input is decrypted as it is buffered, catch up on what
+	   * arrived along with the handshake */
+	  if (r->m_nBufferSize)
+	    RC4(r->Link.rc4keyIn, r->m_nBufferSize,
+		(uint8_t *) r->m_pBufferStart, (uint8_t *) r->m_pBufferStart);
 	}
     }
   else
@@ -760,11 +769,11 @@ SHandShake(RTMP * r)
     {
       if (encrypted)
 	{
-	  /* generate Diffie-Hellmann parameters */
-	  r->Link.dh = DHInit(128);
+	  /* generate Diffie-Hellmann keypair */
+	  r->Link.dh = DHNewKey();
 	  if (!r->Link.dh)
 	    {
-	      Log(LOGERROR, "%s: Couldn't initialize Diffie-Hellmann!",
+	      Log(LOGERROR, "%s: Couldn't generate Diffie-Hellmann key!",
 		  __FUNCTION__);
 	      return false;
 	    }
@@ -772,13 +781,6 @@ SHandShake(RTMP * r)
 	  dhposServer = GetDHOffset2(serversig, RTMP_SIG_SIZE);
 	  Log(LOGDEBUG, "%s: DH pubkey position: %d", __FUNCTION__, dhposServer);
 
-	  if (!DHGenerateKey(r->Link.dh))
-	    {
-	      Log(LOGERROR, "%s: Couldn't generate Diffie-Hellmann public key!",
-		  __FUNCTION__);
-	      return false;
-	    }
-
 	  if (!DHGetPublicKey
 	      (r->Link.dh, (uint8_t *) &serversig[dhposServer], 128))
 	    {
@@ -982,6 +984,12 @@ SHandShake(RTMP * r)
 	      RC4(r->Link.rc4keyOut, RTMP_SIG_SIZE, (uint8_t *) buff,
 		  (uint8_t *) buff);
 	    }
+
+	  /* input is decrypted as it is buffered, catch up on what
+	   * arrived along with the handshake */
+	  if (r->m_nBufferSize)
+	    RC4(r->Link.rc4keyIn, r->m_nBufferSize,
+		(uint8_t *) r->m_pBufferStart, (uint8_t *) r->m_pBufferStart);
 	}
     }
   else
@@ -23,6 +23,12 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/file.h>
+#include <pthread.h>
+#endif
 
 #include "rtmp.h"
 #include "http.h"
@@ -87,6 +93,7 @@ swfcrunch(void *ptr, size_t size, size_t nmemb, void *stream)
 }
 
 #define	AGENT	"Mozilla/5.0"
+#define HTTP_TIMEOUT	5
 
 HTTPResult
 HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb)
@@ -100,13 +107,16 @@ HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb)
   int rc, i;
   int len_known;
   HTTPResult ret = HTTPRES_OK;
-  struct sockaddr_in sa;
-  RTMPSockBuf sb;
+  RTMPAddr addrs[RTMP_MAX_ADDRS];
+  int naddrs;
+  RTMPSockBuf sb = {0};
+  char buf[RTMP_BUFFER_CACHE_SIZE];
 
   http->status = -1;
 
-  memset(&sa, 0, sizeof(struct sockaddr_in));
-  sa.sin_family = AF_INET;
+  /* a fixed buffer of our own, never resized */
+  sb.sb_buf = buf;
+  sb.sb_bufsize = sb.sb_minsize = sb.sb_maxsize = sizeof(buf);
 
   /* we only handle http here */
   if (strncasecmp(url, "http", 4))
@@ -128,40 +138,35 @@ HTTP_get(struct HTTP_ctx *http, const char *url, HTTP_read_callback *cb)
   strncpy(hbuf, host, hlen);
   hbuf[hlen] = '\0';
   host = hbuf;
-  p1 = strrchr(host, ':');
+  /* [IPv6 literal] */
+  p2 = *host == '[' ? strchr(host, ']') : NULL;
+  p1 = strrchr(p2 ? p2 : host, ':');
   if (p1)
     {
       *p1++ = '\0';
       port = atoi(p1);
     }
-
-  sa.sin_addr.s_addr = inet_addr(host);
-  if (sa.sin_addr.s_addr == INADDR_NONE)
+  if (p2)
     {
-      struct hostent *hp = gethostbyname(host);
-      if (!hp || !hp->h_addr)
-        return HTTPRES_LOST_CONNECTION;
-      sa.sin_addr = *(struct in_addr *)hp->h_addr;
+      *p2 = '\0';
+      host++;
     }
-  sa.sin_port = htons(port);
-  sb.sb_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sb.sb_socket < 0)
+
+  naddrs = RTMP_Resolve(host, port, addrs, RTMP_MAX_ADDRS);
+  if (!naddrs)
     return HTTPRES_LOST_CONNECTION;
-  i = sprintf(sb.sb_buf, "GET %s HTTP/1.0\r\nUser-Agent: %s\r\nHost: %s\r\nReferrer: %.*s\r\n",
-    path, AGENT, host, (int)(path-url+1), url);
+  i = sprintf(sb.sb_buf, "GET %s HTTP/1.0\r\nUser-Agent: %s\r\nHost: %s%s%s\r\nReferrer: %.*s\r\n",
+    path, AGENT, p2 ? "[" : "", host, p2 ? "]" : "", (int)(path-url+1), url);
   if (http->date[0])
     i += sprintf(sb.sb_buf+i, "If-Modified-Since: %s\r\n", http->date);
   i += sprintf(sb.sb_buf+i, "\r\n");
 
-  if (connect(sb.sb_socket, (struct sockaddr *)&sa, sizeof(struct sockaddr)) < 0)
-    {
-      ret = HTTPRES_LOST_CONNECTION;
-      goto leave;
-    }
+  sb.sb_socket = RTMP_ConnectAny(addrs, naddrs, HTTP_TIMEOUT);
+  if (sb.sb_socket < 0)
+    return HTTPRES_LOST_CONNECTION;
   send(sb.sb_socket, sb.sb_buf, i, 0);
 
   // set timeout
-#define HTTP_TIMEOUT	5
   SET_RCVTIMEO(tv, HTTP_TIMEOUT);
   if (setsockopt
     (sb.sb_socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv)))
@@ -363,120 +368,391 @@ void strtime(time_t *t, char *s)
 
 #define HEX2BIN(a)      (((a)&0x40)?((a)&0xf)+9:((a)&0xf))
 
-int
-RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash, int age)
+/* SWF hash info is cached in a fixed-format file.
+ * url: <url of SWF file>
+ * ctim: HTTP datestamp of when we last checked it.
+ * date: HTTP datestamp of the SWF's last modification.
+ * size: SWF size in hex
+ * hash: SWF hash in hex
+ *
+ * These fields must be present in this order. All fields
+ * besides URL are fixed size.
+ *
+ * The file is never rewritten in place: writers hold an flock on
+ * <file>.lock, write a new copy and rename it over the old one, so readers
+ * always see a complete file without locking. Recently used entries are
+ * also kept in memory and trusted for as long as the file is unchanged.
+ * That memory is per process, a new one scans the file once per SWF.
+ */
+struct swfinfo {
+  char *key;
+  time_t ctim;
+  char date[64];
+  unsigned int size;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  unsigned int used;
+};
+
+#define SWF_CACHED	32	/* entries kept in memory */
+
+static struct swfinfo swfcache[SWF_CACHED];
+static unsigned int swfclock;
+static struct stat swfstat;	/* the file the cached entries came from */
+#ifndef WIN32
+static pthread_mutex_t swflock = PTHREAD_MUTEX_INITIALIZER;
+#define SWF_LOCK()	pthread_mutex_lock(&swflock)
+#define SWF_UNLOCK()	pthread_mutex_unlock(&swflock)
+#else
+#define SWF_LOCK()
+#define SWF_UNLOCK()
+#endif
+
+/* Entries are matched on scheme://host/ and the SWF's file name, any
+ * directories and query string in between are ignored.
+ */
+static char *
+swfkey(const char *url, int len)
 {
-  FILE *f = NULL;
-  char *path, *home, date[64], cctim[64];
-  long pos = 0;
-  time_t ctim = -1, cnow;
-  int i, got = 0, ret = 0;
-  unsigned int hlen;
-  struct info in = {0};
-  struct HTTP_ctx http = {0};
-  HTTPResult httpres;
-  z_stream zs = {0};
-  HMAC_CTX ctx;
+  const char *file, *end;
+  char *key;
+  int hlen;
 
-  date[0] = '\0';
-  home = getenv("HOME");
-  if (!home)
-    home = ".";
+  file = strstr(url, "://");
+  if (!file)
+    return NULL;
+  file = strchr(file+3, '/');
+  if (!file || file - url >= len)
+    return NULL;
+  file++;
+  hlen = file - url;
+  end = file;
+  while (end < url + len && *end != '?')
+    {
+      if (*end++ == '/')
+        file = end;
+    }
+  key = malloc(hlen + (end - file) + 1);
+  if (!key)
+    return NULL;
+  memcpy(key, url, hlen);
+  memcpy(key+hlen, file, end - file);
+  key[hlen + (end - file)] = '\0';
+  return key;
+}
 
-  /* SWF hash info is cached in a fixed-format file.
-   * url: <url of SWF file>
-   * ctim: HTTP datestamp of when we last checked it.
-   * date: HTTP datestamp of the SWF's last modification.
-   * size: SWF size in hex
-   * hash: SWF hash in hex
-   *
-   * These fields must be present in this order. All fields
-   * besides URL are fixed size.
-   */
-  path=malloc(strlen(home)+sizeof("/.swfinfo"));
-  strcpy(path, home);
-  strcat(path, "/.swfinfo");
+static int
+swfsame(struct stat *a, struct stat *b)
+{
+  return a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+    a->st_size == b->st_size && a->st_mtime == b->st_mtime;
+}
 
-  f = fopen(path, "r+");
-  while (f)
+static void
+swfflush(void)
+{
+  int i;
+  for (i=0; i<SWF_CACHED; i++)
     {
-      char buf[4096], *file, *p;
+      free(swfcache[i].key);
+      swfcache[i].key = NULL;
+    }
+}
 
-      file = strchr(url, '/');
-      if (!file)
-        break;
-      file += 2;
-      file = strchr(file, '/');
-      if (!file)
-        break;
-      file++;
-      hlen = file - url;
-      p = strrchr(file, '/');
-      if (p)
-        file = p;
-      else
-        file--;
+/* must hold swflock */
+static struct swfinfo *
+swffind(const char *key)
+{
+  int i;
+  for (i=0; i<SWF_CACHED; i++)
+    if (swfcache[i].key && !strcmp(swfcache[i].key, key))
+      {
+        swfcache[i].used = ++swfclock;
+        return &swfcache[i];
+      }
+  return NULL;
+}
+
+/* must hold swflock */
+static void
+swfstore(const char *key, struct swfinfo *info)
+{
+  struct swfinfo *e = swffind(key);
+  char *k;
+  int i;
+
+  if (!e)
+    {
+      e = &swfcache[0];
+      for (i=1; i<SWF_CACHED && e->key; i++)
+        if (!swfcache[i].key || swfcache[i].used < e->used)
+          e = &swfcache[i];
+      k = strdup(key);
+      if (!k)
+        return;
+      free(e->key);
+      e->key = k;
+    }
+  k = e->key;
+  *e = *info;
+  e->key = k;
+  e->used = ++swfclock;
+}
+
+/* read one entry's fields after its url: line, 4 if all were there */
+static int
+swfparse(FILE *f, char *buf, int buflen, struct swfinfo *info)
+{
+  int i, got = 0;
 
-      while (fgets(buf, sizeof(buf), f))
+  while (fgets(buf, buflen, f))
+    {
+      if (!strncmp(buf, "size: ", 6))
         {
-          char *r1;
-
-          got = 0;
-
-          if (strncmp(buf, "url: ", 5))
-            continue;
-          if (strncmp(buf+5, url, hlen))
-            continue;
-          r1 = strrchr(buf, '/');
-          i = strlen(r1);
-          r1[--i] = '\0';
-          if (strncmp(r1, file, i))
-            continue;
-          pos = ftell(f);
-          while (got < 4 && fgets(buf, sizeof(buf), f))
-            {
-              if (!strncmp(buf, "size: ", 6))
-                {
-                  *size = strtol(buf+6, NULL, 16);
-                  got++;
-                }
-              else if (!strncmp(buf, "hash: ", 6))
-                {
-                  unsigned char *ptr = hash, *in = (unsigned char *)buf+6;
-                  int l = strlen((char *)in)-1;
-                  for (i=0; i<l; i+=2)
-                    *ptr++ = (HEX2BIN(in[i]) << 4) | HEX2BIN(in[i+1]);
-                  got++;
-                }
-              else if (!strncmp(buf, "date: ", 6))
-                {
-                  buf[strlen(buf)-1] = '\0';
-                  strncpy(date, buf+6, sizeof(date));
-                  got++;
-                }
-              else if (!strncmp(buf, "ctim: ", 6))
-                {
-                  buf[strlen(buf)-1] = '\0';
-		  ctim = make_unix_time(buf+6);
-                  got++;
-                }
-              else if (!strncmp(buf, "url: ", 5))
-                break;
-            }
-          break;
+          info->size = strtol(buf+6, NULL, 16);
+          got++;
         }
+      else if (!strncmp(buf, "hash: ", 6))
+        {
+          unsigned char *ptr = info->hash, *in = (unsigned char *)buf+6;
+          int l = strlen((char *)in)-1;
+          if (l > SHA256_DIGEST_LENGTH*2)
+            l = SHA256_DIGEST_LENGTH*2;
+          for (i=0; i<l; i+=2)
+            *ptr++ = (HEX2BIN(in[i]) << 4) | HEX2BIN(in[i+1]);
+          got++;
+        }
+      else if (!strncmp(buf, "date: ", 6))
+        {
+          buf[strlen(buf)-1] = '\0';
+          strncpy(info->date, buf+6, sizeof(info->date));
+          info->date[sizeof(info->date)-1] = '\0';
+          got++;
+        }
+      else if (!strncmp(buf, "ctim: ", 6))
+        {
+          buf[strlen(buf)-1] = '\0';
+          info->ctim = make_unix_time(buf+6);
+          got++;
+        }
+      else if (!strncmp(buf, "url: ", 5))
+        break;
+    }
+  return got;
+}
+
+/* does this url: line belong to key */
+static int
+swfmatch(const char *line, const char *key)
+{
+  char *k;
+  int ret;
+
+  if (strncmp(line, "url: ", 5))
+    return 0;
+  k = swfkey(line+5, strcspn(line+5, "\r\n"));
+  ret = k && !strcmp(k, key);
+  free(k);
+  return ret;
+}
+
+static int
+swflookup(const char *path, const char *key, struct swfinfo *info)
+{
+  struct stat st;
+  struct swfinfo *e;
+  char buf[4096];
+  FILE *f;
+  int ret = 0;
+
+  SWF_LOCK();
+  if (stat(path, &st))
+    {
+      swfflush();
+      SWF_UNLOCK();
+      return 0;
+    }
+  if (!swfsame(&st, &swfstat))
+    {
+      swfflush();
+      swfstat = st;
+    }
+  e = swffind(key);
+  if (e)
+    {
+      *info = *e;
+      SWF_UNLOCK();
+      return 1;
+    }
+  SWF_UNLOCK();
+
+  f = fopen(path, "r");
+  if (!f)
+    return 0;
+  fstat(fileno(f), &st);
+  while (fgets(buf, sizeof(buf), f))
+    {
+      if (!swfmatch(buf, key))
+        continue;
+      memset(info, 0, sizeof(*info));
+      ret = swfparse(f, buf, sizeof(buf), info) == 4;
       break;
     }
+  fclose(f);
 
-  cnow = time(NULL);
-  /* If we got a cache time, see if it's young enough to use directly */
-  if (age && ctim > 0)
+  if (ret)
     {
-      ctim = cnow - ctim;
-      ctim /= 3600 * 24; /* seconds to days */
-      if (ctim < age)	/* ok, it's new enough */
-        goto out;
+      SWF_LOCK();
+      if (swfsame(&st, &swfstat))
+        swfstore(key, info);
+      SWF_UNLOCK();
     }
+  return ret;
+}
+
+/* replace key's entry in the cache file with info */
+static int
+swfupdate(const char *path, const char *url, const char *key,
+          struct swfinfo *info)
+{
+  char *tmp, *lock, buf[4096], cctim[64];
+  FILE *f, *old;
+  struct stat st;
+  int i, fd, lfd = -1, skip = 0, ret = -1;
+
+  tmp = malloc(strlen(path)+sizeof(".XXXXXX"));
+  lock = malloc(strlen(path)+sizeof(".lock"));
+  if (!tmp || !lock)
+    goto out;
+  sprintf(tmp, "%s.XXXXXX", path);
+  sprintf(lock, "%s.lock", path);
+
+#ifndef WIN32
+  /* one writer at a time, so concurrent updates of different SWFs
+   * don't lose each other */
+  lfd = open(lock, O_RDWR|O_CREAT, 0644);
+  if (lfd < 0 || flock(lfd, LOCK_EX))
+    {
+      int err = errno;
+      Log(LOGERROR, "%s: couldn't lock %s, errno %d (%s)",
+        __FUNCTION__, lock, err, strerror(err));
+      goto out;
+    }
+  fd = mkstemp(tmp);
+  if (fd >= 0)
+    fchmod(fd, 0644);
+#else
+  strcpy(tmp+strlen(path), ".tmp");
+  fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+#endif
+  f = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!f)
+    {
+      int err = errno;
+      Log(LOGERROR, "%s: couldn't open %s for writing, errno %d (%s)",
+        __FUNCTION__, tmp, err, strerror(err));
+      if (fd >= 0)
+        close(fd);
+      goto out;
+    }
+
+  /* copy every other entry over */
+  old = fopen(path, "r");
+  if (old)
+    {
+      while (fgets(buf, sizeof(buf), old))
+        {
+          if (!strncmp(buf, "url: ", 5))
+            skip = swfmatch(buf, key);
+          if (!skip)
+            fputs(buf, f);
+        }
+      fclose(old);
+    }
+
+  i = strcspn(url, "?");
+  strtime(&info->ctim, cctim);
+  fprintf(f, "url: %.*s\n", i, url);
+  fprintf(f, "ctim: %s\n", cctim);
+  fprintf(f, "date: %s\n", info->date);
+  fprintf(f, "size: %08x\n", info->size);
+  fprintf(f, "hash: ");
+  for (i=0; i<SHA256_DIGEST_LENGTH; i++)
+    fprintf(f, "%02x", info->hash[i]);
+  fprintf(f, "\n");
+
+  if (fclose(f))
+    {
+      int err = errno;
+      Log(LOGERROR, "%s: couldn't write %s, errno %d (%s)",
+        __FUNCTION__, tmp, err, strerror(err));
+      unlink(tmp);
+      goto out;
+    }
+#ifdef WIN32
+  remove(path);
+#endif
+  if (rename(tmp, path))
+    {
+      int err = errno;
+      Log(LOGERROR, "%s: couldn't rename %s to %s, errno %d (%s)",
+        __FUNCTION__, tmp, path, err, strerror(err));
+      unlink(tmp);
+      goto out;
+    }
+  ret = 0;
+
+  /* we've seen every entry of the new file, keep the cache valid */
+  SWF_LOCK();
+  if (!stat(path, &st))
+    {
+      swfflush();
+      swfstat = st;
+      swfstore(key, info);
+    }
+  SWF_UNLOCK();
+
+out:
+  if (lfd >= 0)
+    close(lfd);
+  free(lock);
+  free(tmp);
+  return ret;
+}
+
+static char *
+swfpath(void)
+{
+  char *path, *home;
+
+  home = getenv("HOME");
+  if (!home)
+    home = ".";
+
+  path=malloc(strlen(home)+sizeof("/.swfinfo"));
+  if (path)
+    {
+      strcpy(path, home);
+      strcat(path, "/.swfinfo");
+    }
+  return path;
+}
+
+/* download and hash url. If got is set info holds the cached entry and
+ * is only revalidated when the server says it's unmodified. */
+static int
+swffetch(const char *path, const char *url, const char *key,
+         struct swfinfo *info, int got)
+{
+  int ret = 0;
+  unsigned int hlen;
+  struct info in = {0};
+  struct HTTP_ctx http = {0};
+  HTTPResult httpres;
+  z_stream zs = {0};
+  HMAC_CTX ctx;
+
+  if (!got)
+    info->date[0] = '\0';
 
   in.first = 1;
   HMAC_CTX_init(&ctx);
@@ -485,7 +761,7 @@ RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash, int age)
   in.ctx = &ctx;
   in.zs = &zs;
 
-  http.date = date;
+  http.date = info->date;
   http.data = &in;
 
   httpres = HTTP_get(&http, url, swfcrunch);
@@ -507,50 +783,289 @@ RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash, int age)
     }
   else
     {
-      if (got && pos)
-        fseek(f, pos, SEEK_SET);
-      else
+      if (!in.first)
         {
-          char *q;
-          if (!f)
-            f = fopen(path, "w");
-          if (!f)
+          HMAC_Final(&ctx, info->hash, &hlen);
+          info->size = in.size;
+          got = 1;
+        }
+      /* not modified only refreshes the check time */
+      info->ctim = time(NULL);
+      if (!got)
+        ret = -1;
+      else if (key && swfupdate(path, url, key, info))
+        ret = -1;
+    }
+  HMAC_CTX_cleanup(&ctx);
+  return ret;
+}
+
+#ifndef WIN32
+/* Sessions that need the same SWF at the same time share one download:
+ * the first caller fetches, the others wait for its result.
+ */
+struct swfflight {
+  struct swfflight *next;
+  char *key;
+  int waiters;
+  int done;
+  int ret;
+  struct swfinfo info;
+};
+
+static struct swfflight *swfflights;
+static pthread_cond_t swfcond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static int
+swfget(const char *path, const char *url, const char *key,
+       struct swfinfo *info, int got)
+{
+#ifndef WIN32
+  struct swfflight *fl, **prev;
+  int ret;
+
+  if (!key)
+    return swffetch(path, url, key, info, got);
+
+  SWF_LOCK();
+  for (fl = swfflights; fl; fl = fl->next)
+    if (!strcmp(fl->key, key))
+      break;
+  if (fl)
+    {
+      Log(LOGDEBUG, "%s: waiting for download of %s", __FUNCTION__, key);
+      fl->waiters++;
+      while (!fl->done)
+        pthread_cond_wait(&swfcond, &swflock);
+      ret = fl->ret;
+      if (!ret)
+        *info = fl->info;
+      if (!--fl->waiters)
+        {
+          free(fl->key);
+          free(fl);
+        }
+      SWF_UNLOCK();
+      return ret;
+    }
+  fl = calloc(1, sizeof(struct swfflight));
+  if (fl)
+    fl->key = strdup(key);
+  if (!fl || !fl->key)
+    {
+      free(fl);
+      SWF_UNLOCK();
+      return swffetch(path, url, key, info, got);
+    }
+  fl->next = swfflights;
+  swfflights = fl;
+  SWF_UNLOCK();
+
+  ret = swffetch(path, url, key, info, got);
+
+  SWF_LOCK();
+  for (prev = &swfflights; *prev != fl; prev = &(*prev)->next);
+  *prev = fl->next;
+  fl->ret = ret;
+  fl->info = *info;
+  fl->done = 1;
+  pthread_cond_broadcast(&swfcond);
+  if (!fl->waiters)
+    {
+      free(fl->key);
+      free(fl);
+    }
+  SWF_UNLOCK();
+  return ret;
+#else
+  return swffetch(path, url, key, info, got);
+#endif
+}
+
+#ifndef WIN32
+/* With the refresher on, every SWF asked for with a nonzero age is
+ * revalidated in the background once 3/4 of its age has passed, so
+ * callers find it fresh instead of waiting on the download.
+ */
+#define SWF_WATCHED	32
+#define SWF_CHECK	60	/* seconds between refresher passes */
+#define SWF_RETRY	600	/* seconds before retrying a failed refresh */
+
+struct swfwatch {
+  char *key;
+  char *url;
+  int age;
+  time_t retry;
+  unsigned int used;
+};
+
+static struct swfwatch swfwatched[SWF_WATCHED];
+static int swfrefresh, swfrefreshing;
+
+static void
+swfwatch(const char *url, const char *key, int age)
+{
+  struct swfwatch *w = NULL;
+  char *k, *u;
+  int i, l;
+
+  for (i=0; i<SWF_WATCHED; i++)
+    if (swfwatched[i].key && !strcmp(swfwatched[i].key, key))
+      {
+        w = &swfwatched[i];
+        break;
+      }
+  if (!w)
+    {
+      w = &swfwatched[0];
+      for (i=1; i<SWF_WATCHED && w->key; i++)
+        if (!swfwatched[i].key || swfwatched[i].used < w->used)
+          w = &swfwatched[i];
+      l = strlen(url);
+      k = strdup(key);
+      u = malloc(l+1);
+      if (!k || !u)
+        {
+          free(k);
+          free(u);
+          return;
+        }
+      memcpy(u, url, l+1);
+      free(w->key);
+      free(w->url);
+      w->key = k;
+      w->url = u;
+      w->retry = 0;
+    }
+  w->age = age;
+  w->used = ++swfclock;
+}
+
+static void *
+swfrefresher(void *arg)
+{
+  struct swfinfo info;
+  char *path, *url, *key;
+  time_t cnow;
+  int i, got, age;
+
+  for (;;)
+    {
+      sleep(SWF_CHECK);
+      path = swfpath();
+      if (!path)
+        continue;
+      for (i=0; i<SWF_WATCHED; i++)
+        {
+          SWF_LOCK();
+          cnow = time(NULL);
+          if (!swfwatched[i].key || swfwatched[i].retry > cnow)
+            {
+              SWF_UNLOCK();
+              continue;
+            }
+          key = strdup(swfwatched[i].key);
+          url = strdup(swfwatched[i].url);
+          age = swfwatched[i].age;
+          SWF_UNLOCK();
+
+          if (key && url)
             {
-              int err = errno;
-              Log(LOGERROR, "%s: couldn't open %s for writing, errno %d (%s)",
-                __FUNCTION__, path, err, strerror(err));
-              ret = -1;
-              goto out;
+              got = swflookup(path, key, &info);
+              if (!got || cnow - info.ctim >= age * 3600 * 24 * 3 / 4)
+                {
+                  Log(LOGDEBUG, "%s: revalidating %s", __FUNCTION__, url);
+                  if (swfget(path, url, key, &info, got))
+                    {
+                      SWF_LOCK();
+                      if (swfwatched[i].key && !strcmp(swfwatched[i].key, key))
+                        swfwatched[i].retry = cnow + SWF_RETRY;
+                      SWF_UNLOCK();
+                    }
+                }
             }
-          fseek(f, 0, SEEK_END);
-          q = strchr(url, '?');
-          if (q)
-            i = q - url;
-          else
-            i = strlen(url);
-
-          fprintf(f, "url: %.*s\n", i, url);
+          free(key);
+          free(url);
         }
-      strtime(&cnow, cctim);
-      fprintf(f, "ctim: %s\n", cctim);
+      free(path);
+    }
+  return NULL;
+}
+#endif
 
-      if (!in.first)
+/* refresh SWF hashes in the background, for long running processes */
+void
+RTMP_SetSWFRefresh(bool on)
+{
+#ifndef WIN32
+  SWF_LOCK();
+  swfrefresh = on;
+  SWF_UNLOCK();
+#endif
+}
+
+int
+RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash, int age)
+{
+  char *path, *key;
+  time_t ctim = -1, cnow;
+  int got = 0, ret = 0;
+  struct swfinfo info = {0};
+
+  path = swfpath();
+  if (!path)
+    return -1;
+
+  key = swfkey(url, strlen(url));
+  if (key && swflookup(path, key, &info))
+    {
+      got = 1;
+      ctim = info.ctim;
+    }
+
+#ifndef WIN32
+  if (key && age)
+    {
+      SWF_LOCK();
+      if (swfrefresh)
         {
-          HMAC_Final(&ctx, (unsigned char *)hash, &hlen);
-          *size = in.size;
-
-          fprintf(f, "date: %s\n", date);
-          fprintf(f, "size: %08x\n", in.size);
-          fprintf(f, "hash: ");
-          for (i=0; i<SHA256_DIGEST_LENGTH; i++)
-            fprintf(f, "%02x", hash[i]);
-          fprintf(f, "\n");
+          swfwatch(url, key, age);
+          if (!swfrefreshing)
+            {
+              pthread_t id;
+              pthread_attr_t attr;
+
+              pthread_attr_init(&attr);
+              pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+              if (pthread_create(&id, &attr, swfrefresher, NULL) == 0)
+                swfrefreshing = true;
+              pthread_attr_destroy(&attr);
+            }
         }
+      SWF_UNLOCK();
     }
-  HMAC_CTX_cleanup(&ctx);
+#endif
+
+  cnow = time(NULL);
+  /* If we got a cache time, see if it's young enough to use directly */
+  if (age && ctim > 0)
+    {
+      ctim = cnow - ctim;
+      ctim /= 3600 * 24; /* seconds to days */
+      if (ctim < age)	/* ok, it's new enough */
+        goto out;
+    }
+
+  ret = swfget(path, url, key, &info, got);
+
 out:
+  if (!ret)
+    {
+      *size = info.size;
+      memcpy(hash, info.hash, SHA256_DIGEST_LENGTH);
+    }
+  free(key);
   free(path);
-  if (f)
-    fclose(f);
   return ret;
 }
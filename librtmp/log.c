@@ -21,10 +21,15 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#ifndef WIN32
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 
 #include "log.h"
 
@@ -41,6 +46,230 @@ static const char *levels[] = {
   "DEBUG", "DEBUG2"
 };
 
+/* what a piece of output is, it decides the decoration */
+enum { LOG_PRINTF, LOG_STATUS, LOG_LINE, LOG_SKIP };
+
+static void LogOutput(int kind, int level, const char *str)
+{
+	int len;
+
+	if ( !fmsg ) fmsg = stderr;
+
+	switch (kind) {
+	case LOG_PRINTF:
+		if (neednl) {
+			putc('\n', fmsg);
+			neednl = 0;
+		}
+		fputs(str, fmsg);
+		len = strlen(str);
+		if (len && str[len-1] == '\n')
+			fflush(fmsg);
+		break;
+	case LOG_STATUS:
+		fputs(str, fmsg);
+		fflush(fmsg);
+		neednl = 1;
+		break;
+	case LOG_LINE:
+		if (neednl) {
+			putc('\n', fmsg);
+			neednl = 0;
+		}
+		fprintf(fmsg, "%s: %s\n", levels[level], str);
+#ifdef _DEBUG
+		fflush(fmsg);
+#endif
+		break;
+	}
+}
+
+#ifndef WIN32
+/* Asynchronous output. Callers format into a slot of a bounded ring
+ * (Vyukov's MPMC queue, used with a single consumer) and a thread writes
+ * the slots out in order. When the ring is full lines are dropped and
+ * counted rather than waiting for the writer. */
+
+#define LOG_RING_SLOTS	256	/* power of 2 */
+
+typedef struct LogSlot
+{
+	volatile unsigned ls_seq;
+	int ls_kind;
+	int ls_level;
+	char ls_text[MAX_PRINT_LEN];
+} LogSlot;
+
+static LogSlot *slots;
+static LogSlot * volatile ring;		/* slots, while the writer runs */
+static volatile unsigned ringHead;	/* next slot to fill */
+static unsigned ringTail;		/* next slot to write out */
+static volatile unsigned ringDropped;
+static volatile int ringIdle, ringStop;
+static pthread_t ringThread;
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ringCond = PTHREAD_COND_INITIALIZER;
+
+static LogSlot *RingClaim(void)
+{
+	unsigned pos = ringHead;
+	LogSlot *slot;
+
+	for (;;) {
+		int dif;
+		slot = &slots[pos & (LOG_RING_SLOTS-1)];
+		dif = (int)(slot->ls_seq - pos);
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&ringHead, pos, pos+1))
+				break;
+		} else if (dif < 0) {
+			__sync_fetch_and_add(&ringDropped, 1);
+			return NULL;
+		}
+		pos = ringHead;
+	}
+	return slot;
+}
+
+static void RingPublish(LogSlot *slot)
+{
+	__sync_synchronize();
+	slot->ls_seq++;
+	if (ringIdle)
+		pthread_cond_signal(&ringCond);
+}
+
+static int RingDrain(void)
+{
+	int n = 0;
+	unsigned dropped;
+
+	for (;;) {
+		LogSlot *slot = &slots[ringTail & (LOG_RING_SLOTS-1)];
+		if ((int)(slot->ls_seq - (ringTail+1)) < 0)
+			break;
+		__sync_synchronize();
+		LogOutput(slot->ls_kind, slot->ls_level, slot->ls_text);
+		__sync_synchronize();
+		slot->ls_seq = ringTail + LOG_RING_SLOTS;
+		ringTail++;
+		n++;
+	}
+	dropped = __sync_lock_test_and_set(&ringDropped, 0);
+	if (dropped) {
+		char str[64];
+		sprintf(str, "%u log lines dropped", dropped);
+		LogOutput(LOG_LINE, LOGWARNING, str);
+	}
+	return n;
+}
+
+static void *RingThread(void *arg)
+{
+	(void)arg;
+	for (;;) {
+		struct timeval tv;
+		struct timespec ts;
+
+		if (RingDrain())
+			continue;
+		if (ringStop)
+			break;
+		/* a wakeup may be missed, so don't sleep for long */
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000 + 50000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&ringLock);
+		ringIdle = 1;
+		pthread_cond_timedwait(&ringCond, &ringLock, &ts);
+		ringIdle = 0;
+		pthread_mutex_unlock(&ringLock);
+	}
+	RingDrain();
+	return NULL;
+}
+
+static void RingStop(void)
+{
+	LogSetAsync(0);
+}
+
+int LogSetAsync(int on)
+{
+	static int registered;
+	int i;
+
+	if (on && !ring) {
+		/* the slots are never freed, a caller may still be
+		 * filling one after the writer has been stopped */
+		if (!slots && !(slots = malloc(LOG_RING_SLOTS * sizeof(LogSlot))))
+			return 0;
+		for (i=0; i<LOG_RING_SLOTS; i++)
+			slots[i].ls_seq = i;
+		ringHead = ringTail = 0;
+		ringStop = 0;
+		ring = slots;
+		if (pthread_create(&ringThread, NULL, RingThread, NULL)) {
+			ring = NULL;
+			return 0;
+		}
+		if (!registered) {
+			atexit(RingStop);
+			registered = 1;
+		}
+	} else if (!on && ring) {
+		/* new output is written directly, flush what is queued */
+		ring = NULL;
+		ringStop = 1;
+		pthread_cond_signal(&ringCond);
+		pthread_join(ringThread, NULL);
+	}
+	return 1;
+}
+
+#else
+int LogSetAsync(int on)
+{
+	return !on;
+}
+#endif
+
+/* format and write out, or queue for the writer thread */
+static void LogEmit(int kind, int level, const char *format, va_list args)
+{
+	char str[MAX_PRINT_LEN];
+	char *buf = str;
+#ifndef WIN32
+	LogSlot *slot = NULL;
+
+	if (ring) {
+		slot = RingClaim();
+		if (!slot)
+			return;
+		buf = slot->ls_text;
+	}
+#endif
+	vsnprintf(buf, MAX_PRINT_LEN-1, format, args);
+
+	// Filter out 'no-name'
+	if ( kind == LOG_LINE && debuglevel<LOGALL && strstr(buf, "no-name" ) != NULL )
+		kind = LOG_SKIP;
+
+#ifndef WIN32
+	if (slot) {
+		slot->ls_kind = kind;
+		slot->ls_level = level;
+		RingPublish(slot);
+		return;
+	}
+#endif
+	LogOutput(kind, level, str);
+}
+
 void LogSetOutput(FILE *file)
 {
 	fmsg = file;
@@ -48,75 +277,41 @@ void LogSetOutput(FILE *file)
 
 void LogPrintf(const char *format, ...)
 {
-	char str[MAX_PRINT_LEN]="";
-        int len;
 	va_list args;
-	va_start(args, format);
-	len = vsnprintf(str, MAX_PRINT_LEN-1, format, args);
-	va_end(args);
 
 	if ( debuglevel==LOGCRIT )
 		return;
 
-	if ( !fmsg ) fmsg = stderr;
-
-	if (neednl) {
-		putc('\n', fmsg);
-		neednl = 0;
-	}
-
-        if (len > MAX_PRINT_LEN-1)
-          len = MAX_PRINT_LEN-1;
-	fprintf(fmsg, "%s", str);
-        if (str[len-1] == '\n')
-	  fflush(fmsg);
+	va_start(args, format);
+	LogEmit(LOG_PRINTF, 0, format, args);
+	va_end(args);
 }
 
 void LogStatus(const char *format, ...)
 {
-	char str[MAX_PRINT_LEN]="";
 	va_list args;
-	va_start(args, format);
-	vsnprintf(str, MAX_PRINT_LEN-1, format, args);
-	va_end(args);
 
 	if ( debuglevel==LOGCRIT )
 		return;
 
-	if ( !fmsg ) fmsg = stderr;
-
-	fprintf(fmsg, "%s", str);
-	fflush(fmsg);
-	neednl = 1;
+	va_start(args, format);
+	LogEmit(LOG_STATUS, 0, format, args);
+	va_end(args);
 }
 
-void Log(int level, const char *format, ...)
+void (Log)(int level, const char *format, ...)
 {
-	char str[MAX_PRINT_LEN]="";
 	va_list args;
-	va_start(args, format);
-	vsnprintf(str, MAX_PRINT_LEN-1, format, args);
-	va_end(args);
 
-	// Filter out 'no-name'
-	if ( debuglevel<LOGALL && strstr(str, "no-name" ) != NULL )
+	if ( level > debuglevel )
 		return;
 
-	if ( !fmsg ) fmsg = stderr;
-
-	if ( level <= debuglevel ) {
-		if (neednl) {
-			putc('\n', fmsg);
-			neednl = 0;
-		}
-		fprintf(fmsg, "%s: %s\n", levels[level], str);
-#ifdef _DEBUG
-		fflush(fmsg);
-#endif
-	}
+	va_start(args, format);
+	LogEmit(LOG_LINE, level, format, args);
+	va_end(args);
 }
 
-void LogHex(int level, const char *data, unsigned long len)
+void (LogHex)(int level, const char *data, unsigned long len)
 {
 	unsigned long i;
 	if ( level > debuglevel )
@@ -127,7 +322,7 @@ void LogHex(int level, const char *data, unsigned long len)
 	LogPrintf("\n");
 }
 
-void LogHexString(int level, const char *data, unsigned long len)
+void (LogHexString)(int level, const char *data, unsigned long len)
 {
 	static const char hexdig[] = "0123456789abcdef";
 #define BP_OFFSET 9
@@ -60,6 +60,18 @@ void Log(int level, const char *format, ...);
 void LogHex(int level, const char *data, unsigned long len);
 void LogHexString(int level, const char *data, unsigned long len);
 
+/* write log output from a background thread, so callers never block on
+ * the output stream. returns 0 if that isn't supported here */
+int LogSetAsync(int on);
+
+/* levels that are off cost a compare, the arguments aren't evaluated */
+#define Log(level, ...)	\
+	do { if ((level) <= debuglevel) (Log)(level, __VA_ARGS__); } while (0)
+#define LogHex(level, data, len)	\
+	do { if ((level) <= debuglevel) (LogHex)(level, data, len); } while (0)
+#define LogHexString(level, data, len)	\
+	do { if ((level) <= debuglevel) (LogHexString)(level, data, len); } while (0)
+
 #ifdef __cplusplus
 }
 #endif
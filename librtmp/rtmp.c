@@ -34,9 +34,34 @@
 #include <openssl/rc4.h>
 #endif
 
+#ifdef WIN32
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#endif
+
 #define RTMP_SIG_SIZE 1536
 #define RTMP_LARGE_HEADER_SIZE 12
 
+/* the stream id a first createStream gets from the usual servers */
+#define RTMP_PREDICTED_STREAM_ID	1
+
+/* reads at least this large bypass the socket buffer when it is empty */
+#define RTMP_DIRECT_READ_MIN	4096
+
+/* output a non-blocking session may queue before it is dropped */
+#define RTMP_PENDING_MAX	(1024*1024)
+
+/* chunk headers + body slices gathered into a single send */
+#define RTMP_SEND_IOV	256
+
 static const int packetSize[] = { 12, 8, 4, 1 };
 
 bool RTMP_ctrlC;
@@ -59,7 +84,7 @@ const char RTMPProtocolStringsLower[][7] = {
   "rtmpfp"
 };
 
-static bool DumpMetaData(AMFObject * obj);
+static bool DumpMetaData(AMFCursor * cur);
 static bool HandShake(RTMP * r, bool FP9HandShake);
 static bool SocksNegotiate(RTMP * r);
 
@@ -70,6 +95,8 @@ static bool SendDeleteStream(RTMP * r, double dStreamId);
 static bool SendFCSubscribe(RTMP * r, AVal * subscribepath);
 static bool SendPlay(RTMP * r);
 static bool SendBytesReceived(RTMP * r);
+static bool SendStreamRequest(RTMP * r);
+static int FindCall(RTMP * r, int txn);
 
 #if 0 /* unused */
 static bool SendBGHasStream(RTMP * r, double dId, AVal * playpath);
@@ -86,6 +113,10 @@ static void HandleServerBW(RTMP * r, const RTMPPacket * packet);
 static void HandleClientBW(RTMP * r, const RTMPPacket * packet);
 
 static int ReadN(RTMP * r, char *buffer, int n);
+static bool SendV(RTMP * r, struct iovec *iov, int iovcnt, int n);
+static bool Uncork(RTMP * r);
+static bool SetSockNonBlocking(int sock, bool on);
+static int RTMPSockBuf_Recv(RTMPSockBuf *sb, char *buf, int len);
 static bool WriteN(RTMP * r, const char *buffer, int n);
 
 static void DecodeTEA(AVal *key, AVal *text);
@@ -103,6 +134,31 @@ RTMP_GetTime()
 #endif
 }
 
+/* microseconds on a clock that is not set back or forth, for timing */
+uint64_t
+RTMP_GetTimeUs()
+{
+#ifdef WIN32
+  return (uint64_t) timeGetTime() * 1000;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+const char RTMPPhaseStrings[RTMP_PHASES][11] = {
+  "resolved", "tcp", "c1_sent", "handshaked", "connected", "stream",
+  "playing", "media", "keyframe"
+};
+
+static void
+MarkPhase(RTMP * r, int phase)
+{
+  if (!r->m_stats.st_phases[phase])
+    r->m_stats.st_phases[phase] = RTMP_GetTimeUs();
+}
+
 void
 RTMPPacket_Reset(RTMPPacket * p)
 {
@@ -116,13 +172,25 @@ RTMPPacket_Reset(RTMPPacket * p)
   p->m_nBytesRead = 0;
 }
 
+/* every packet body is preceded by this and RTMP_MAX_HEADER_SIZE bytes
+ * of room for a chunk header */
+typedef struct RTMPBlock
+{
+  RTMPAllocator *b_alloc;	/* NULL if malloc'd */
+  size_t b_size;		/* of the whole block */
+} RTMPBlock;
+
+#define BLOCK_OVERHEAD	(sizeof(RTMPBlock) + RTMP_MAX_HEADER_SIZE)
+#define BodyBlock(body)	((RTMPBlock *)((body) - BLOCK_OVERHEAD))
+
 bool
 RTMPPacket_Alloc(RTMPPacket * p, int nSize)
 {
-  char *ptr = calloc(1, nSize+RTMP_MAX_HEADER_SIZE);
-  if (!ptr)
+  RTMPBlock *b = calloc(1, BLOCK_OVERHEAD + nSize);
+  if (!b)
     return false;
-  p->m_body = ptr + RTMP_MAX_HEADER_SIZE;
+  b->b_size = BLOCK_OVERHEAD + nSize;
+  p->m_body = (char *) b + BLOCK_OVERHEAD;
   p->m_nBytesRead = 0;
   return true;
 }
@@ -132,11 +200,163 @@ RTMPPacket_Free(RTMPPacket * p)
 {
   if (p->m_body)
     {
-      free(p->m_body-RTMP_MAX_HEADER_SIZE);
+      RTMPBlock *b = BodyBlock(p->m_body);
+      if (b->b_alloc)
+	b->b_alloc->pa_free(b->b_alloc->pa_ctx, b, b->b_size);
+      else
+	free(b);
       p->m_body = NULL;
     }
 }
 
+/* blocks of 64 bytes up to 128 KB are pooled, bigger ones malloc'd */
+#define RTMP_POOL_CLASSES	12
+#define RTMP_POOL_SHIFT	6
+#define RTMP_POOL_KEEP	4	/* idle blocks kept per class */
+
+typedef struct RTMPPool
+{
+  RTMPAllocator p_alloc;
+  void *p_free[RTMP_POOL_CLASSES];	/* linked through their first word */
+  int p_nFree[RTMP_POOL_CLASSES];
+  int p_refs;			/* blocks handed out, +1 while attached */
+  bool p_attached;
+} RTMPPool;
+
+static int
+PoolClass(size_t size)
+{
+  int c = 0;
+  while (c < RTMP_POOL_CLASSES && ((size_t) 1 << (c + RTMP_POOL_SHIFT)) < size)
+    c++;
+  return c;
+}
+
+static void
+PoolFree(void *ctx, void *ptr, size_t size)
+{
+  RTMPPool *pool = ctx;
+  int c = PoolClass(size);
+
+  if (pool->p_attached && pool->p_nFree[c] < RTMP_POOL_KEEP)
+    {
+      *(void **) ptr = pool->p_free[c];
+      pool->p_free[c] = ptr;
+      pool->p_nFree[c]++;
+    }
+  else
+    free(ptr);
+
+  if (--pool->p_refs == 0)
+    free(pool);
+}
+
+/* the session is done with its pool. bodies still out free it later */
+static void
+PoolDetach(RTMP * r)
+{
+  RTMPPool *pool = r->m_pool;
+  int c;
+
+  if (!pool)
+    return;
+  r->m_pool = NULL;
+  pool->p_attached = false;
+  for (c = 0; c < RTMP_POOL_CLASSES; c++)
+    while (pool->p_free[c])
+      {
+	void *next = *(void **) pool->p_free[c];
+	free(pool->p_free[c]);
+	pool->p_free[c] = next;
+      }
+  if (--pool->p_refs == 0)
+    free(pool);
+}
+
+static RTMPBlock *
+PoolAlloc(RTMP * r, size_t size)
+{
+  RTMPPool *pool = r->m_pool;
+  RTMPBlock *b;
+  int c;
+
+  if (!pool)
+    {
+      pool = calloc(1, sizeof(RTMPPool));
+      if (!pool)
+	return NULL;
+      pool->p_alloc.pa_free = PoolFree;
+      pool->p_alloc.pa_ctx = pool;
+      pool->p_refs = 1;
+      pool->p_attached = true;
+      r->m_pool = pool;
+    }
+
+  c = PoolClass(size);
+  if (c == RTMP_POOL_CLASSES)
+    {
+      r->m_nPoolMisses++;
+      b = malloc(size);
+      if (b)
+	{
+	  b->b_alloc = NULL;
+	  b->b_size = size;
+	}
+      return b;
+    }
+
+  if (pool->p_free[c])
+    {
+      r->m_nPoolHits++;
+      b = pool->p_free[c];
+      pool->p_free[c] = *(void **) b;
+      pool->p_nFree[c]--;
+    }
+  else
+    {
+      r->m_nPoolMisses++;
+      b = malloc((size_t) 1 << (c + RTMP_POOL_SHIFT));
+      if (!b)
+	return NULL;
+    }
+  pool->p_refs++;
+  b->b_alloc = &pool->p_alloc;
+  b->b_size = (size_t) 1 << (c + RTMP_POOL_SHIFT);
+  return b;
+}
+
+/* like RTMPPacket_Alloc, using the session's allocator */
+static bool
+PacketAlloc(RTMP * r, RTMPPacket * p, int nSize)
+{
+  size_t size = BLOCK_OVERHEAD + nSize;
+  RTMPBlock *b;
+
+  if (r->m_alloc)
+    {
+      b = r->m_alloc->pa_alloc(r->m_alloc->pa_ctx, size);
+      if (b)
+	{
+	  b->b_alloc = r->m_alloc;
+	  b->b_size = size;
+	}
+    }
+  else
+    b = PoolAlloc(r, size);
+  if (!b)
+    return false;
+
+  p->m_body = (char *) b + BLOCK_OVERHEAD;
+  p->m_nBytesRead = 0;
+  return true;
+}
+
+void
+RTMP_SetAllocator(RTMP * r, RTMPAllocator * a)
+{
+  r->m_alloc = a;
+}
+
 void
 RTMPPacket_Dump(RTMPPacket * p)
 {
@@ -149,13 +369,20 @@ RTMPPacket_Dump(RTMPPacket * p)
 void
 RTMP_Init(RTMP * r)
 {
-  int i;
-  for (i = 0; i < RTMP_CHANNELS; i++)
-    {
-      r->m_vecChannelsIn[i] = NULL;
-      r->m_vecChannelsOut[i] = NULL;
-    }
+  memset(r->m_channels, 0, sizeof(r->m_channels));
+  r->m_extChannels = NULL;
+  r->m_numExtChannels = 0;
+  memset(&r->m_read, 0, sizeof(r->m_read));
+  r->m_alloc = NULL;
+  r->m_pool = NULL;
+  r->m_pSendBuf = NULL;
+  r->m_pCork = NULL;
+  r->m_pPending = NULL;
+  r->m_sb.sb_buf = NULL;
   RTMP_Close(r);
+  RTMP_SetBufferSize(r, 0, 0);
+  r->Link.pipeline = false;
+  r->Link.deferS2 = false;
   r->m_nBufferMS = 300;
   r->m_fDuration = 0;
   r->m_stream_id = -1;
@@ -166,6 +393,11 @@ RTMP_Init(RTMP * r)
   r->m_bTimedout = false;
   r->m_pausing = 0;
   r->m_mediaChannel = 0;
+  r->m_nBytesCopied = 0;
+  r->m_nBytesDirect = 0;
+  r->m_nPoolHits = 0;
+  r->m_nPoolMisses = 0;
+  memset(&r->m_stats, 0, sizeof(r->m_stats));
 }
 
 double
@@ -174,6 +406,56 @@ RTMP_GetDuration(RTMP * r)
   return r->m_fDuration;
 }
 
+/* Look up the state of a chunk stream. Extended ids are kept sorted in
+ * m_extChannels, a new slot is inserted there if create is set. The
+ * returned pointer is only valid until the next insertion.
+ */
+static RTMPChannel *
+GetChannel(RTMP * r, int nChannel, bool create)
+{
+  int lo = 0, hi = r->m_numExtChannels;
+  RTMPChannel *ch;
+
+  if (nChannel < RTMP_CHANNELS_INLINE)
+    return &r->m_channels[nChannel];
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (r->m_extChannels[mid].ch_id < nChannel)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if (lo < r->m_numExtChannels && r->m_extChannels[lo].ch_id == nChannel)
+    return &r->m_extChannels[lo];
+
+  if (!create)
+    return NULL;
+
+  if (!(r->m_numExtChannels & 0x0f))
+    {
+      ch = realloc(r->m_extChannels,
+		   (r->m_numExtChannels + 16) * sizeof(RTMPChannel));
+      if (!ch)
+	return NULL;
+      r->m_extChannels = ch;
+    }
+  ch = &r->m_extChannels[lo];
+  memmove(ch + 1, ch, (r->m_numExtChannels - lo) * sizeof(RTMPChannel));
+  r->m_numExtChannels++;
+  memset(ch, 0, sizeof(RTMPChannel));
+  ch->ch_id = nChannel;
+  return ch;
+}
+
+uint32_t
+RTMP_GetChannelTimestamp(RTMP * r, int nChannel)
+{
+  RTMPChannel *ch = GetChannel(r, nChannel, false);
+  return ch ? ch->ch_timestamp : 0;
+}
+
 bool
 RTMP_IsConnected(RTMP * r)
 {
@@ -186,6 +468,15 @@ RTMP_IsTimedout(RTMP * r)
   return r->m_bTimedout;
 }
 
+bool
+RTMP_SetNonBlocking(RTMP * r, bool on)
+{
+  if (!SetSockNonBlocking(r->m_socket, on))
+    return false;
+  r->m_bNonBlocking = on;
+  return true;
+}
+
 void
 RTMP_SetBufferMS(RTMP * r, int size)
 {
@@ -305,65 +596,404 @@ RTMP_SetupStream(RTMP * r,
 }
 
 static bool
-add_addr_info(struct sockaddr_in *service, const char *hostname, int port)
+SetSockNonBlocking(int sock, bool on)
 {
-  service->sin_addr.s_addr = inet_addr(hostname);
-  if (service->sin_addr.s_addr == INADDR_NONE)
+#ifdef WIN32
+  u_long arg = on;
+  return ioctlsocket(sock, FIONBIO, &arg) == 0;
+#else
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (flags < 0)
+    return false;
+  if (on)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+  return fcntl(sock, F_SETFL, flags) == 0;
+#endif
+}
+
+/* Resolved addresses are kept per host for RTMP_DNS_TTL seconds, so a
+ * reconnect doesn't wait on DNS. getaddrinfo doesn't report the records'
+ * TTL, the constant bounds it instead. When a lookup fails an expired
+ * entry is still used rather than failing the connect.
+ */
+#define RTMP_DNS_TTL	60
+#define RTMP_DNS_HOSTS	16
+
+#ifndef WIN32
+typedef struct RTMPHost {
+  char *host;
+  time_t expires;
+  int naddrs;
+  RTMPAddr addrs[RTMP_MAX_ADDRS];
+  unsigned int used;
+} RTMPHost;
+
+static RTMPHost dnsCache[RTMP_DNS_HOSTS];
+static unsigned int dnsClock;
+static pthread_mutex_t dnsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static RTMPHost *
+FindHost(const char *host)
+{
+  int i;
+  for (i = 0; i < RTMP_DNS_HOSTS; i++)
+    if (dnsCache[i].host && !strcmp(dnsCache[i].host, host))
+      return &dnsCache[i];
+  return NULL;
+}
+#endif
+
+static void
+SetAddrPort(RTMPAddr *a, int port)
+{
+  if (a->addr.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *) &a->addr)->sin6_port = htons(port);
+  else
+    ((struct sockaddr_in *) &a->addr)->sin_port = htons(port);
+}
+
+/* fill addrs with up to max addresses of host, alternating between
+ * address families for RTMP_ConnectAny. returns the count, 0 on failure */
+int
+RTMP_Resolve(const char *host, int port, RTMPAddr *addrs, int max)
+{
+  struct addrinfo hints, *res, *ai;
+  RTMPAddr found[RTMP_MAX_ADDRS];
+  int i, n = 0, err, fam, other = 0;
+#ifndef WIN32
+  RTMPHost *h;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&dnsLock);
+  h = FindHost(host);
+  if (h && h->expires > now)
+    {
+      h->used = ++dnsClock;
+      n = h->naddrs < max ? h->naddrs : max;
+      memcpy(addrs, h->addrs, n * sizeof(RTMPAddr));
+    }
+  pthread_mutex_unlock(&dnsLock);
+  if (n)
+    goto out;
+#endif
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  err = getaddrinfo(host, NULL, &hints, &res);
+  if (err)
+    {
+#ifndef WIN32
+      pthread_mutex_lock(&dnsLock);
+      h = FindHost(host);
+      if (h)
+	{
+	  n = h->naddrs < max ? h->naddrs : max;
+	  memcpy(addrs, h->addrs, n * sizeof(RTMPAddr));
+	}
+      pthread_mutex_unlock(&dnsLock);
+      if (n)
+	{
+	  Log(LOGWARNING, "%s, lookup of %s failed (%s), using expired addresses",
+	      __FUNCTION__, host, gai_strerror(err));
+	  goto out;
+	}
+#endif
+      Log(LOGERROR, "Problem accessing the DNS. (addr: %s, %s)", host,
+	  gai_strerror(err));
+      return 0;
+    }
+
+  /* take the families in turn, keeping the resolver's order in each,
+   * and leave room for some of the second family */
+  fam = res->ai_family;
+  for (ai = res; ai; ai = ai->ai_next)
+    if (ai->ai_family != fam)
+      other++;
+  if (other > RTMP_MAX_ADDRS / 2)
+    other = RTMP_MAX_ADDRS / 2;
+  for (i = 0; i < 2; i++)
     {
-      struct hostent *host = gethostbyname(hostname);
-      if (host == NULL || host->h_addr == NULL)
+      int k = 0;
+      for (ai = res; ai && n < RTMP_MAX_ADDRS - (i ? 0 : other);
+	   ai = ai->ai_next)
 	{
-	  Log(LOGERROR, "Problem accessing the DNS. (addr: %s)", hostname);
-	  return false;
+	  if ((i ? ai->ai_family == fam : ai->ai_family != fam)
+	      || (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+	      || ai->ai_addrlen > sizeof(found[0].addr))
+	    continue;
+	  if (!i)
+	    {
+	      /* first family goes to the even slots for now */
+	      memcpy(&found[n].addr, ai->ai_addr, ai->ai_addrlen);
+	      found[n++].len = ai->ai_addrlen;
+	    }
+	  else
+	    {
+	      /* slot the other family in after each of the first */
+	      int at = 2 * k + 1;
+	      if (at > n)
+		at = n;
+	      memmove(&found[at + 1], &found[at], (n - at) * sizeof(RTMPAddr));
+	      memcpy(&found[at].addr, ai->ai_addr, ai->ai_addrlen);
+	      found[at].len = ai->ai_addrlen;
+	      n++;
+	      k++;
+	    }
 	}
-      service->sin_addr = *(struct in_addr *) host->h_addr;
+    }
+  freeaddrinfo(res);
+  if (!n)
+    {
+      Log(LOGERROR, "Problem accessing the DNS. (addr: %s, no addresses)", host);
+      return 0;
     }
 
-  service->sin_port = htons(port);
-  return true;
+#ifndef WIN32
+  pthread_mutex_lock(&dnsLock);
+  h = FindHost(host);
+  if (!h)
+    {
+      char *dup = strdup(host);
+      h = &dnsCache[0];
+      for (i = 1; i < RTMP_DNS_HOSTS && h->host; i++)
+	if (!dnsCache[i].host || dnsCache[i].used < h->used)
+	  h = &dnsCache[i];
+      free(h->host);
+      h->host = dup;
+    }
+  if (h->host)
+    {
+      h->expires = now + RTMP_DNS_TTL;
+      h->naddrs = n;
+      h->used = ++dnsClock;
+      memcpy(h->addrs, found, n * sizeof(RTMPAddr));
+    }
+  pthread_mutex_unlock(&dnsLock);
+#endif
+
+  if (n > max)
+    n = max;
+  memcpy(addrs, found, n * sizeof(RTMPAddr));
+
+out:
+  for (i = 0; i < n; i++)
+    SetAddrPort(&addrs[i], port);
+  Log(LOGDEBUG, "%s, %s has %d address%s", __FUNCTION__, host, n,
+      n == 1 ? "" : "es");
+  return n;
 }
 
-bool
-RTMP_Connect0(RTMP *r, struct sockaddr *service)
+/* wait up to ms (forever if negative) for connects in progress on socks (-1 is unused) to
+ * finish either way, flagging those in ready */
+static int
+WaitConnect(int *socks, int n, int ms, bool *ready)
 {
-  // close any previous connection
-  RTMP_Close(r);
+  int i, rc;
+#ifdef WIN32
+  fd_set wfds, efds;
+  struct timeval tv;
 
-  r->m_bTimedout = false;
-  r->m_pausing = 0;
-  r->m_fDuration = 0.0;
+  FD_ZERO(&wfds);
+  FD_ZERO(&efds);
+  for (i = 0; i < n; i++)
+    if (socks[i] != -1)
+      {
+	FD_SET(socks[i], &wfds);
+	FD_SET(socks[i], &efds);
+      }
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  rc = select(0, NULL, &wfds, &efds, ms < 0 ? NULL : &tv);
+  for (i = 0; i < n; i++)
+    ready[i] = rc > 0 && socks[i] != -1
+      && (FD_ISSET(socks[i], &wfds) || FD_ISSET(socks[i], &efds));
+#else
+  struct pollfd pfd[RTMP_MAX_ADDRS];
+  int idx[RTMP_MAX_ADDRS], np = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      ready[i] = false;
+      if (socks[i] == -1)
+	continue;
+      pfd[np].fd = socks[i];
+      pfd[np].events = POLLOUT;
+      pfd[np].revents = 0;
+      idx[np++] = i;
+    }
+  rc = poll(pfd, np, ms);
+  for (i = 0; rc > 0 && i < np; i++)
+    ready[idx[i]] = pfd[i].revents != 0;
+#endif
+  return rc;
+}
 
-  r->m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (r->m_socket != -1)
+/* Happy eyeballs (RFC 8305): try the addresses in order, starting the next
+ * one when the last hasn't connected within RTMP_CONNECT_DELAY ms or has
+ * failed, and keep the first that connects. timeout is in seconds, 0 for
+ * none. returns the connected, blocking socket or -1.
+ */
+#define RTMP_CONNECT_DELAY	250
+
+int
+RTMP_ConnectAny(RTMPAddr *addrs, int n, int timeout)
+{
+  int socks[RTMP_MAX_ADDRS];
+  int i, next = 0, pending = 0, sock = -1, err = 0;
+  uint64_t now, start, last = 0;
+
+  if (n > RTMP_MAX_ADDRS)
+    n = RTMP_MAX_ADDRS;
+  start = RTMP_GetTimeUs() / 1000;
+  for (;;)
     {
-      if (connect
-	  (r->m_socket, service, sizeof(struct sockaddr)) < 0)
+      bool ready[RTMP_MAX_ADDRS];
+      int64_t wait;
+
+      now = RTMP_GetTimeUs() / 1000;
+      if (next < n && (!pending || now - last >= RTMP_CONNECT_DELAY))
 	{
-	  int err = GetSockError();
-	  Log(LOGERROR, "%s, failed to connect socket. %d (%s)", __FUNCTION__,
-	      err, strerror(err));
-	  RTMP_Close(r);
-	  return false;
+	  int s = socket(addrs[next].addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+
+	  socks[next] = -1;
+	  if (s == -1)
+	    err = GetSockError();
+	  else if (!SetSockNonBlocking(s, true))
+	    {
+	      err = GetSockError();
+	      closesocket(s);
+	    }
+	  else if (connect(s, (struct sockaddr *) &addrs[next].addr,
+			   addrs[next].len) == 0)
+	    {
+	      sock = s;
+	      break;
+	    }
+	  else
+	    {
+	      err = GetSockError();
+#ifdef WIN32
+	      if (err == WSAEWOULDBLOCK)
+#else
+	      if (err == EINPROGRESS)
+#endif
+		{
+		  socks[next] = s;
+		  pending++;
+		}
+	      else
+		closesocket(s);
+	    }
+	  next++;
+	  last = now;
+	  continue;
 	}
+      if (!pending)
+	break;
 
-      if (r->Link.socksport)
+      wait = -1;
+      if (timeout > 0)
 	{
-	  Log(LOGDEBUG, "%s ... SOCKS negotiation", __FUNCTION__);
-	  if (!SocksNegotiate(r))
+	  wait = (int64_t) timeout * 1000 - (int64_t) (now - start);
+	  if (wait <= 0)
 	    {
-	      Log(LOGERROR, "%s, SOCKS negotiation failed.", __FUNCTION__);
-	      RTMP_Close(r);
-	      return false;
+	      err = ETIMEDOUT;
+	      break;
 	    }
 	}
+      if (next < n
+	  && (wait < 0 || wait > RTMP_CONNECT_DELAY - (int64_t) (now - last)))
+	wait = RTMP_CONNECT_DELAY - (int64_t) (now - last);
+
+      if (WaitConnect(socks, next, wait, ready) < 0)
+	{
+	  err = GetSockError();
+	  if (err == EINTR)
+	    continue;
+	  break;
+	}
+      for (i = 0; i < next && sock == -1; i++)
+	{
+	  int soerr = 0;
+	  socklen_t len = sizeof(soerr);
+
+	  if (socks[i] == -1 || !ready[i])
+	    continue;
+	  if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, (char *) &soerr, &len))
+	    soerr = GetSockError();
+	  if (!soerr)
+	    {
+	      sock = socks[i];
+	      socks[i] = -1;
+	    }
+	  else
+	    {
+	      err = soerr;
+	      closesocket(socks[i]);
+	      socks[i] = -1;
+	      pending--;
+	      /* don't sit out the delay after a refusal */
+	      last = 0;
+	    }
+	}
+      if (sock != -1)
+	break;
     }
-  else
+
+  for (i = 0; i < next; i++)
+    if (socks[i] != -1)
+      closesocket(socks[i]);
+
+  if (sock == -1)
+    {
+      errno = err;
+      return -1;
+    }
+  SetSockNonBlocking(sock, false);
+  return sock;
+}
+
+/* connect to the first of addrs that answers */
+static bool
+ConnectAddrs(RTMP *r, RTMPAddr *addrs, int n)
+{
+  uint32_t t;
+
+  // close any previous connection
+  RTMP_Close(r);
+
+  r->m_bTimedout = false;
+  r->m_pausing = 0;
+  r->m_fDuration = 0.0;
+  r->m_stats.st_connects++;
+
+  t = RTMP_GetTime();
+  r->m_socket = RTMP_ConnectAny(addrs, n, r->Link.timeout);
+  r->m_stats.st_connectTime = RTMP_GetTime() - t;
+  if (r->m_socket == -1)
     {
-      Log(LOGERROR, "%s, failed to create socket. Error: %d", __FUNCTION__,
-	  GetSockError());
+      int err = errno;
+      Log(LOGERROR, "%s, failed to connect socket. %d (%s)", __FUNCTION__,
+	  err, strerror(err));
+      r->m_socket = 0;
       return false;
     }
 
+  if (r->Link.socksport)
+    {
+      Log(LOGDEBUG, "%s ... SOCKS negotiation", __FUNCTION__);
+      if (!SocksNegotiate(r))
+	{
+	  Log(LOGERROR, "%s, SOCKS negotiation failed.", __FUNCTION__);
+	  RTMP_Close(r);
+	  return false;
+	}
+    }
+
   // set timeout
   SET_RCVTIMEO(tv, r->Link.timeout);
   if (setsockopt
@@ -376,12 +1006,53 @@ RTMP_Connect0(RTMP *r, struct sockaddr *service)
   int on = 1;
   setsockopt(r->m_socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 
+  if (r->Link.rcvbuf
+      && setsockopt(r->m_socket, SOL_SOCKET, SO_RCVBUF, &r->Link.rcvbuf,
+		    sizeof(r->Link.rcvbuf)))
+    Log(LOGWARNING, "%s, Setting socket receive buffer to %d failed!",
+	__FUNCTION__, r->Link.rcvbuf);
+
   return true;
 }
 
+bool
+RTMP_Connect0(RTMP *r, struct sockaddr *service)
+{
+  RTMPAddr addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.len = service->sa_family == AF_INET6 ?
+    sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+  memcpy(&addr.addr, service, addr.len);
+  return ConnectAddrs(r, &addr, 1);
+}
+
+void
+RTMP_SetBufferSize(RTMP * r, int size, int rcvbuf)
+{
+  RTMPSockBuf *sb = &r->m_sb;
+
+  if (size)
+    {
+      sb->sb_minsize = sb->sb_maxsize = size;
+    }
+  else
+    {
+      size = RTMP_BUFFER_CACHE_SIZE;
+      sb->sb_minsize = RTMP_BUFFER_MIN_SIZE;
+      sb->sb_maxsize = RTMP_BUFFER_MAX_SIZE;
+    }
+  /* an existing buffer is brought within bounds on its next fill */
+  if (!sb->sb_buf)
+    sb->sb_bufsize = size;
+  r->Link.rcvbuf = rcvbuf;
+}
+
 bool
 RTMP_Connect1(RTMP *r, RTMPPacket *cp)
 {
+  uint32_t t = RTMP_GetTime();
+
   Log(LOGDEBUG, "%s, ... connected, handshaking", __FUNCTION__);
   if (!HandShake(r, true))
     {
@@ -389,9 +1060,12 @@ RTMP_Connect1(RTMP *r, RTMPPacket *cp)
       RTMP_Close(r);
       return false;
     }
+  r->m_stats.st_handshakeTime = RTMP_GetTime() - t;
+  MarkPhase(r, RTMP_PHASE_HANDSHAKED);
   Log(LOGDEBUG, "%s, handshaked", __FUNCTION__);
 
-  if (!SendConnectPacket(r, cp))
+  /* the handshake held C2 back, connect goes out in the same write */
+  if (!SendConnectPacket(r, cp) || !Uncork(r))
     {
       Log(LOGERROR, "%s, RTMP connect failed.", __FUNCTION__);
       RTMP_Close(r);
@@ -403,28 +1077,29 @@ RTMP_Connect1(RTMP *r, RTMPPacket *cp)
 bool
 RTMP_Connect(RTMP *r, RTMPPacket *cp)
 {
-  struct sockaddr_in service;
+  RTMPAddr addrs[RTMP_MAX_ADDRS];
+  int n;
+
   if (!r->Link.hostname)
     return false;
 
-  memset(&service, 0, sizeof(struct sockaddr_in));
-  service.sin_family = AF_INET;
-
   if (r->Link.socksport)
     {
       // Connect via SOCKS
-      if (!add_addr_info(&service, r->Link.sockshost, r->Link.socksport))
-	return false;
+      n = RTMP_Resolve(r->Link.sockshost, r->Link.socksport, addrs, RTMP_MAX_ADDRS);
     }
   else
     {
       // Connect directly
-      if (!add_addr_info(&service, r->Link.hostname, r->Link.port))
-	return false;
+      n = RTMP_Resolve(r->Link.hostname, r->Link.port, addrs, RTMP_MAX_ADDRS);
     }
+  if (!n)
+    return false;
+  MarkPhase(r, RTMP_PHASE_RESOLVED);
 
-  if (!RTMP_Connect0(r, (struct sockaddr *)&service))
+  if (!ConnectAddrs(r, addrs, n))
     return false;
+  MarkPhase(r, RTMP_PHASE_TCP);
 
   r->m_bSendCounter = true;
 
@@ -434,11 +1109,22 @@ RTMP_Connect(RTMP *r, RTMPPacket *cp)
 static bool
 SocksNegotiate(RTMP * r)
 {
-  struct sockaddr_in service;
-  memset(&service, 0, sizeof(struct sockaddr_in));
+  RTMPAddr addrs[RTMP_MAX_ADDRS];
+  unsigned long addr = 0;
+  int i, n;
 
-  add_addr_info(&service, r->Link.hostname, r->Link.port);
-  unsigned long addr = htonl(service.sin_addr.s_addr);
+  /* SOCKS4 can only ask for an IPv4 address */
+  n = RTMP_Resolve(r->Link.hostname, r->Link.port, addrs, RTMP_MAX_ADDRS);
+  for (i = 0; i < n; i++)
+    if (addrs[i].addr.ss_family == AF_INET)
+      break;
+  if (i == n)
+    {
+      Log(LOGERROR, "%s, no IPv4 address for %s", __FUNCTION__,
+	  r->Link.hostname);
+      return false;
+    }
+  addr = htonl(((struct sockaddr_in *) &addrs[i].addr)->sin_addr.s_addr);
 
   char packet[] = {
     4, 1,			// SOCKS 4, connect
@@ -477,6 +1163,21 @@ RTMP_ConnectStream(RTMP * r, double seekTime, uint32_t dLength)
 
   r->m_mediaChannel = 0;
 
+  /* connect still unanswered: ask for a stream and play on the id servers
+   * hand out first, the replies get checked as they come in */
+  if (r->Link.pipeline && !r->Link.token.av_len && r->m_numInvokes == 1
+      && FindCall(r, 1) >= 0)
+    {
+      Log(LOGDEBUG, "%s, pipelining createStream and play", __FUNCTION__);
+      r->m_bPipelined = true;
+      r->m_stream_id = RTMP_PREDICTED_STREAM_ID;
+      r->m_bCorked = true;
+      if (!SendStreamRequest(r) || !SendPlay(r)
+	  || !RTMP_SendCtrl(r, 3, r->m_stream_id, r->m_nBufferMS)
+	  || !Uncork(r))
+	return false;
+    }
+
   while (!r->m_bPlaying && RTMP_IsConnected(r) && RTMP_ReadPacket(r, &packet))
     {
       if (RTMPPacket_IsReady(&packet))
@@ -506,7 +1207,7 @@ RTMP_ReconnectStream(RTMP * r, int bufferTime, double seekTime,
 {
   RTMP_DeleteStream(r);
 
-  RTMP_SendCreateStream(r, 2.0);
+  RTMP_SendCreateStream(r, ++r->m_numInvokes);
 
   RTMP_SetBufferMS(r, bufferTime);
 
@@ -581,7 +1282,7 @@ RTMP_GetNextMediaPacket(RTMP * r, RTMPPacket * packet)
   if (bHasMediaPacket)
     r->m_bPlaying = true;
   else if (r->m_bTimedout && !r->m_pausing)
-    r->m_pauseStamp = r->m_channelTimestamp[r->m_mediaChannel];
+    r->m_pauseStamp = RTMP_GetChannelTimestamp(r, r->m_mediaChannel);
 
   return bHasMediaPacket;
 }
@@ -621,6 +1322,7 @@ RTMP_ClientPacket(RTMP * r, RTMPPacket * packet)
       // audio data
       //Log(LOGDEBUG, "%s, received: audio %lu bytes", __FUNCTION__, packet.m_nBodySize);
       HandleAudio(r, packet);
+      MarkPhase(r, RTMP_PHASE_MEDIA);
       bHasMediaPacket = 1;
       if (!r->m_mediaChannel)
 	r->m_mediaChannel = packet->m_nChannel;
@@ -632,6 +1334,11 @@ RTMP_ClientPacket(RTMP * r, RTMPPacket * packet)
       // video data
       //Log(LOGDEBUG, "%s, received: video %lu bytes", __FUNCTION__, packet.m_nBodySize);
       HandleVideo(r, packet);
+      MarkPhase(r, RTMP_PHASE_MEDIA);
+      /* a keyframe, but not an AVC sequence header */
+      if (packet->m_nBodySize > 1 && (packet->m_body[0] & 0xf0) == 0x10
+	  && (packet->m_body[0] != 0x17 || packet->m_body[1] != 0))
+	MarkPhase(r, RTMP_PHASE_KEYFRAME);
       bHasMediaPacket = 1;
       if (!r->m_mediaChannel)
 	r->m_mediaChannel = packet->m_nChannel;
@@ -744,6 +1451,23 @@ extern FILE *netstackdump;
 extern FILE *netstackdump_read;
 #endif
 
+/* refill the socket buffer. RTMPE input is decrypted here in one pass
+ * over the new bytes rather than piecemeal as it is consumed */
+static int
+FillBuffer(RTMP * r)
+{
+  int nBytes = RTMPSockBuf_Fill(&r->m_sb);
+  r->m_stats.st_recvCalls++;
+#ifdef CRYPTO
+  if (nBytes > 0 && r->Link.rc4keyIn)
+    {
+      uint8_t *ptr = (uint8_t *) r->m_pBufferStart + r->m_nBufferSize - nBytes;
+      RC4(r->Link.rc4keyIn, nBytes, ptr, ptr);
+    }
+#endif
+  return nBytes;
+}
+
 static int
 ReadN(RTMP * r, char *buffer, int n)
 {
@@ -760,21 +1484,46 @@ ReadN(RTMP * r, char *buffer, int n)
   while (n > 0)
     {
       int nBytes = 0, nRead;
-      if (r->m_nBufferSize == 0)
-	if (RTMPSockBuf_Fill(&r->m_sb)<1)
-	  {
-	    if (!r->m_bTimedout)
-	      RTMP_Close(r);
-	    return 0;
-	  }
-      nRead = ((n < r->m_nBufferSize) ? n : r->m_nBufferSize);
+      if (r->m_nBufferSize == 0 && n >= RTMP_DIRECT_READ_MIN)
+	{
+	  /* nothing buffered and a big read, receive straight into the caller's buffer */
+	  nRead = RTMPSockBuf_Recv(&r->m_sb, ptr, n);
+	  r->m_stats.st_recvCalls++;
+	  if (nRead < 1)
+	    {
+	      if (!r->m_bTimedout)
+		RTMP_Close(r);
+	      break;
+	    }
+#ifdef CRYPTO
+	  if (r->Link.rc4keyIn)
+	    RC4(r->Link.rc4keyIn, nRead, (uint8_t *) ptr, (uint8_t *) ptr);
+#endif
+	  r->m_nBytesDirect += nRead;
+	}
+      else
+	{
+	  if (r->m_nBufferSize == 0)
+	    if (FillBuffer(r)<1)
+	      {
+		if (!r->m_bTimedout)
+		  RTMP_Close(r);
+		break;
+	      }
+	  nRead = ((n < r->m_nBufferSize) ? n : r->m_nBufferSize);
+	  if (nRead > 0)
+	    {
+	      memcpy(ptr, r->m_pBufferStart, nRead);
+	      r->m_pBufferStart += nRead;
+	      r->m_nBufferSize -= nRead;
+	      r->m_nBytesCopied += nRead;
+	    }
+	}
       if (nRead > 0)
 	{
-	  memcpy(ptr, r->m_pBufferStart, nRead);
-	  r->m_pBufferStart += nRead;
-	  r->m_nBufferSize -= nRead;
 	  nBytes = nRead;
 	  r->m_nBytesIn += nRead;
+	  r->m_stats.st_bytesIn += nRead;
 	  if (r->m_bSendCounter && r->m_nBytesIn > r->m_nBytesInSent + r->m_nClientBW / 2)
 	    SendBytesReceived(r);
 	}
@@ -792,13 +1541,6 @@ ReadN(RTMP * r, char *buffer, int n)
 	  break;
 	}
 
-#ifdef CRYPTO
-      if (r->Link.rc4keyIn)
-	{
-	  RC4(r->Link.rc4keyIn, nBytes, (uint8_t *) ptr, (uint8_t *) ptr);
-	}
-#endif
-
       n -= nBytes;
       ptr += nBytes;
     }
@@ -806,43 +1548,213 @@ ReadN(RTMP * r, char *buffer, int n)
   return nOriginalSize - n;
 }
 
+/* append n bytes from iov to a growable buffer */
 static bool
-WriteN(RTMP * r, const char *buffer, int n)
+BufAppend(char **buf, int *size, int *len, struct iovec *iov, int iovcnt,
+	  int n)
+{
+  int i;
+
+  if (*len + n > *size)
+    {
+      int nsize = *size ? *size : 4096;
+      char *ptr;
+
+      while (nsize < *len + n)
+	nsize *= 2;
+      ptr = realloc(*buf, nsize);
+      if (!ptr)
+	return false;
+      *buf = ptr;
+      *size = nsize;
+    }
+  for (i = 0; i < iovcnt; i++)
+    {
+      memcpy(*buf + *len, iov[i].iov_base, iov[i].iov_len);
+      *len += iov[i].iov_len;
+    }
+  return true;
+}
+
+/* hold output back, it goes out in one write with what follows */
+static bool
+CorkAppend(RTMP * r, struct iovec *iov, int iovcnt, int n)
+{
+  return BufAppend(&r->m_pCork, &r->m_nCorkSize, &r->m_nCorked, iov, iovcnt,
+		   n);
+}
+
+/* queue what a non-blocking socket didn't take, RTMP_Flush sends it */
+static bool
+PendAppend(RTMP * r, struct iovec *iov, int iovcnt, int n)
+{
+  if (r->m_nPending + n > RTMP_PENDING_MAX
+      || !BufAppend(&r->m_pPending, &r->m_nPendingSize, &r->m_nPending,
+		    iov, iovcnt, n))
+    {
+      Log(LOGERROR, "%s, %d bytes of output queued, giving up",
+	  __FUNCTION__, r->m_nPending + n);
+      RTMP_Close(r);
+      return false;
+    }
+  return true;
+}
+
+static bool
+WouldBlock(int sockerr)
+{
+#ifdef WIN32
+  return sockerr == WSAEWOULDBLOCK;
+#else
+  return sockerr == EAGAIN || sockerr == EWOULDBLOCK;
+#endif
+}
+
+int
+RTMP_Flush(RTMP * r)
+{
+  int off = 0;
+
+  while (off < r->m_nPending)
+    {
+      int nBytes = send(r->m_socket, r->m_pPending + off,
+			r->m_nPending - off, 0);
+      r->m_stats.st_sendCalls++;
+      if (nBytes < 0)
+	{
+	  int sockerr = GetSockError();
+
+	  if (sockerr == EINTR && !RTMP_ctrlC)
+	    continue;
+	  if (WouldBlock(sockerr))
+	    break;
+	  Log(LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
+	      sockerr, r->m_nPending - off);
+	  RTMP_Close(r);
+	  return -1;
+	}
+#ifdef _DEBUG
+      fwrite(r->m_pPending + off, 1, nBytes, netstackdump);
+#endif
+      r->m_stats.st_bytesOut += nBytes;
+      off += nBytes;
+    }
+  r->m_nPending -= off;
+  if (off && r->m_nPending)
+    memmove(r->m_pPending, r->m_pPending + off, r->m_nPending);
+  return r->m_nPending;
+}
+
+/* send what was held back */
+static bool
+Uncork(RTMP * r)
+{
+  struct iovec iov;
+  int n = r->m_nCorked;
+
+  r->m_bCorked = false;
+  r->m_nCorked = 0;
+  if (!n)
+    return true;
+  iov.iov_base = r->m_pCork;
+  iov.iov_len = n;
+  return SendV(r, &iov, 1, n);
+}
+
+static bool
+WriteV(RTMP * r, struct iovec *iov, int iovcnt)
 {
-  const char *ptr = buffer;
+  int n = 0, i;
 #ifdef CRYPTO
   char *encrypted = 0;
   char buf[RTMP_BUFFER_CACHE_SIZE];
+  struct iovec eiov;
+#endif
 
+  for (i = 0; i < iovcnt; i++)
+    n += iov[i].iov_len;
+
+#ifdef CRYPTO
   if (r->Link.rc4keyOut)
     {
+      /* the keystream runs across the whole message, so encrypt the
+       * pieces in order into one contiguous buffer */
+      char *ptr;
+
       if (n > sizeof(buf))
-	encrypted = (char *) malloc(n);
+	{
+	  if (n > r->m_nSendBufSize)
+	    {
+	      /* grow the session's scratch buffer, it is kept until close */
+	      char *ptr = realloc(r->m_pSendBuf, n);
+	      if (!ptr)
+		return false;
+	      r->m_pSendBuf = ptr;
+	      r->m_nSendBufSize = n;
+	    }
+	  encrypted = r->m_pSendBuf;
+	}
       else
 	encrypted = (char *) buf;
       ptr = encrypted;
-      RC4(r->Link.rc4keyOut, n, (uint8_t *) buffer, (uint8_t *) ptr);
+      for (i = 0; i < iovcnt; i++)
+	{
+	  RC4(r->Link.rc4keyOut, iov[i].iov_len, (uint8_t *) iov[i].iov_base,
+	      (uint8_t *) ptr);
+	  ptr += iov[i].iov_len;
+	}
+      eiov.iov_base = encrypted;
+      eiov.iov_len = n;
+      iov = &eiov;
+      iovcnt = 1;
     }
 #endif
 
+  if (r->m_bCorked)
+    return CorkAppend(r, iov, iovcnt, n);
+  return SendV(r, iov, iovcnt, n);
+}
+
+/* n bytes from iov to the socket, as they are */
+static bool
+SendV(RTMP * r, struct iovec *iov, int iovcnt, int n)
+{
+  /* nothing may overtake output that is still queued */
+  if (r->m_nPending)
+    {
+      if (RTMP_Flush(r) < 0)
+	return false;
+      if (r->m_nPending)
+	return PendAppend(r, iov, iovcnt, n);
+    }
+
   while (n > 0)
     {
-#ifdef _DEBUG
-      fwrite(ptr, 1, n, netstackdump);
-#endif
+      int nBytes;
+#ifdef WIN32
+      nBytes = send(r->m_socket, iov->iov_base, iov->iov_len, 0);
+#else
+      struct msghdr msg;
 
-      int nBytes = send(r->m_socket, ptr, n, 0);
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      nBytes = sendmsg(r->m_socket, &msg, 0);
+#endif
+      r->m_stats.st_sendCalls++;
       //Log(LOGDEBUG, "%s: %d\n", __FUNCTION__, nBytes);
 
       if (nBytes < 0)
 	{
 	  int sockerr = GetSockError();
-	  Log(LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
-	      sockerr, n);
 
 	  if (sockerr == EINTR && !RTMP_ctrlC)
 	    continue;
-
+	  /* the send buffer is full, keep the rest for RTMP_Flush */
+	  if (r->m_bNonBlocking && WouldBlock(sockerr))
+	    return PendAppend(r, iov, iovcnt, n);
+	  Log(LOGERROR, "%s, RTMP send error %d (%d bytes)", __FUNCTION__,
+	      sockerr, n);
 	  RTMP_Close(r);
 	  n = 1;
 	  break;
@@ -851,18 +1763,41 @@ WriteN(RTMP * r, const char *buffer, int n)
       if (nBytes == 0)
 	break;
 
+      r->m_stats.st_bytesOut += nBytes;
       n -= nBytes;
-      ptr += nBytes;
-    }
-
-#ifdef CRYPTO
-  if (encrypted && encrypted != buf)
-    free(encrypted);
+      /* skip over what went out, resume mid-segment on a short write */
+      while (iovcnt > 0 && nBytes >= (int) iov->iov_len)
+	{
+#ifdef _DEBUG
+	  fwrite(iov->iov_base, 1, iov->iov_len, netstackdump);
 #endif
+	  nBytes -= iov->iov_len;
+	  iov++;
+	  iovcnt--;
+	}
+      if (nBytes)
+	{
+#ifdef _DEBUG
+	  fwrite(iov->iov_base, 1, nBytes, netstackdump);
+#endif
+	  iov->iov_base = (char *) iov->iov_base + nBytes;
+	  iov->iov_len -= nBytes;
+	}
+    }
 
   return n == 0;
 }
 
+static bool
+WriteN(RTMP * r, const char *buffer, int n)
+{
+  struct iovec iov;
+
+  iov.iov_base = (char *) buffer;
+  iov.iov_len = n;
+  return WriteV(r, &iov, 1);
+}
+
 #define SAVC(x)	static const AVal av_##x = AVC(#x)
 
 SAVC(app);
@@ -880,108 +1815,103 @@ SAVC(objectEncoding);
 SAVC(secureToken);
 SAVC(secureTokenResponse);
 
+static AMFObjectProperty *
+SetProp(AMFObjectProperty *p, const AVal *name, AMFDataType type,
+	double num, const AVal *str)
+{
+  p->p_name = *name;
+  p->p_type = type;
+  if (str)
+    p->p_vu.p_aval = *str;
+  else
+    p->p_vu.p_number = num;
+  return p + 1;
+}
+
 static bool
 SendConnectPacket(RTMP *r, RTMPPacket *cp)
 {
   RTMPPacket packet;
-  char pbuf[4096], *pend = pbuf+sizeof(pbuf);
+  AMFObjectProperty props[11], *p = props;
+  AMFObject cmd;
+  char *enc, *pend;
+  int i, n, size;
+  bool ret;
 
   if (cp)
     return RTMP_SendPacket(r, cp, true);
 
-  packet.m_nChannel = 0x03;	// control channel (invoke)
-  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
-  packet.m_packetType = 0x14;	// INVOKE
-  packet.m_nInfoField1 = 0;
-  packet.m_nInfoField2 = 0;
-  packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
-
-  char *enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_connect);
-  enc = AMF_EncodeNumber(enc, pend, 1.0);
-  *enc++ = AMF_OBJECT;
-
   if (r->Link.app.av_len)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_app, &r->Link.app);
-      if (!enc)
-        return false;
-    }
+    p = SetProp(p, &av_app, AMF_STRING, 0, &r->Link.app);
   if (r->Link.flashVer.av_len)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_flashVer, &r->Link.flashVer);
-      if (!enc)
-        return false;
-    }
-  if (r->Link.swfUrl.av_len)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_swfUrl, &r->Link.swfUrl);
-      if (!enc)
-        return false;
-    }
-  if (r->Link.tcUrl.av_len)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_tcUrl, &r->Link.tcUrl);
-      if (!enc)
-        return false;
-    }
-  enc = AMF_EncodeNamedBoolean(enc, pend, &av_fpad, false);
-  if (!enc)
-    return false;
-  enc = AMF_EncodeNamedNumber(enc, pend, &av_capabilities, 15.0);
-  if (!enc)
-    return false;
-  enc = AMF_EncodeNamedNumber(enc, pend, &av_audioCodecs, r->m_fAudioCodecs);
-  if (!enc)
-    return false;
-  enc = AMF_EncodeNamedNumber(enc, pend, &av_videoCodecs, r->m_fVideoCodecs);
-  if (!enc)
-    return false;
-  enc = AMF_EncodeNamedNumber(enc, pend, &av_videoFunction, 1.0);
-  if (!enc)
-    return false;
+    p = SetProp(p, &av_flashVer, AMF_STRING, 0, &r->Link.flashVer);
+  if (r->Link.swfUrl.av_len)
+    p = SetProp(p, &av_swfUrl, AMF_STRING, 0, &r->Link.swfUrl);
+  if (r->Link.tcUrl.av_len)
+    p = SetProp(p, &av_tcUrl, AMF_STRING, 0, &r->Link.tcUrl);
+  p = SetProp(p, &av_fpad, AMF_BOOLEAN, false, NULL);
+  p = SetProp(p, &av_capabilities, AMF_NUMBER, 15.0, NULL);
+  p = SetProp(p, &av_audioCodecs, AMF_NUMBER, r->m_fAudioCodecs, NULL);
+  p = SetProp(p, &av_videoCodecs, AMF_NUMBER, r->m_fVideoCodecs, NULL);
+  p = SetProp(p, &av_videoFunction, AMF_NUMBER, 1.0, NULL);
   if (r->Link.pageUrl.av_len)
-    {
-      enc = AMF_EncodeNamedString(enc, pend, &av_pageUrl, &r->Link.pageUrl);
-      if (!enc)
-        return false;
-    }
+    p = SetProp(p, &av_pageUrl, AMF_STRING, 0, &r->Link.pageUrl);
   if (r->m_fEncoding != 0.0 || r->m_bSendEncoding)
+    p = SetProp(p, &av_objectEncoding, AMF_NUMBER, r->m_fEncoding, NULL);	// AMF0, AMF3 not supported yet
+  cmd.o_num = p - props;
+  cmd.o_props = props;
+  cmd.o_index = NULL;
+
+  /* size the body exactly, however many extras -C added */
+  size = AMF_STRING_SIZE(av_connect.av_len) + AMF_NUMBER_SIZE
+    + AMF_EncodedSize(&cmd);
+  if (r->Link.auth.av_len)
+    size += AMF_BOOLEAN_SIZE + AMF_STRING_SIZE(r->Link.auth.av_len);
+  for (i = 0; i < r->Link.extras.o_num; i++)
     {
-      enc = AMF_EncodeNamedNumber(enc, pend, &av_objectEncoding, r->m_fEncoding);	// AMF0, AMF3 not supported yet
-      if (!enc)
-        return false;
+      n = AMFProp_EncodedSize(&r->Link.extras.o_props[i]);
+      if (n < 0)
+	{
+	  Log(LOGERROR, "%s, can't encode connect option %d", __FUNCTION__,
+	      i);
+	  return false;
+	}
+      size += n;
     }
-  if (enc+3 >= pend)
+
+  if (!RTMPPacket_Alloc(&packet, size))
     return false;
-  *enc++ = 0;
-  *enc++ = 0;			// end of object - 0x00 0x00 0x09
-  *enc++ = AMF_OBJECT_END;
+  packet.m_nChannel = 0x03;	// control channel (invoke)
+  packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+  packet.m_packetType = 0x14;	// INVOKE
+  packet.m_nInfoField1 = 0;
+  packet.m_nInfoField2 = 0;
+  packet.m_hasAbsTimestamp = 0;
+
+  enc = packet.m_body;
+  pend = enc + size;
+  enc = AMF_EncodeString(enc, pend, &av_connect);
+  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
+  enc = AMF_Encode(&cmd, enc, pend);
 
   // add auth string
-  if (r->Link.auth.av_len)
+  if (enc && r->Link.auth.av_len)
     {
       enc = AMF_EncodeBoolean(enc, pend, r->Link.authflag);
-      if (!enc)
-        return false;
       enc = AMF_EncodeString(enc, pend, &r->Link.auth);
-      if (!enc)
-        return false;
     }
-  if (r->Link.extras.o_num)
+  for (i = 0; enc && i < r->Link.extras.o_num; i++)
+    enc = AMFProp_Encode(&r->Link.extras.o_props[i], enc, pend);
+  if (!enc)
     {
-      int i;
-      for (i=0; i < r->Link.extras.o_num; i++)
-        {
-          enc = AMFProp_Encode(&r->Link.extras.o_props[i], enc, pend);
-          if (!enc)
-            return false;
-        }
+      RTMPPacket_Free(&packet);
+      return false;
     }
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, true);
+  ret = RTMP_SendPacket(r, &packet, true);
+  RTMPPacket_Free(&packet);
+  return ret;
 }
 
 #if 0 /* unused */
@@ -1048,28 +1978,49 @@ static bool
 SendFCSubscribe(RTMP * r, AVal * subscribepath)
 {
   RTMPPacket packet;
-  char pbuf[512], *pend = pbuf+sizeof(pbuf);
+  int size = AMF_STRING_SIZE(av_FCSubscribe.av_len) + AMF_NUMBER_SIZE + 1
+    + AMF_STRING_SIZE(subscribepath->av_len);
+  char *enc, *pend;
+  bool ret;
+
+  if (!RTMPPacket_Alloc(&packet, size))
+    return false;
   packet.m_nChannel = 0x03;	// control channel (invoke)
   packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
   packet.m_packetType = 0x14;	// INVOKE
   packet.m_nInfoField1 = 0;
   packet.m_nInfoField2 = 0;
   packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   Log(LOGDEBUG, "FCSubscribe: %s", subscribepath->av_val);
-  char *enc = packet.m_body;
+  enc = packet.m_body;
+  pend = enc + size;
   enc = AMF_EncodeString(enc, pend, &av_FCSubscribe);
-  enc = AMF_EncodeNumber(enc, pend, 4.0);
+  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
   *enc++ = AMF_NULL;
   enc = AMF_EncodeString(enc, pend, subscribepath);
 
-  if (!enc)
-    return false;
-
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, true);
+  ret = RTMP_SendPacket(r, &packet, true);
+  RTMPPacket_Free(&packet);
+  return ret;
+}
+
+/* what follows a successful connect */
+static bool
+SendStreamRequest(RTMP * r)
+{
+  if (!RTMP_SendServerBW(r) || !RTMP_SendCtrl(r, 3, 0, 300)
+      || !RTMP_SendCreateStream(r, ++r->m_numInvokes))
+    return false;
+
+  /* Send the FCSubscribe if live stream or if subscribepath is set */
+  if (r->Link.subscribepath.av_len)
+    return SendFCSubscribe(r, &r->Link.subscribepath);
+  else if (r->Link.bLiveStream)
+    return SendFCSubscribe(r, &r->Link.playpath);
+  return true;
 }
 
 SAVC(deleteStream);
@@ -1127,6 +2078,10 @@ RTMP_SendPause(RTMP * r, bool DoPause, double dTime)
 
   Log(LOGDEBUG, "%s, %d, pauseTime=%.2f",
       __FUNCTION__, DoPause, dTime);
+  if (DoPause)
+    r->m_stats.st_pauses++;
+  else
+    r->m_stats.st_unpauses++;
   return RTMP_SendPacket(r, &packet, true);
 }
 
@@ -1197,6 +2152,7 @@ SendBytesReceived(RTMP * r)
 
   AMF_EncodeInt32(packet.m_body, pend, r->m_nBytesIn);	// hard coded for now
   r->m_nBytesInSent = r->m_nBytesIn;
+  r->m_stats.st_acks++;
 
   //Log(LOGDEBUG, "Send bytes report. 0x%x (%d bytes)", (unsigned int)m_nBytesIn, m_nBytesIn);
   return RTMP_SendPacket(r, &packet, false);
@@ -1262,17 +2218,23 @@ static bool
 SendPlay(RTMP * r)
 {
   RTMPPacket packet;
-  char pbuf[1024], *pend = pbuf+sizeof(pbuf);
+  int size = AMF_STRING_SIZE(av_play.av_len) + AMF_NUMBER_SIZE + 1
+    + AMF_STRING_SIZE(r->Link.playpath.av_len) + AMF_NUMBER_SIZE
+    + (r->Link.length ? AMF_NUMBER_SIZE : 0);
+  char *enc, *pend;
+  bool ret;
 
+  if (!RTMPPacket_Alloc(&packet, size))
+    return false;
   packet.m_nChannel = 0x08;	// we make 8 our stream channel
   packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
   packet.m_packetType = 0x14;	// INVOKE
   packet.m_nInfoField2 = r->m_stream_id;	//0x01000000;
   packet.m_nInfoField1 = 0;
   packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-  char *enc = packet.m_body;
+  enc = packet.m_body;
+  pend = enc + size;
   enc = AMF_EncodeString(enc, pend, &av_play);
   enc = AMF_EncodeNumber(enc, pend, 0.0);	// stream id??
   *enc++ = AMF_NULL;
@@ -1281,8 +2243,6 @@ SendPlay(RTMP * r)
       __FUNCTION__, r->Link.seekTime, r->Link.length,
       r->Link.playpath.av_val);
   enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-  if (!enc)
-    return false;
 
   // Optional parameters start and len.
 
@@ -1299,8 +2259,6 @@ SendPlay(RTMP * r)
       else
 	enc = AMF_EncodeNumber(enc, pend, 0.0);	//-2000.0); // recorded as default, -2000.0 is not reliable since that freezes the player if the stream is not found
     }
-  if (!enc)
-    return false;
 
   // len: -1, 0, positive number
   //  -1: plays live or recorded stream to the end (default)
@@ -1308,42 +2266,45 @@ SendPlay(RTMP * r)
   //  >0: plays a live or recoded stream for 'len' milliseconds
   //enc += EncodeNumber(enc, -1.0); // len
   if (r->Link.length)
-    {
-      enc = AMF_EncodeNumber(enc, pend, r->Link.length);	// len
-      if (!enc)
-        return false;
-    }
+    enc = AMF_EncodeNumber(enc, pend, r->Link.length);	// len
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, true);
+  ret = RTMP_SendPacket(r, &packet, true);
+  RTMPPacket_Free(&packet);
+  return ret;
 }
 
 static bool
 SendSecureTokenResponse(RTMP *r, AVal *resp)
 {
   RTMPPacket packet;
-  char pbuf[1024], *pend = pbuf+sizeof(pbuf);
+  int size = AMF_STRING_SIZE(av_secureTokenResponse.av_len)
+    + AMF_NUMBER_SIZE + 1 + AMF_STRING_SIZE(resp->av_len);
+  char *enc, *pend;
+  bool ret;
 
+  if (!RTMPPacket_Alloc(&packet, size))
+    return false;
   packet.m_nChannel = 0x03;	/* control channel (invoke) */
   packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
   packet.m_packetType = 0x14;
   packet.m_nInfoField2 = 0;
   packet.m_nInfoField1 = 0;
   packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-  char *enc = packet.m_body;
+  enc = packet.m_body;
+  pend = enc + size;
   enc = AMF_EncodeString(enc, pend, &av_secureTokenResponse);
   enc = AMF_EncodeNumber(enc, pend, 0.0);
   *enc++ = AMF_NULL;
   enc = AMF_EncodeString(enc, pend, resp);
-  if (!enc)
-    return false;
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, false);
+  ret = RTMP_SendPacket(r, &packet, false);
+  RTMPPacket_Free(&packet);
+  return ret;
 }
 
 /*
@@ -1408,17 +2369,18 @@ RTMP_SendCtrl(RTMP * r, short nType, unsigned int nObject, unsigned int nTime)
 }
 
 static void
-AV_erase(AVal * vals, int *num, int i, bool freeit)
+AV_erase(RTMPMethod * vals, int *num, int i, bool freeit)
 {
   if (freeit)
-    free(vals[i].av_val);
+    free(vals[i].name.av_val);
   (*num)--;
   for (; i < *num; i++)
     {
       vals[i] = vals[i + 1];
     }
-  vals[i].av_val = NULL;
-  vals[i].av_len = 0;
+  vals[i].name.av_val = NULL;
+  vals[i].name.av_len = 0;
+  vals[i].num = 0;
 }
 
 void
@@ -1428,27 +2390,39 @@ RTMP_DropRequest(RTMP *r, int i, bool freeit)
 }
 
 static void
-AV_queue(AVal ** vals, int *num, AVal * av)
+AV_queue(RTMPMethod ** vals, int *num, AVal * av, int txn)
 {
   char *tmp;
   if (!(*num & 0x0f))
-    *vals = realloc(*vals, (*num + 16) * sizeof(AVal));
+    *vals = realloc(*vals, (*num + 16) * sizeof(RTMPMethod));
   tmp = malloc(av->av_len + 1);
   memcpy(tmp, av->av_val, av->av_len);
   tmp[av->av_len] = '\0';
-  (*vals)[*num].av_len = av->av_len;
-  (*vals)[(*num)++].av_val = tmp;
+  (*vals)[*num].num = txn;
+  (*vals)[*num].name.av_len = av->av_len;
+  (*vals)[(*num)++].name.av_val = tmp;
 }
 
 static void
-AV_clear(AVal * vals, int num)
+AV_clear(RTMPMethod * vals, int num)
 {
   int i;
   for (i = 0; i < num; i++)
-    free(vals[i].av_val);
+    free(vals[i].name.av_val);
   free(vals);
 }
 
+/* index of the pending call with this transaction id, or -1 */
+static int
+FindCall(RTMP * r, int txn)
+{
+  int i;
+  for (i = 0; i < r->m_numCalls; i++)
+    if (r->m_methodCalls[i].num == txn)
+      return i;
+  return -1;
+}
+
 SAVC(onBWDone);
 SAVC(onFCSubscribe);
 SAVC(onFCUnsubscribe);
@@ -1456,8 +2430,6 @@ SAVC(_onbwcheck);
 SAVC(_onbwdone);
 SAVC(_error);
 SAVC(close);
-SAVC(code);
-SAVC(level);
 SAVC(onStatus);
 static const AVal av_NetStream_Failed = AVC("NetStream.Failed");
 static const AVal av_NetStream_Play_Failed = AVC("NetStream.Play.Failed");
@@ -1469,11 +2441,27 @@ static const AVal av_NetStream_Play_Start = AVC("NetStream.Play.Start");
 static const AVal av_NetStream_Play_Complete = AVC("NetStream.Play.Complete");
 static const AVal av_NetStream_Play_Stop = AVC("NetStream.Play.Stop");
 
+/* the whole tree is only decoded for the debug dump */
+static void
+DumpPacket(const char *body, unsigned int len)
+{
+  AMFObject obj;
+  AMFArena arena;
+  char abuf[4096];
+
+  if (debuglevel < LOGDEBUG)
+    return;
+  AMFArena_Init(&arena, abuf, sizeof(abuf));
+  if (AMF_DecodeArena(&obj, body, len, false, &arena) >= 0)
+    AMF_Dump(&obj);
+  AMFArena_Free(&arena);
+}
+
 // Returns 0 for OK/Failed/error, 1 for 'Stop or Complete'
 static int
 HandleInvoke(RTMP * r, const char *body, unsigned int nBodySize)
 {
-  int ret = 0, nRes;
+  int ret = 0;
   if (body[0] != 0x02)		// make sure it is a string method name we start with
     {
       Log(LOGWARNING, "%s, Sanity failed. no string method in invoke packet",
@@ -1481,57 +2469,81 @@ HandleInvoke(RTMP * r, const char *body, unsigned int nBodySize)
       return 0;
     }
 
-  AMFObject obj;
-  nRes = AMF_Decode(&obj, body, nBodySize, false);
-  if (nRes < 0)
+  /* only the few fields we act on are read, in place */
+  AMFCursor args, val;
+  AVal method;
+  double txn = 0;
+
+  AMFCursor_Init(&args, body, nBodySize);
+  val = args;
+  if (!AMFCursor_String(&val, &method))
     {
       Log(LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
       return 0;
     }
-
-  AMF_Dump(&obj);
-  AVal method;
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
-  double txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
+  AMFCursor_Number(&val, &txn);
+  DumpPacket(body, nBodySize);
   Log(LOGDEBUG, "%s, server invoking <%s>", __FUNCTION__, method.av_val);
 
   if (AVMATCH(&method, &av__result))
     {
-      AVal methodInvoked = r->m_methodCalls[0];
-      AV_erase(r->m_methodCalls, &r->m_numCalls, 0, false);
+      AVal methodInvoked;
+      int i = FindCall(r, (int) txn);
+
+      if (i < 0)
+	{
+	  Log(LOGWARNING, "%s, received result %d without matching request",
+	      __FUNCTION__, (int) txn);
+	  goto leave;
+	}
+      methodInvoked = r->m_methodCalls[i].name;
+      AV_erase(r->m_methodCalls, &r->m_numCalls, i, false);
 
       Log(LOGDEBUG, "%s, received result for method call <%s>", __FUNCTION__,
 	  methodInvoked.av_val);
 
       if (AVMATCH(&methodInvoked, &av_connect))
 	{
+	  MarkPhase(r, RTMP_PHASE_CONNECTED);
           if (r->Link.token.av_len)
             {
-              AMFObjectProperty p;
-              if (RTMP_FindFirstMatchingProperty(&obj, &av_secureToken, &p))
+              AVal token;
+              if (AMFCursor_Search(&args, &av_secureToken, &val)
+                  && AMFCursor_String(&val, &token))
                 {
-                  DecodeTEA(&r->Link.token, &p.p_vu.p_aval);
-                  SendSecureTokenResponse(r, &p.p_vu.p_aval);
+                  DecodeTEA(&r->Link.token, &token);
+                  SendSecureTokenResponse(r, &token);
                 }
             }
-	  RTMP_SendServerBW(r);
-	  RTMP_SendCtrl(r, 3, 0, 300);
-
-	  RTMP_SendCreateStream(r, 2.0);
-
-	  /* Send the FCSubscribe if live stream or if subscribepath is set */
-	  if (r->Link.subscribepath.av_len)
-	    SendFCSubscribe(r, &r->Link.subscribepath);
-	  else if (r->Link.bLiveStream)
-	    SendFCSubscribe(r, &r->Link.playpath);
+	  if (!r->m_bPipelined)
+	    {
+	      r->m_bCorked = true;
+	      SendStreamRequest(r);
+	      Uncork(r);
+	    }
 	}
       else if (AVMATCH(&methodInvoked, &av_createStream))
 	{
-	  r->m_stream_id =
-	    (int) AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
+	  double num = 0;
+	  int id;
 
-	  SendPlay(r);
-	  RTMP_SendCtrl(r, 3, r->m_stream_id, r->m_nBufferMS);
+	  if (AMFCursor_Get(&args, 3, &val))
+	    AMFCursor_Number(&val, &num);
+	  id = (int) num;
+	  MarkPhase(r, RTMP_PHASE_STREAM);
+
+	  if (!r->m_bPipelined || id != r->m_stream_id)
+	    {
+	      if (r->m_bPipelined)
+		Log(LOGWARNING, "%s, got stream %d, not the predicted %d, "
+		    "playing again", __FUNCTION__, id, r->m_stream_id);
+	      r->m_stream_id = id;
+	      r->m_bCorked = true;
+	      SendPlay(r);
+	      RTMP_SendCtrl(r, 3, r->m_stream_id, r->m_nBufferMS);
+	      Uncork(r);
+	    }
+	  r->m_bPipelined = false;
 	}
       else if (AVMATCH(&methodInvoked, &av_play))
 	{
@@ -1560,7 +2572,7 @@ HandleInvoke(RTMP * r, const char *body, unsigned int nBodySize)
     {
       int i;
       for (i = 0; i < r->m_numCalls; i++)
-	if (AVMATCH(&r->m_methodCalls[i], &av__checkbw))
+	if (AVMATCH(&r->m_methodCalls[i].name, &av__checkbw))
 	  {
 	    AV_erase(r->m_methodCalls, &r->m_numCalls, i, true);
 	    break;
@@ -1568,7 +2580,12 @@ HandleInvoke(RTMP * r, const char *body, unsigned int nBodySize)
     }
   else if (AVMATCH(&method, &av__error))
     {
-      Log(LOGERROR, "rtmp server sent error");
+      int i = FindCall(r, (int) txn);
+
+      Log(LOGERROR, "rtmp server sent error for <%s>",
+	  i < 0 ? "unknown" : r->m_methodCalls[i].name.av_val);
+      if (i >= 0)
+	AV_erase(r->m_methodCalls, &r->m_numCalls, i, true);
     }
   else if (AVMATCH(&method, &av_close))
     {
@@ -1577,11 +2594,15 @@ HandleInvoke(RTMP * r, const char *body, unsigned int nBodySize)
     }
   else if (AVMATCH(&method, &av_onStatus))
     {
-      AMFObject obj2;
-      AVal code, level;
-      AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
+      AMFCursor info, prop;
+      AVal code = { 0, 0 }, level = { 0, 0 };
+      if (AMFCursor_Get(&args, 3, &info))
+	{
+	  if (AMFCursor_Find(&info, "code", &prop))
+	    AMFCursor_String(&prop, &code);
+	  if (AMFCursor_Find(&info, "level", &prop))
+	    AMFCursor_String(&prop, &level);
+	}
 
       Log(LOGDEBUG, "%s, onStatus: %s", __FUNCTION__, code.av_val);
       if (AVMATCH(&code, &av_NetStream_Failed)
@@ -1598,9 +2619,10 @@ HandleInvoke(RTMP * r, const char *body, unsigned int nBodySize)
 	{
 	  int i;
 	  r->m_bPlaying = true;
+	  MarkPhase(r, RTMP_PHASE_PLAYING);
 	  for (i = 0; i < r->m_numCalls; i++)
 	    {
-	      if (AVMATCH(&r->m_methodCalls[i], &av_play))
+	      if (AVMATCH(&r->m_methodCalls[i].name, &av_play))
 		{
 		  AV_erase(r->m_methodCalls, &r->m_numCalls, i, true);
 		  break;
@@ -1620,7 +2642,7 @@ HandleInvoke(RTMP * r, const char *body, unsigned int nBodySize)
     {
 
     }
-  AMF_Reset(&obj);
+leave:
   return ret;
 }
 
@@ -1628,73 +2650,75 @@ bool
 RTMP_FindFirstMatchingProperty(AMFObject * obj, const AVal * name,
 			       AMFObjectProperty * p)
 {
-  int n;
-  /* this is a small object search to locate the "duration" property */
-  for (n = 0; n < obj->o_num; n++)
+  int n, end;
+  /* depth first: a match in a nested object ahead of obj's own wins */
+  AMFObjectProperty *match = AMF_GetProp(obj, name, -1);
+
+  end = AMFProp_IsValid(match) ? match - obj->o_props : obj->o_num;
+  for (n = 0; n < end; n++)
     {
       AMFObjectProperty *prop = AMF_GetProp(obj, NULL, n);
 
-      if (AVMATCH(&prop->p_name, name))
-	{
-	  *p = *prop;
-	  return true;
-	}
-
       if (prop->p_type == AMF_OBJECT)
 	{
 	  if (RTMP_FindFirstMatchingProperty(&prop->p_vu.p_object, name, p))
             return true;
 	}
     }
+  if (end < obj->o_num)
+    {
+      *p = *match;
+      return true;
+    }
   return false;
 }
 
 static bool
-DumpMetaData(AMFObject * obj)
+DumpMetaData(AMFCursor * cur)
 {
-  AMFObjectProperty *prop;
-  int n;
-  for (n = 0; n < obj->o_num; n++)
+  AMFCursor inner;
+  AVal name;
+  while (AMFCursor_Next(cur, &name))
     {
-      prop = AMF_GetProp(obj, NULL, n);
-      if (prop->p_type != AMF_OBJECT)
+      AMFDataType type = AMFCursor_Type(cur);
+      if (type == AMF_OBJECT || type == AMF_ECMA_ARRAY
+	  || type == AMF_STRICT_ARRAY || type == AMF_TYPED_OBJECT)
+	{
+	  if (!AMFCursor_Enter(cur, &inner))
+	    return false;
+	  if (name.av_len)
+	    LogPrintf("%.*s:\n", name.av_len, name.av_val);
+	  DumpMetaData(&inner);
+	}
+      else
 	{
 	  char str[256] = "";
-	  switch (prop->p_type)
+	  double num;
+	  AVal val;
+	  if (type == AMF_BOOLEAN && AMFCursor_Number(cur, &num))
+	    snprintf(str, 255, "%s", num != 0. ? "TRUE" : "FALSE");
+	  else if (type == AMF_DATE && AMFCursor_Number(cur, &num))
+	    snprintf(str, 255, "timestamp:%.2f", num);
+	  else if (AMFCursor_Number(cur, &num))
+	    snprintf(str, 255, "%.2f", num);
+	  else if (AMFCursor_String(cur, &val))
+	    snprintf(str, 255, "%.*s", val.av_len, val.av_val);
+	  else
 	    {
-	    case AMF_NUMBER:
-	      snprintf(str, 255, "%.2f", prop->p_vu.p_number);
-	      break;
-	    case AMF_BOOLEAN:
-	      snprintf(str, 255, "%s",
-		       prop->p_vu.p_number != 0. ? "TRUE" : "FALSE");
-	      break;
-	    case AMF_STRING:
-	      snprintf(str, 255, "%.*s", prop->p_vu.p_aval.av_len,
-		       prop->p_vu.p_aval.av_val);
-	      break;
-	    case AMF_DATE:
-	      snprintf(str, 255, "timestamp:%.2f", prop->p_vu.p_number);
-	      break;
-	    default:
-	      snprintf(str, 255, "INVALID TYPE 0x%02x",
-		       (unsigned char) prop->p_type);
+	      if (type == AMF_UNDEFINED || type == AMF_UNSUPPORTED)
+		type = AMF_NULL;
+	      snprintf(str, 255, "INVALID TYPE 0x%02x", (unsigned char) type);
+	      if (!AMFCursor_Skip(cur))
+		return false;
 	    }
-	  if (prop->p_name.av_len)
+	  if (name.av_len)
 	    {
 	      // chomp
 	      if (strlen(str) >= 1 && str[strlen(str) - 1] == '\n')
 		str[strlen(str) - 1] = '\0';
-	      LogPrintf("  %-22.*s%s\n", prop->p_name.av_len,
-			prop->p_name.av_val, str);
+	      LogPrintf("  %-22.*s%s\n", name.av_len, name.av_val, str);
 	    }
 	}
-      else
-	{
-	  if (prop->p_name.av_len)
-	    LogPrintf("%.*s:\n", prop->p_name.av_len, prop->p_name.av_val);
-	  DumpMetaData(&prop->p_vu.p_object);
-	}
     }
   return false;
 }
@@ -1708,35 +2732,39 @@ HandleMetadata(RTMP * r, char *body, unsigned int len)
   // allright we get some info here, so parse it and print it
   // also keep duration or filesize to make a nice progress bar
 
-  AMFObject obj;
-  AVal metastring;
-  bool ret = false;
+  AMFCursor args, val;
+  AVal metastring = { 0, 0 };
+  double duration;
 
-  int nRes = AMF_Decode(&obj, body, len, false);
-  if (nRes < 0)
+  /* one pass to reject a malformed packet, nothing is decoded */
+  AMFCursor_Init(&args, body, len);
+  for (val = args; AMFCursor_Next(&val, NULL);)
     {
-      Log(LOGERROR, "%s, error decoding meta data packet", __FUNCTION__);
-      return false;
+      if (!AMFCursor_Skip(&val))
+	{
+	  Log(LOGERROR, "%s, error decoding meta data packet", __FUNCTION__);
+	  return false;
+	}
     }
 
-  AMF_Dump(&obj);
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &metastring);
+  DumpPacket(body, len);
+  val = args;
+  AMFCursor_String(&val, &metastring);
 
-  if (AVMATCH(&metastring, &av_onMetaData))
+  if (!AVMATCH(&metastring, &av_onMetaData))
+    return false;
+
+  // Show metadata
+  LogPrintf("Metadata:\n");
+  val = args;
+  DumpMetaData(&val);
+  if (AMFCursor_Search(&args, &av_duration, &val)
+      && AMFCursor_Number(&val, &duration))
     {
-      AMFObjectProperty prop;
-      // Show metadata
-      LogPrintf("Metadata:\n");
-      DumpMetaData(&obj);
-      if (RTMP_FindFirstMatchingProperty(&obj, &av_duration, &prop))
-	{
-	  r->m_fDuration = prop.p_vu.p_number;
-	  //Log(LOGDEBUG, "Set duration: %.2f", m_fDuration);
-	}
-      ret = true;
+      r->m_fDuration = duration;
+      //Log(LOGDEBUG, "Set duration: %.2f", m_fDuration);
     }
-  AMF_Reset(&obj);
-  return ret;
+  return true;
 }
 
 static void
@@ -1809,7 +2837,7 @@ HandleCtrl(RTMP * r, const RTMPPacket * packet)
 	  if (r->Link.bLiveStream) break;
 	  if (!r->m_pausing)
 	    {
-	      r->m_pauseStamp = r->m_channelTimestamp[r->m_mediaChannel];
+	      r->m_pauseStamp = RTMP_GetChannelTimestamp(r, r->m_mediaChannel);
 	      RTMP_SendPause(r, true, r->m_pauseStamp);
 	      r->m_pausing = 1;
 	    }
@@ -1900,17 +2928,106 @@ EncodeInt32LE(char *output, int nVal)
   return 4;
 }
 
+/* length of the chunk header starting with the n bytes in hbuf. it
+ * grows as more of the header becomes known. */
+static int
+ChunkHeaderSize(const char *hbuf, int n)
+{
+  int hSize = 1, nSize;
+
+  if (n < 1)
+    return hSize;
+
+  switch (hbuf[0] & 0x3f)
+    {
+    case 0:
+      hSize += 1;
+      break;
+    case 1:
+      hSize += 2;
+      break;
+    }
+  nSize = packetSize[(hbuf[0] & 0xc0) >> 6] - 1;
+  hSize += nSize;
+  if (nSize >= 3 && n >= hSize
+      && AMF_DecodeInt24(hbuf + hSize - nSize) == 0xffffff)
+    hSize += 4;
+  return hSize;
+}
+
+/* drop input that precedes the chunk stream, the S2 of a handshake that
+ * did not wait for it */
+static bool
+SkipInput(RTMP * r)
+{
+  char buf[RTMP_SIG_SIZE];
+
+  while (r->m_nSkipIn > 0)
+    {
+      int n = ReadN(r, buf, r->m_nSkipIn < RTMP_SIG_SIZE
+		    ? r->m_nSkipIn : RTMP_SIG_SIZE);
+      if (n <= 0)
+	return false;
+      r->m_nSkipIn -= n;
+    }
+  return true;
+}
+
 bool
 RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
 {
-  char hbuf[RTMP_MAX_HEADER_SIZE] = { 0 }, *header = hbuf;
+  RTMPReadState *rs = &r->m_read;
+  char *hbuf = rs->rs_hbuf, *header = hbuf;
+  RTMPChannel *ch;
+  int nSize, hSize, nChunk;
 
   Log(LOGDEBUG2, "%s: fd=%d", __FUNCTION__, r->m_socket);
 
-  if (ReadN(r, hbuf, 1) == 0)
+  if (r->m_nSkipIn && !SkipInput(r))
+    return false;
+
+  if (rs->rs_state == RTMP_READ_BODY)
     {
-      Log(LOGERROR, "%s, failed to read RTMP packet header", __FUNCTION__);
-      return false;
+      /* resume the chunk body we ran out of data in */
+      memcpy(packet, &rs->rs_packet, sizeof(RTMPPacket));
+      nChunk = rs->rs_nChunk;
+      goto body;
+    }
+
+  if (rs->rs_hlen == 0 && r->m_nBufferSize >= RTMP_MAX_HEADER_SIZE)
+    {
+      /* the whole header is buffered, take it in one go */
+      hSize = ChunkHeaderSize(r->m_pBufferStart, RTMP_MAX_HEADER_SIZE);
+      memcpy(hbuf, r->m_pBufferStart, hSize);
+#ifdef _DEBUG
+      fwrite(hbuf, 1, hSize, netstackdump_read);
+#endif
+      r->m_pBufferStart += hSize;
+      r->m_nBufferSize -= hSize;
+      r->m_nBytesCopied += hSize;
+      r->m_nBytesIn += hSize;
+      r->m_stats.st_bytesIn += hSize;
+      if (r->m_bSendCounter && r->m_nBytesIn > r->m_nBytesInSent + r->m_nClientBW / 2)
+	SendBytesReceived(r);
+    }
+  else
+    {
+      while (rs->rs_hlen < (hSize = ChunkHeaderSize(hbuf, rs->rs_hlen)))
+	{
+	  rs->rs_hlen += ReadN(r, hbuf + rs->rs_hlen, hSize - rs->rs_hlen);
+	  if (rs->rs_hlen < hSize)
+	    {
+	      if (RTMP_IsTimedout(r) && RTMP_IsConnected(r))
+		{
+		  Log(LOGDEBUG2, "%s, need more data for header", __FUNCTION__);
+		  return false;
+		}
+	      Log(LOGERROR, "%s, failed to read RTMP packet header", __FUNCTION__);
+	      rs->rs_hlen = 0;
+	      return false;
+	    }
+	}
+      rs->rs_hlen = 0;
     }
 
   packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
@@ -1918,54 +3035,33 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
   header++;
   if (packet->m_nChannel == 0)
     {
-      if (ReadN(r, &hbuf[1], 1) != 1)
-	{
-	  Log(LOGERROR, "%s, failed to read RTMP packet header 2nd byte",
-	      __FUNCTION__);
-	  return false;
-	}
-      packet->m_nChannel = (unsigned) hbuf[1];
+      packet->m_nChannel = (unsigned char) hbuf[1];
       packet->m_nChannel += 64;
       header++;
     }
   else if (packet->m_nChannel == 1)
     {
       int tmp;
-      if (ReadN(r, &hbuf[1], 2) != 2)
-	{
-	  Log(LOGERROR, "%s, failed to read RTMP packet header 3nd byte",
-	      __FUNCTION__);
-	  return false;
-	}
-      tmp = (((unsigned) hbuf[2]) << 8) + (unsigned) hbuf[1];
+      tmp = (((unsigned char) hbuf[2]) << 8) + (unsigned char) hbuf[1];
       packet->m_nChannel = tmp + 64;
       Log(LOGDEBUG, "%s, m_nChannel: %0x", __FUNCTION__, packet->m_nChannel);
       header += 2;
     }
 
-  int nSize = packetSize[packet->m_headerType], hSize;
+  nSize = packetSize[packet->m_headerType];
 
   if (nSize == RTMP_LARGE_HEADER_SIZE)	// if we get a full header the timestamp is absolute
     packet->m_hasAbsTimestamp = true;
 
   else if (nSize < RTMP_LARGE_HEADER_SIZE)
     {				// using values from the last message of this channel
-      if (r->m_vecChannelsIn[packet->m_nChannel])
-	memcpy(packet, r->m_vecChannelsIn[packet->m_nChannel],
-	       sizeof(RTMPPacket));
+      ch = GetChannel(r, packet->m_nChannel, false);
+      if (ch && ch->ch_in)
+	memcpy(packet, ch->ch_in, sizeof(RTMPPacket));
     }
 
   nSize--;
 
-  if (nSize > 0 && ReadN(r, header, nSize) != nSize)
-    {
-      Log(LOGERROR, "%s, failed to read RTMP packet header. type: %x",
-	  __FUNCTION__, (unsigned int) hbuf[0]);
-      return false;
-    }
-
-  hSize = nSize+(header-hbuf);
-
   if (nSize >= 3)
     {
       packet->m_nInfoField1 = AMF_DecodeInt24(header);
@@ -1987,34 +3083,23 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
 	    }
 	}
       if (packet->m_nInfoField1 == 0xffffff)
-        {
-          if (ReadN(r, header+nSize, 4) != 4)
-            {
-              Log(LOGERROR, "%s, failed to read extended timestamp",
-	          __FUNCTION__);
-              return false;
-            }
-          packet->m_nInfoField1 = AMF_DecodeInt32(header+nSize);
-          hSize += 4;
-        }
+	packet->m_nInfoField1 = AMF_DecodeInt32(header+nSize);
     }
 
   LogHexString(LOGDEBUG2, hbuf, hSize);
 
-  bool didAlloc = false;
   if (packet->m_nBodySize > 0 && packet->m_body == NULL)
     {
-      if (!RTMPPacket_Alloc(packet, packet->m_nBodySize))
+      if (!PacketAlloc(r, packet, packet->m_nBodySize))
 	{
 	  Log(LOGDEBUG, "%s, failed to allocate packet", __FUNCTION__);
 	  return false;
 	}
-      didAlloc = true;
       packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
     }
 
   int nToRead = packet->m_nBodySize - packet->m_nBytesRead;
-  int nChunk = r->m_inChunkSize;
+  nChunk = r->m_inChunkSize;
   if (nToRead < nChunk)
     nChunk = nToRead;
 
@@ -2027,37 +3112,64 @@ RTMP_ReadPacket(RTMP * r, RTMPPacket * packet)
       packet->m_chunk->c_chunkSize = nChunk;
     }
 
-  if (ReadN(r, packet->m_body + packet->m_nBytesRead, nChunk) != nChunk)
+  rs->rs_nChunk = nChunk;
+  rs->rs_nRead = 0;
+
+body:
+  rs->rs_nRead += ReadN(r, packet->m_body + packet->m_nBytesRead + rs->rs_nRead,
+		       nChunk - rs->rs_nRead);
+  if (rs->rs_nRead < nChunk)
     {
+      if (RTMP_IsTimedout(r) && RTMP_IsConnected(r))
+	{
+	  /* keep the partial chunk until the next call */
+	  Log(LOGDEBUG2, "%s, need more data for body", __FUNCTION__);
+	  memcpy(&rs->rs_packet, packet, sizeof(RTMPPacket));
+	  rs->rs_state = RTMP_READ_BODY;
+	  packet->m_body = NULL;	/* owned by the read state */
+	  return false;
+	}
       Log(LOGERROR, "%s, failed to read RTMP packet body. len: %lu",
 	  __FUNCTION__, packet->m_nBodySize);
+      rs->rs_state = RTMP_READ_HEADER;
       return false;
     }
+  rs->rs_state = RTMP_READ_HEADER;
 
   LogHexString(LOGDEBUG2, packet->m_body+packet->m_nBytesRead, nChunk);
 
   packet->m_nBytesRead += nChunk;
+  r->m_stats.st_chunksIn++;
 
   // keep the packet as ref for other packets on this channel
-  if (!r->m_vecChannelsIn[packet->m_nChannel])
-    r->m_vecChannelsIn[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-  memcpy(r->m_vecChannelsIn[packet->m_nChannel], packet, sizeof(RTMPPacket));
+  ch = GetChannel(r, packet->m_nChannel, true);
+  if (ch && !ch->ch_in)
+    ch->ch_in = malloc(sizeof(RTMPPacket));
+  if (!ch || !ch->ch_in)
+    {
+      Log(LOGERROR, "%s, failed to allocate channel %d", __FUNCTION__,
+	  packet->m_nChannel);
+      return false;
+    }
+  memcpy(ch->ch_in, packet, sizeof(RTMPPacket));
 
   if (RTMPPacket_IsReady(packet))
     {
+      r->m_stats.st_msgsIn[packet->m_packetType < RTMP_STATS_TYPES
+			   ? packet->m_packetType : 0]++;
       packet->m_nTimeStamp = packet->m_nInfoField1;
 
       // make packet's timestamp absolute
       if (!packet->m_hasAbsTimestamp)
-	packet->m_nTimeStamp += r->m_channelTimestamp[packet->m_nChannel];	// timestamps seem to be always relative!!
+	packet->m_nTimeStamp += ch->ch_timestamp;	// timestamps seem to be always relative!!
 
-      r->m_channelTimestamp[packet->m_nChannel] = packet->m_nTimeStamp;
+      ch->ch_timestamp = packet->m_nTimeStamp;
 
       // reset the data from the stored packet. we keep the header since we may use it later if a new packet for this channel
       // arrives and requests to re-use some info (small packet header)
-      r->m_vecChannelsIn[packet->m_nChannel]->m_body = NULL;
-      r->m_vecChannelsIn[packet->m_nChannel]->m_nBytesRead = 0;
-      r->m_vecChannelsIn[packet->m_nChannel]->m_hasAbsTimestamp = false;	// can only be false if we reuse header
+      ch->ch_in->m_body = NULL;
+      ch->ch_in->m_nBytesRead = 0;
+      ch->ch_in->m_hasAbsTimestamp = false;	// can only be false if we reuse header
     }
   else
     {
@@ -2094,6 +3206,7 @@ HandShake(RTMP * r, bool FP9HandShake)
 
   if (!WriteN(r, clientbuf, RTMP_SIG_SIZE + 1))
     return false;
+  MarkPhase(r, RTMP_PHASE_C1_SENT);
 
   char type;
   if (ReadN(r, &type, 1) != 1)	// 0x03 or 0x06
@@ -2118,10 +3231,18 @@ HandShake(RTMP * r, bool FP9HandShake)
   Log(LOGDEBUG, "%s: FMS Version   : %d.%d.%d.%d", __FUNCTION__, serversig[4],
       serversig[5], serversig[6], serversig[7]);
 
-  // 2nd part of handshake
+  // 2nd part of handshake, C2 goes out together with connect
+  r->m_bCorked = true;
   if (!WriteN(r, serversig, RTMP_SIG_SIZE))
     return false;
 
+  if (r->Link.deferS2)
+    {
+      Log(LOGDEBUG, "%s: not waiting for S2", __FUNCTION__);
+      r->m_nSkipIn = RTMP_SIG_SIZE;
+      return true;
+    }
+
   if (ReadN(r, serversig, RTMP_SIG_SIZE) != RTMP_SIG_SIZE)
     return false;
 
@@ -2222,7 +3343,8 @@ RTMP_SendChunk(RTMP *r, RTMPChunk *chunk)
 bool
 RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
 {
-  const RTMPPacket *prevPacket = r->m_vecChannelsOut[packet->m_nChannel];
+  RTMPChannel *ch = GetChannel(r, packet->m_nChannel, false);
+  const RTMPPacket *prevPacket = ch ? ch->ch_out : NULL;
   if (prevPacket && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
     {
       // compress a bit by using the prev packet's attributes
@@ -2245,18 +3367,12 @@ RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
 
   int nSize = packetSize[packet->m_headerType];
   int hSize = nSize, cSize = 0;
-  char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
+  char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], cbuf[3], c;
+  struct iovec iov[RTMP_SEND_IOV];
+  int niov = 0;
 
-  if (packet->m_body)
-    {
-      header = packet->m_body - nSize;
-      hend = packet->m_body;
-    }
-  else
-    {
-      header = hbuf+6;
-      hend = hbuf+sizeof(hbuf);
-    }
+  header = hbuf+6;
+  hend = hbuf+sizeof(hbuf);
 
   if (packet->m_nChannel > 319)
     cSize = 2;
@@ -2316,6 +3432,16 @@ RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
   if (nSize > 1 && packet->m_nInfoField1 >= 0xffffff)
     hptr = AMF_EncodeInt32(hptr, hend, packet->m_nInfoField1);
 
+  /* every continuation chunk carries the same type 3 header */
+  cbuf[0] = (0xc0 | c);
+  if (cSize)
+    {
+      int tmp = packet->m_nChannel - 64;
+      cbuf[1] = tmp & 0xff;
+      if (cSize == 2)
+        cbuf[2] = tmp >> 8;
+    }
+
   nSize = packet->m_nBodySize;
   char *buffer = packet->m_body;
   int nChunkSize = r->m_outChunkSize;
@@ -2323,50 +3449,42 @@ RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
   Log(LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, r->m_socket, nSize);
   while (nSize+hSize)
     {
-      int wrote;
-
       if (nSize < nChunkSize)
 	nChunkSize = nSize;
 
-      if (header)
-	{
-          LogHexString(LOGDEBUG2, header, hSize);
-          LogHexString(LOGDEBUG2, buffer, nChunkSize);
-	  wrote = WriteN(r, header, nChunkSize + hSize);
-	  header = NULL;
-          hSize = 0;
-	}
-      else
+      LogHexString(LOGDEBUG2, header, hSize);
+      LogHexString(LOGDEBUG2, buffer, nChunkSize);
+      iov[niov].iov_base = header;
+      iov[niov++].iov_len = hSize;
+      if (nChunkSize)
 	{
-          LogHexString(LOGDEBUG2, buffer, nChunkSize);
-	  wrote = WriteN(r, buffer, nChunkSize);
+	  iov[niov].iov_base = buffer;
+	  iov[niov++].iov_len = nChunkSize;
 	}
-      if (!wrote)
-	return false;
 
       nSize -= nChunkSize;
       buffer += nChunkSize;
+      hSize = 0;
+      r->m_stats.st_chunksOut++;
 
       if (nSize > 0)
 	{
-	  header = buffer - 1;
-	  hSize = 1;
-          if (cSize)
-            {
-              header -= cSize;
-              hSize += cSize;
-            }
-	  *header = (0xc0 | c);
-          if (cSize)
-            {
-              int tmp = packet->m_nChannel - 64;
-              header[1] = tmp & 0xff;
-              if (cSize == 2)
-                header[2] = tmp >> 8;
-            }
+	  header = cbuf;
+	  hSize = 1 + cSize;
+	}
+
+      /* flush when the vector is full or the message is complete */
+      if (niov > RTMP_SEND_IOV - 2 || !(nSize+hSize))
+	{
+	  if (!WriteV(r, iov, niov))
+	    return false;
+	  niov = 0;
 	}
     }
 
+  r->m_stats.st_msgsOut[packet->m_packetType < RTMP_STATS_TYPES
+			? packet->m_packetType : 0]++;
+
   /* we invoked a remote method */
   if (packet->m_packetType == 0x14)
     {
@@ -2375,12 +3493,23 @@ RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue)
       Log(LOGDEBUG, "Invoking %s", method.av_val);
       /* keep it in call queue till result arrives */
       if (queue)
-        AV_queue(&r->m_methodCalls, &r->m_numCalls, &method);
+	{
+	  const char *ptr = packet->m_body + 3 + method.av_len;
+	  int txn = 0;
+
+	  if (packet->m_nBodySize >= 3 + method.av_len + 9
+	      && *ptr == AMF_NUMBER)
+	    txn = (int) AMF_DecodeNumber(ptr + 1);
+	  AV_queue(&r->m_methodCalls, &r->m_numCalls, &method, txn);
+	}
     }
 
-  if (!r->m_vecChannelsOut[packet->m_nChannel])
-    r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-  memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
+  ch = GetChannel(r, packet->m_nChannel, true);
+  if (ch && !ch->ch_out)
+    ch->ch_out = malloc(sizeof(RTMPPacket));
+  if (!ch || !ch->ch_out)
+    return false;
+  memcpy(ch->ch_out, packet, sizeof(RTMPPacket));
   return true;
 }
 
@@ -2396,7 +3525,14 @@ RTMP_Close(RTMP * r)
   int i;
 
   if (RTMP_IsConnected(r))
-    closesocket(r->m_socket);
+    {
+      Log(LOGDEBUG, "%s, received %llu bytes copied, %llu bytes direct",
+	  __FUNCTION__, (unsigned long long) r->m_nBytesCopied,
+	  (unsigned long long) r->m_nBytesDirect);
+      Log(LOGDEBUG, "%s, packet bodies: %u from pool, %u allocated",
+	  __FUNCTION__, r->m_nPoolHits, r->m_nPoolMisses);
+      closesocket(r->m_socket);
+    }
 
   r->m_stream_id = -1;
   r->m_socket = 0;
@@ -2409,23 +3545,53 @@ RTMP_Close(RTMP * r)
   r->m_nClientBW2 = 2;
   r->m_nServerBW = 2500000;
 
-  for (i = 0; i < RTMP_CHANNELS; i++)
+  for (i = 0; i < RTMP_CHANNELS_INLINE + r->m_numExtChannels; i++)
     {
-      if (r->m_vecChannelsIn[i])
+      RTMPChannel *ch = i < RTMP_CHANNELS_INLINE ? &r->m_channels[i] :
+	&r->m_extChannels[i - RTMP_CHANNELS_INLINE];
+      if (ch->ch_in)
 	{
-	  RTMPPacket_Free(r->m_vecChannelsIn[i]);
-	  free(r->m_vecChannelsIn[i]);
-	  r->m_vecChannelsIn[i] = NULL;
+	  RTMPPacket_Free(ch->ch_in);
+	  free(ch->ch_in);
+	  ch->ch_in = NULL;
 	}
-      if (r->m_vecChannelsOut[i])
+      if (ch->ch_out)
 	{
-	  free(r->m_vecChannelsOut[i]);
-	  r->m_vecChannelsOut[i] = NULL;
+	  free(ch->ch_out);
+	  ch->ch_out = NULL;
 	}
     }
+  /* a fresh message body is only referenced by the read state */
+  if (r->m_read.rs_state == RTMP_READ_BODY
+      && r->m_read.rs_packet.m_nBytesRead == 0)
+    RTMPPacket_Free(&r->m_read.rs_packet);
+  r->m_read.rs_state = RTMP_READ_HEADER;
+  r->m_read.rs_hlen = 0;
+  PoolDetach(r);
+  free(r->m_pSendBuf);
+  r->m_pSendBuf = NULL;
+  r->m_nSendBufSize = 0;
+  free(r->m_pCork);
+  r->m_pCork = NULL;
+  r->m_nCorkSize = 0;
+  r->m_nCorked = 0;
+  r->m_bCorked = false;
+  free(r->m_pPending);
+  r->m_pPending = NULL;
+  r->m_nPendingSize = 0;
+  r->m_nPending = 0;
+  r->m_bNonBlocking = false;
+  r->m_nSkipIn = 0;
+  free(r->m_sb.sb_buf);
+  r->m_sb.sb_buf = NULL;
+  free(r->m_extChannels);
+  r->m_extChannels = NULL;
+  r->m_numExtChannels = 0;
   AV_clear(r->m_methodCalls, r->m_numCalls);
   r->m_methodCalls = NULL;
   r->m_numCalls = 0;
+  r->m_numInvokes = 0;
+  r->m_bPipelined = false;
 
   r->m_bPlaying = false;
   r->m_nBufferSize = 0;
@@ -2449,23 +3615,16 @@ RTMP_Close(RTMP * r)
 #endif
 }
 
-int
-RTMPSockBuf_Fill(RTMPSockBuf *sb)
+/* recv() into buf, retrying on EINTR. Returns 0 on timeout or EOF, -1 on error */
+static int
+RTMPSockBuf_Recv(RTMPSockBuf *sb, char *buf, int len)
 {
   int nBytes;
 
-  if (!sb->sb_size)
-    sb->sb_start = sb->sb_buf;
-
   while (1)
     {
-      nBytes = sizeof(sb->sb_buf) - sb->sb_size - (sb->sb_start - sb->sb_buf);
-      nBytes = recv(sb->sb_socket, sb->sb_start+sb->sb_size, nBytes, 0);
-      if (nBytes != -1)
-        {
-          sb->sb_size += nBytes;
-        }
-      else
+      nBytes = recv(sb->sb_socket, buf, len, 0);
+      if (nBytes == -1)
         {
           int sockerr = GetSockError();
           Log(LOGDEBUG, "%s, recv returned %d. GetSockError(): %d (%s)",
@@ -2485,6 +3644,69 @@ RTMPSockBuf_Fill(RTMPSockBuf *sb)
   return nBytes;
 }
 
+/* fills in a row before the buffer is doubled, or halved */
+#define RTMP_BUFFER_GROW	4
+#define RTMP_BUFFER_SHRINK	64
+
+int
+RTMPSockBuf_Fill(RTMPSockBuf *sb)
+{
+  int nBytes;
+
+  if (!sb->sb_size)
+    {
+      /* resize only while empty, nothing needs to be moved */
+      int size = sb->sb_bufsize;
+
+      if (sb->sb_nFull >= RTMP_BUFFER_GROW || size < sb->sb_minsize)
+	size = size * 2 < sb->sb_maxsize ? size * 2 : sb->sb_maxsize;
+      else if (sb->sb_nShort >= RTMP_BUFFER_SHRINK || size > sb->sb_maxsize)
+	size = size / 2 > sb->sb_minsize ? size / 2 : sb->sb_minsize;
+
+      if (size != sb->sb_bufsize || !sb->sb_buf)
+	{
+	  char *ptr;
+
+	  Log(LOGDEBUG2, "%s, receive buffer %d -> %d bytes", __FUNCTION__,
+	      sb->sb_bufsize, size);
+	  free(sb->sb_buf);
+	  ptr = malloc(size);
+	  if (!ptr)
+	    {
+	      sb->sb_buf = NULL;
+	      return -1;
+	    }
+	  sb->sb_buf = ptr;
+	  sb->sb_bufsize = size;
+	  sb->sb_nFull = sb->sb_nShort = 0;
+	}
+      sb->sb_start = sb->sb_buf;
+    }
+
+  nBytes = sb->sb_bufsize - sb->sb_size - (sb->sb_start - sb->sb_buf);
+  if (nBytes < 1)
+    return 0;
+  nBytes = RTMPSockBuf_Recv(sb, sb->sb_start+sb->sb_size, nBytes);
+  if (nBytes > 0)
+    {
+      sb->sb_size += nBytes;
+      if (sb->sb_size == sb->sb_bufsize)
+	{
+	  sb->sb_nFull++;
+	  sb->sb_nShort = 0;
+	}
+      else if (nBytes < sb->sb_bufsize / 4)
+	{
+	  sb->sb_nShort++;
+	  sb->sb_nFull = 0;
+	}
+      else
+	sb->sb_nFull = sb->sb_nShort = 0;
+    }
+
+  return nBytes;
+}
+
 #define HEX2BIN(a)	(((a)&0x40)?((a)&0xf)+9:((a)&0xf))
 
 static void
@@ -25,7 +25,8 @@
  */
 
 #ifdef WIN32
-#include <winsock.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #define GetSockError()	WSAGetLastError()
 #define setsockopt(a,b,c,d,e)	(setsockopt)(a,b,c,(const char *)d,(int)e)
 #define EWOULDBLOCK	WSAETIMEDOUT	/* we don't use nonblocking, but we do use timeouts */
@@ -64,14 +65,18 @@
 
 #define RTMP_DEFAULT_CHUNKSIZE	128
 
-#define RTMP_BUFFER_CACHE_SIZE (16*1024) // needs to fit largest number of bytes recv() may return
+#define RTMP_BUFFER_CACHE_SIZE (16*1024) // initial receive buffer, resized between the two below
+#define RTMP_BUFFER_MIN_SIZE (4*1024)
+#define RTMP_BUFFER_MAX_SIZE (256*1024)
 
 #define	RTMP_CHANNELS	65600
+#define	RTMP_CHANNELS_INLINE	64	/* ids with a 1 byte basic header */
 
 extern const char RTMPProtocolStringsLower[][7];
 extern bool RTMP_ctrlC;
 
 uint32_t RTMP_GetTime();
+uint64_t RTMP_GetTimeUs();
 
 #define RTMP_PACKET_TYPE_AUDIO 0x08
 #define RTMP_PACKET_TYPE_VIDEO 0x09
@@ -114,7 +119,11 @@ typedef struct RTMPSockBuf
   int sb_socket;
   int sb_size;				/* number of unprocessed bytes in buffer */
   char *sb_start;			/* pointer into sb_pBuffer of next byte to process */
-  char sb_buf[RTMP_BUFFER_CACHE_SIZE];	/* data read from socket */
+  char *sb_buf;			/* data read from socket, allocated on first fill */
+  int sb_bufsize;		/* size of sb_buf */
+  int sb_minsize, sb_maxsize;	/* bounds for resizing, equal for a fixed size */
+  int sb_nFull;			/* consecutive fills that filled the buffer */
+  int sb_nShort;		/* ... and that used less than a quarter of it */
   bool sb_timedout;
 } RTMPSockBuf;
 
@@ -125,6 +134,90 @@ void RTMPPacket_Free(RTMPPacket *p);
 
 #define RTMPPacket_IsReady(a)	((a)->m_nBytesRead == (a)->m_nBodySize)
 
+/* per chunk stream state. ids below RTMP_CHANNELS_INLINE live in a fixed
+ * array in the RTMP struct, extended ids are kept in a sorted overflow
+ * array which is only allocated when the peer actually uses them. */
+typedef struct RTMPChannel
+{
+  int ch_id;
+  uint32_t ch_timestamp;	/* abs timestamp of last packet */
+  RTMPPacket *ch_in;		/* last header read on this channel */
+  RTMPPacket *ch_out;		/* last header sent on this channel */
+} RTMPChannel;
+
+/* allocator for the bodies of packets read on a session, see
+ * RTMP_SetAllocator. it must stay valid as long as any body it handed out */
+typedef struct RTMPAllocator
+{
+  void *(*pa_alloc)(void *ctx, size_t size);
+  void (*pa_free)(void *ctx, void *ptr, size_t size);
+  void *pa_ctx;
+} RTMPAllocator;
+
+#define RTMP_STATS_TYPES	0x17	/* message types counted one by one */
+
+/* steps of getting a stream going, in the order they normally happen */
+enum
+{
+  RTMP_PHASE_RESOLVED,		/* server address looked up */
+  RTMP_PHASE_TCP,		/* TCP connection established */
+  RTMP_PHASE_C1_SENT,		/* C0+C1 written, includes DH keys and digest */
+  RTMP_PHASE_HANDSHAKED,
+  RTMP_PHASE_CONNECTED,		/* result of connect received */
+  RTMP_PHASE_STREAM,		/* result of createStream received */
+  RTMP_PHASE_PLAYING,		/* play started */
+  RTMP_PHASE_MEDIA,		/* first audio or video message */
+  RTMP_PHASE_KEYFRAME,		/* first video keyframe */
+  RTMP_PHASES
+};
+
+extern const char RTMPPhaseStrings[RTMP_PHASES][11];
+
+/* what a session has been doing. reset by RTMP_Init, kept across
+ * RTMP_Close so reconnects add up */
+typedef struct RTMPStats
+{
+  uint64_t st_bytesIn;
+  uint64_t st_bytesOut;
+  uint32_t st_chunksIn;
+  uint32_t st_chunksOut;
+  uint32_t st_recvCalls;	/* syscalls */
+  uint32_t st_sendCalls;
+  uint32_t st_msgsIn[RTMP_STATS_TYPES];	/* by message type, others at 0 */
+  uint32_t st_msgsOut[RTMP_STATS_TYPES];
+  uint32_t st_acks;		/* bytes received reports sent */
+  uint32_t st_connects;		/* TCP connects, more than one is a reconnect */
+  uint32_t st_pauses;
+  uint32_t st_unpauses;
+  uint32_t st_connectTime;	/* ms taken by the latest TCP connect ... */
+  uint32_t st_handshakeTime;	/* ... and handshake */
+  uint64_t st_phases[RTMP_PHASES];	/* RTMP_GetTimeUs() when each phase was
+					 * first reached, 0 if not yet */
+} RTMPStats;
+
+/* a chunk being received. the header is collected byte-wise and the
+ * body of the current chunk may arrive in several pieces, so a read that
+ * runs out of data can be resumed on the next call. */
+#define RTMP_READ_HEADER	0
+#define RTMP_READ_BODY	1
+
+typedef struct RTMPReadState
+{
+  int rs_state;
+  int rs_hlen;			/* header bytes received so far */
+  int rs_nChunk;		/* body bytes in the current chunk */
+  int rs_nRead;			/* of which already received */
+  RTMPPacket rs_packet;		/* packet the chunk belongs to */
+  char rs_hbuf[RTMP_MAX_HEADER_SIZE];
+} RTMPReadState;
+
+/* a remote method call waiting for its reply */
+typedef struct RTMPMethod
+{
+  AVal name;
+  int num;			/* transaction id */
+} RTMPMethod;
+
 typedef struct RTMP_LNK
 {
   const char *hostname;
@@ -146,8 +239,13 @@ typedef struct RTMP_LNK
   double seekTime;
   uint32_t length;
   bool bLiveStream;
+  bool pipeline;		/* send createStream and play without waiting
+				 * for the replies to connect and createStream */
+  bool deferS2;			/* send C2 and connect before S2 arrives,
+				 * plain RTMP only */
 
   long int timeout;		// number of seconds before connection times out
+  int rcvbuf;			// SO_RCVBUF to request, 0 for the system default
 
   const char *sockshost;
   unsigned short socksport;
@@ -182,14 +280,16 @@ typedef struct RTMP
   bool m_bPlaying;
   bool m_bSendEncoding;
   bool m_bSendCounter;
+  bool m_bPipelined;		/* play went out on a predicted stream id */
 
-  AVal *m_methodCalls;		/* remote method calls queue */
+  int m_numInvokes;		/* last transaction id used */
+  RTMPMethod *m_methodCalls;	/* remote method calls waiting for replies */
   int m_numCalls;
 
   RTMP_LNK Link;
-  RTMPPacket *m_vecChannelsIn[RTMP_CHANNELS];
-  RTMPPacket *m_vecChannelsOut[RTMP_CHANNELS];
-  int m_channelTimestamp[RTMP_CHANNELS];	// abs timestamp of last packet
+  RTMPChannel m_channels[RTMP_CHANNELS_INLINE];
+  RTMPChannel *m_extChannels;	/* sorted by ch_id */
+  int m_numExtChannels;
 
   double m_fAudioCodecs;	// audioCodecs for the connect packet
   double m_fVideoCodecs;	// videoCodecs for the connect packet
@@ -197,6 +297,30 @@ typedef struct RTMP
 
   double m_fDuration;		// duration of stream in seconds
 
+  uint64_t m_nBytesCopied;	/* received via the socket buffer */
+  uint64_t m_nBytesDirect;	/* received straight into packet bodies */
+
+  RTMPReadState m_read;
+
+  RTMPAllocator *m_alloc;	/* NULL to use m_pool */
+  struct RTMPPool *m_pool;	/* size classed free lists of packet bodies */
+  uint32_t m_nPoolHits;		/* bodies reused from the pool ... */
+  uint32_t m_nPoolMisses;	/* ... and ones that had to be malloc'd */
+
+  char *m_pSendBuf;		/* scratch for encrypting large writes */
+  int m_nSendBufSize;
+  char *m_pCork;		/* output held back while corked */
+  int m_nCorkSize;
+  int m_nCorked;
+  bool m_bCorked;
+  char *m_pPending;		/* output a non-blocking socket didn't take */
+  int m_nPendingSize;
+  int m_nPending;
+  bool m_bNonBlocking;
+  int m_nSkipIn;		/* input to drop before the next chunk */
+
+  RTMPStats m_stats;
+
   RTMPSockBuf m_sb;
 #define m_socket	m_sb.sb_socket
 #define m_nBufferSize	m_sb.sb_size
@@ -226,16 +350,38 @@ void RTMP_SetupStream(RTMP *r, int protocol,
 		      uint32_t dLength, bool bLiveStream, long int timeout);
 
 bool RTMP_Connect(RTMP *r, RTMPPacket *cp);
+/* an address from RTMP_Resolve */
+#define RTMP_MAX_ADDRS	8
+
+typedef struct RTMPAddr
+{
+  struct sockaddr_storage addr;
+  socklen_t len;
+} RTMPAddr;
+
+int RTMP_Resolve(const char *host, int port, RTMPAddr *addrs, int max);
+int RTMP_ConnectAny(RTMPAddr *addrs, int n, int timeout);
+
 bool RTMP_Connect0(RTMP *r, struct sockaddr *svc);
 bool RTMP_Connect1(RTMP *r, RTMPPacket *cp);
 bool RTMP_Serve(RTMP *r);
 
+/* in non-blocking mode RTMP_ReadPacket returns false with
+ * RTMP_IsTimedout() set when the socket has no more data; call it
+ * again once the socket is readable to resume the same chunk.
+ * Output the socket can't take is queued on the session instead;
+ * RTMP_Flush sends what it can of it and returns the bytes still
+ * queued, -1 if the session failed. Wait for the socket to become
+ * writable while that is non-zero. */
+bool RTMP_SetNonBlocking(RTMP *r, bool on);
+int RTMP_Flush(RTMP *r);
 bool RTMP_ReadPacket(RTMP * r, RTMPPacket * packet);
 bool RTMP_SendPacket(RTMP * r, RTMPPacket * packet, bool queue);
 bool RTMP_SendChunk(RTMP * r, RTMPChunk *chunk);
 bool RTMP_IsConnected(RTMP *r);
 bool RTMP_IsTimedout(RTMP *r);
 double RTMP_GetDuration(RTMP *r);
+uint32_t RTMP_GetChannelTimestamp(RTMP *r, int nChannel);
 bool RTMP_ToggleStream(RTMP *r);
 
 bool RTMP_ConnectStream(RTMP *r, double seekTime, uint32_t dLength);
@@ -244,6 +390,14 @@ void RTMP_DeleteStream(RTMP *r);
 int RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet);
 int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet);
 
+/* packet bodies from the session pool must be freed by the thread
+ * using the session, they may outlive RTMP_Close though */
+void RTMP_SetAllocator(RTMP *r, RTMPAllocator *a);
+
+/* size 0 lets the receive buffer adapt to the stream's bitrate, anything
+ * else fixes it. rcvbuf sets SO_RCVBUF if nonzero */
+void RTMP_SetBufferSize(RTMP *r, int size, int rcvbuf);
+
 void RTMP_Init(RTMP *r);
 void RTMP_Close(RTMP *r);
 
@@ -263,6 +417,12 @@ void RTMP_DropRequest(RTMP *r, int i, bool freeit);
 #define HASHLEN	32
 
 int RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash, int age);
+void RTMP_SetSWFRefresh(bool on);
+
+/* dh.h */
+#define RTMP_DH_POOL	8
+
+void RTMP_SetDHPool(int size);
 #endif
 
 #endif
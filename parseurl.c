@@ -157,12 +157,17 @@ parsehost:
 	int iCol   = iEnd+1;
 	int iQues  = iEnd+1;
 	int iSlash = iEnd+1;
+	int iV6    = 0;
 
-	if((temp=strstr(p, ":"))!=0)
+	// [IPv6 literal], the brackets aren't part of the host
+	if(*p == '[' && (temp=strchr(p, ']'))!=0)
+		iV6 = temp-p+1;
+
+	if((temp=strstr(p+iV6, ":"))!=0)
 		iCol = temp-p;
-	if((temp=strstr(p, "?"))!=0)
+	if((temp=strstr(p+iV6, "?"))!=0)
 	        iQues = temp-p;
-	if((temp=strstr(p, "/"))!=0)
+	if((temp=strstr(p+iV6, "/"))!=0)
 	        iSlash = temp-p;
 
 	int min = iSlash < iEnd ? iSlash : iEnd+1;
@@ -172,8 +177,13 @@ parsehost:
 
 	if(min < 256) {
 		*host = (char *)malloc((hostlen+1)*sizeof(char));
-		strncpy(*host, p, hostlen);
-		(*host)[hostlen]=0;
+		if(iV6) {
+			strncpy(*host, p+1, iV6-2);
+			(*host)[iV6-2]=0;
+		} else {
+			strncpy(*host, p, hostlen);
+			(*host)[hostlen]=0;
+		}
 
 		Log(LOGDEBUG, "Parsed host    : %s", *host);
 	} else {
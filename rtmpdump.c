@@ -84,6 +84,9 @@ uint32_t nIgnoredFrameCounter = 0;
 
 FILE *file = 0;
 
+/* startup timing, see --timing */
+uint64_t tStart, tSwfDone, tFirstWrite;
+
 void
 sigIntHandler(int sig)
 {
@@ -204,7 +207,11 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 	    {
 
 	      AMFObject metaObj;
-	      int nRes = AMF_Decode(&metaObj, packetBody, nPacketLen, false);
+	      AMFArena arena;
+	      char abuf[4096];
+	      AMFArena_Init(&arena, abuf, sizeof(abuf));
+	      int nRes = AMF_DecodeArena(&metaObj, packetBody, nPacketLen,
+					 false, &arena);
 	      if (nRes >= 0)
 		{
 		  AVal metastring;
@@ -221,10 +228,10 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 			  ret = -2;
 			}
 		    }
-		  AMF_Reset(&metaObj);
-		  if (ret == -2)
-		    break;
 		}
+	      AMFArena_Free(&arena);
+	      if (ret == -2)
+		break;
 	    }
 
 	  // check first keyframe to make sure we got the right position in the stream!
@@ -607,6 +614,10 @@ OpenResumeFile(const char *flvFile,	// file name [in]
       // go through the file to find the meta data!
       off_t pos = dataOffset + 4;
       bool bFoundMetaHeader = false;
+      AMFArena arena;
+      char abuf[4096];
+
+      AMFArena_Init(&arena, abuf, sizeof(abuf));
 
       while (pos < *size - 4 && !bFoundMetaHeader)
 	{
@@ -626,7 +637,10 @@ OpenResumeFile(const char *flvFile,	// file name [in]
 		  free(buffer);
                   buffer = malloc(bufferSize);
                   if (!buffer)
-		    return RD_FAILED;
+		    {
+		      AMFArena_Free(&arena);
+		      return RD_FAILED;
+		    }
 		}
 
 	      fseeko(*file, pos + 11, SEEK_SET);
@@ -634,7 +648,8 @@ OpenResumeFile(const char *flvFile,	// file name [in]
 		break;
 
 	      AMFObject metaObj;
-	      int nRes = AMF_Decode(&metaObj, buffer, dataSize, false);
+	      int nRes = AMF_DecodeArena(&metaObj, buffer, dataSize, false,
+					 &arena);
 	      if (nRes < 0)
 		{
 		  Log(LOGERROR, "%s, error decoding meta data packet",
@@ -667,12 +682,12 @@ OpenResumeFile(const char *flvFile,	// file name [in]
 		  bFoundMetaHeader = true;
 		  break;
 		}
-	      //metaObj.Reset();
-	      //delete obj;
+	      AMFArena_Reset(&arena);
 	    }
 	  pos += (dataSize + 11 + 4);
 	}
 
+      AMFArena_Free(&arena);
       free(buffer);
       if (!bFoundMetaHeader)
 	Log(LOGWARNING, "Couldn't locate meta data!");
@@ -954,6 +969,11 @@ Download(RTMP * rtmp,		// connected RTMP object
 	      return RD_FAILED;
 	    }
 	  size += nRead;
+	  if (!tFirstWrite && (buffer[0] == 0x08 || buffer[0] == 0x09))
+	    {
+	      fflush(file);
+	      tFirstWrite = RTMP_GetTimeUs();
+	    }
 
 	  //LogPrintf("write %dbytes (%.1f kB)\n", nRead, nRead/1024.0);
 	  if (duration <= 0)	// if duration unknown try to get it from the stream (onMetaData)
@@ -1161,6 +1181,31 @@ parseAMF(AMFObject *obj, const char *arg, int *depth)
   return 0;
 }
 
+static void
+PrintTiming(const char *name, uint64_t t)
+{
+  if (t)
+    fprintf(stderr, ",\"%s\":%.3f", name, (t - tStart) / 1000.0);
+  else
+    fprintf(stderr, ",\"%s\":null", name);
+}
+
+/* a JSON line with the ms from start to each step, null if never reached */
+static void
+PrintTimings(RTMP * rtmp, int nStatus)
+{
+  uint64_t now = RTMP_GetTimeUs();
+  int i;
+
+  fprintf(stderr, "{\"status\":%d", nStatus);
+  PrintTiming("swf", tSwfDone);
+  for (i = 0; i < RTMP_PHASES; i++)
+    PrintTiming(RTMPPhaseStrings[i], rtmp->m_stats.st_phases[i]);
+  PrintTiming("first_write", tFirstWrite);
+  PrintTiming("exit", now);
+  fprintf(stderr, "}\n");
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1198,6 +1243,7 @@ main(int argc, char **argv)
   bool bHashes = false;		// display byte counters not hashes by default
 
   long int timeout = 120;	// timeout connection after 120 seconds
+  int rcvbuf = 0;		// socket receive buffer, system default
   uint32_t dStartOffset = 0;	// seek position in non-live mode
   uint32_t dStopOffset = 0;
   uint32_t dLength = 0;		// length to play from stream - calculated from seek position and dStopOffset
@@ -1232,7 +1278,11 @@ main(int argc, char **argv)
 #endif
 
   char DEFAULT_FLASH_VER[] = OSS " 10,0,22,87";
+  bool bTiming = false;
+  bool bPipeline = false;
+  bool bFastHandshake = false;
 
+  tStart = RTMP_GetTimeUs();
   signal(SIGINT, sigIntHandler);
   signal(SIGTERM, sigIntHandler);
 #ifndef WIN32
@@ -1290,6 +1340,10 @@ main(int argc, char **argv)
     {"flv", 1, NULL, 'o'},
     {"resume", 0, NULL, 'e'},
     {"timeout", 1, NULL, 'm'},
+    {"rcvbuf", 1, NULL, 'R'},
+    {"timing", 0, NULL, 'J'},
+    {"pipeline", 0, NULL, 'P'},
+    {"fasthandshake", 0, NULL, 'F'},
     {"buffer", 1, NULL, 'b'},
     {"skip", 1, NULL, 'k'},
     {"subscribe", 1, NULL, 'd'},
@@ -1305,7 +1359,7 @@ main(int argc, char **argv)
 
   while ((opt =
 	  getopt_long(argc, argv,
-		      "hVveqzr:s:t:p:a:b:f:o:u:C:n:c:l:y:m:k:d:A:B:T:w:x:W:X:S:#",
+		      "hVveqzJPFr:s:t:p:a:b:f:o:u:C:n:c:l:y:m:R:k:d:A:B:T:w:x:W:X:S:#",
 		      longopts, NULL)) != -1)
     {
       switch (opt)
@@ -1363,6 +1417,14 @@ main(int argc, char **argv)
 	  LogPrintf
 	    ("--timeout|-m num        Timeout connection num seconds (default: %lu)\n",
 	     timeout);
+	  LogPrintf
+	    ("--rcvbuf|-R num         Socket receive buffer size in bytes (default: system)\n");
+	  LogPrintf
+	    ("--fasthandshake|-F      Send connect without waiting for the end of the handshake (RTMP only)\n");
+	  LogPrintf
+	    ("--pipeline|-P           Send createStream and play without waiting for the replies\n");
+	  LogPrintf
+	    ("--timing|-J             Print the time taken by each startup step as JSON on exit\n");
 	  LogPrintf
 	    ("--start|-A num          Start at num seconds into stream (not valid when using --live)\n");
 	  LogPrintf
@@ -1556,6 +1618,18 @@ main(int argc, char **argv)
 	case 'm':
 	  timeout = atoi(optarg);
 	  break;
+	case 'R':
+	  rcvbuf = atoi(optarg);
+	  break;
+	case 'J':
+	  bTiming = true;
+	  break;
+	case 'P':
+	  bPipeline = true;
+	  break;
+	case 'F':
+	  bFastHandshake = true;
+	  break;
 	case 'A':
 	  dStartOffset = (int) (atof(optarg) * 1000.0);
 	  break;
@@ -1643,6 +1717,7 @@ main(int argc, char **argv)
           swfHash.av_val = (char *)hash;
           swfHash.av_len = HASHLEN;
         }
+      tSwfDone = RTMP_GetTimeUs();
     }
 
   if (swfHash.av_len == 0 && swfSize > 0)
@@ -1671,8 +1746,9 @@ main(int argc, char **argv)
     {
       char str[512] = { 0 };
 
-      snprintf(str, 511, "%s://%s:%d/%s", RTMPProtocolStringsLower[protocol],
-	       hostname, port, app.av_val);
+      int v6 = strchr(hostname, ':') != NULL;
+      snprintf(str, 511, "%s://%s%s%s:%d/%s", RTMPProtocolStringsLower[protocol],
+	       v6 ? "[" : "", hostname, v6 ? "]" : "", port, app.av_val);
       tcUrl.av_len = strlen(str);
       tcUrl.av_val = (char *) malloc(tcUrl.av_len + 1);
       strcpy(tcUrl.av_val, str);
@@ -1697,6 +1773,7 @@ main(int argc, char **argv)
   RTMP_SetupStream(&rtmp, protocol, hostname, port, sockshost, &playpath,
 		   &tcUrl, &swfUrl, &pageUrl, &app, &auth, &swfHash, swfSize,
 		   &flashVer, &subscribepath, dSeek, 0, bLiveStream, timeout);
+  RTMP_SetBufferSize(&rtmp, 0, rcvbuf);
 
   /* backward compatibility, we always sent this as true before */
   if (auth.av_len)
@@ -1704,6 +1781,8 @@ main(int argc, char **argv)
 
   rtmp.Link.extras = extras;
   rtmp.Link.token = token;
+  rtmp.Link.pipeline = bPipeline;
+  rtmp.Link.deferS2 = bFastHandshake;
   off_t size = 0;
 
   // ok, we have to get the timestamp of the last keyframe (only keyframes are seekable) / last audio frame (audio only streams)
@@ -1897,6 +1976,8 @@ main(int argc, char **argv)
 clean:
   Log(LOGDEBUG, "Closing connection.\n");
   RTMP_Close(&rtmp);
+  if (bTiming)
+    PrintTimings(&rtmp, nStatus);
 
   if (file != 0)
     fclose(file);
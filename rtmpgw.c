@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdarg.h>
 
 #include <signal.h>
 #include <getopt.h>
@@ -39,6 +40,19 @@
 
 #define PACKET_SIZE 1024*1024
 
+/* on Linux connections are served by a pool of epoll workers, elsewhere
+ * the server thread streams one request at a time */
+#ifdef __linux__
+#define STREAMING_EPOLL	1
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+#define STREAMING_WORKERS	4	// default number of worker threads
+#define STREAMING_EVENTS	64	// events handled per epoll_wait
+#define STREAMING_RING	512	// FLV tags kept for the clients of a live stream
+#define STREAMING_RING_PRIVATE	8	// ... of any other stream
+#endif
+
 #ifdef WIN32
 #define InitSockets()	{\
         WORD version;			\
@@ -58,19 +72,25 @@ enum
   STREAMING_ACCEPTING,
   STREAMING_IN_PROGRESS,
   STREAMING_STOPPING,
-  STREAMING_STOPPED
+  STREAMING_STOPPED,
+  STREAMING_CONNECTING
 };
 
 typedef struct
 {
   int socket;
   int state;
-
+  int nActive;			// connections currently being served
+#ifdef STREAMING_EPOLL
+  struct STREAMING_WORKER *workers;
+  int nWorkers;
+  int nextWorker;		// round robin for new connections
+#endif
 } STREAMING_SERVER;
 
 STREAMING_SERVER *httpServer = 0;	// server structure pointer
 
-STREAMING_SERVER *startStreaming(const char *address, int port);
+STREAMING_SERVER *startStreaming(const char *address, int port, int nWorkers);
 void stopStreaming(STREAMING_SERVER * server);
 
 typedef struct
@@ -110,6 +130,134 @@ typedef struct
   unsigned char hash[HASHLEN];
 } RTMP_REQUEST;
 
+typedef struct STREAMING_CONN STREAMING_CONN;
+typedef struct STREAMING_SOURCE STREAMING_SOURCE;
+
+#ifdef STREAMING_EPOLL
+/* a socket as registered with a worker's epoll set */
+typedef struct
+{
+  STREAMING_CONN *conn;		// the client, NULL for the upstream socket
+  STREAMING_SOURCE *source;
+  int events;			// events currently asked for
+} STREAMING_HANDLE;
+
+/* an FLV tag kept in a source's ring */
+typedef struct
+{
+  char *data;
+  int size;
+  int alloc;
+  bool keyframe;		// clients can start here
+} STREAMING_TAG;
+#endif
+
+/* the RTMP session feeding one or, for live streams, many clients */
+struct STREAMING_SOURCE
+{
+  STREAMING_SERVER *server;
+  int state;
+  RTMP rtmp;
+  RTMP_REQUEST req;
+  uint32_t dSeek;		// can be used to start from a later point in the stream
+  char *buffer;			// stream buffer
+  unsigned long size;
+  double duration;
+  STREAMING_SOURCE *snext;	// open sessions, for /stats
+  bool bCounted;
+  RTMPStats stats;		// what /stats sees of rtmp.m_stats, under statsLock
+  unsigned int nUnpublished;	// reads since stats was updated
+#ifdef STREAMING_EPOLL
+  char *key;			// set for shared sources
+  STREAMING_SOURCE *next;	// registry of shared sources
+  bool bRegistered;
+  int nPending;			// messages on their way to the worker
+  bool bConnected;
+  struct STREAMING_WORKER *worker;
+  STREAMING_SOURCE *wnext;	// worker's list of sources
+  bool bListed;
+  STREAMING_HANDLE up;
+  STREAMING_CONN *subscribers;
+  int nSubscribers;		// those not closed yet
+  bool bHasVideo;
+  STREAMING_TAG meta;		// latest onMetaData ...
+  STREAMING_TAG videoHeader;	// ... and codec headers, for late joiners
+  STREAMING_TAG audioHeader;
+  bool bHasKey;
+  unsigned int nKeyTag;		// latest keyframe
+  STREAMING_TAG *ring;
+  unsigned int nRing;
+  unsigned int nTags;		// tags produced, tag n is in ring[n % nRing]
+#endif
+};
+
+/* a HTTP client */
+struct STREAMING_CONN
+{
+  STREAMING_SERVER *server;
+  STREAMING_SOURCE *source;
+  int sockfd;			// client connection socket
+  int state;
+#ifdef STREAMING_EPOLL
+  unsigned int nTag;		// next tag to send ...
+  int nSent;			// ... and how much of it went out
+  bool bSkip;			// wait for a keyframe
+  char *rest;			// unsent end of a tag that was overwritten
+  int nRest;
+  STREAMING_HANDLE down;
+  STREAMING_CONN *next;		// source's list of subscribers
+#endif
+};
+
+#ifdef STREAMING_EPOLL
+typedef struct STREAMING_WORKER
+{
+  STREAMING_SERVER *server;
+  int epfd;
+  int pipefd[2];		// STREAMING_MSGs are handed over here
+  STREAMING_SOURCE *sources;
+  int nClosed;			// connections waiting to be freed
+} STREAMING_WORKER;
+
+/* either a new client or a source that finished connecting */
+typedef struct
+{
+  STREAMING_CONN *conn;
+  STREAMING_SOURCE *source;
+} STREAMING_MSG;
+
+static pthread_mutex_t sourcesLock = PTHREAD_MUTEX_INITIALIZER;
+static STREAMING_SOURCE *sources;	// shared sources by key
+#endif
+
+/* setup times in ms, for /stats */
+#define STATS_BUCKETS	8
+#define STATS_PUBLISH_READS	32	// update a session's /stats copy this often
+static const uint32_t statsBuckets[STATS_BUCKETS] =
+  { 10, 25, 50, 100, 250, 500, 1000, 2500 };
+
+typedef struct
+{
+  unsigned long counts[STATS_BUCKETS + 1];	// the last one is +Inf
+  unsigned long count;
+  double sum;			// in seconds
+} STREAMING_HISTOGRAM;
+
+static STREAMING_SOURCE *sessions;	// sources with a session open
+static RTMPStats closedStats;	// sums of the sessions that ended
+static unsigned long nClosedSessions;
+static unsigned long nReconnects;	// ... and of their reconnects
+static STREAMING_HISTOGRAM connectTimes, handshakeTimes;
+
+#ifdef STREAMING_EPOLL
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+#define LockStats()	pthread_mutex_lock(&statsLock)
+#define UnlockStats()	pthread_mutex_unlock(&statsLock)
+#else
+#define LockStats()
+#define UnlockStats()
+#endif
+
 #define STR2AVAL(av,str)	av.av_val = str; av.av_len = strlen(av.av_val)
 
 int
@@ -469,10 +617,12 @@ WriteStream(RTMP * rtmp, char **buf,	// target pointer, maybe preallocated
 TFTYPE
 controlServerThread(void *unused)
 {
-  char ich;
+  int ich;
   while (1)
     {
       ich = getchar();
+      if (ich == EOF)
+	break;			/* no terminal, e.g. running detached */
       switch (ich)
 	{
 	case 'q':
@@ -523,30 +673,338 @@ bool isHTTPRequestEOF(char *line, size_t length)
 }
 */
 
-void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (our listening socket)
-		       int sockfd	// client connection socket
-  )
+static void
+addStats(RTMPStats * to, const RTMPStats * from)
+{
+  int i;
+
+  to->st_bytesIn += from->st_bytesIn;
+  to->st_bytesOut += from->st_bytesOut;
+  to->st_chunksIn += from->st_chunksIn;
+  to->st_chunksOut += from->st_chunksOut;
+  to->st_recvCalls += from->st_recvCalls;
+  to->st_sendCalls += from->st_sendCalls;
+  for (i = 0; i < RTMP_STATS_TYPES; i++)
+    {
+      to->st_msgsIn[i] += from->st_msgsIn[i];
+      to->st_msgsOut[i] += from->st_msgsOut[i];
+    }
+  to->st_acks += from->st_acks;
+  to->st_connects += from->st_connects;
+  to->st_pauses += from->st_pauses;
+  to->st_unpauses += from->st_unpauses;
+}
+
+static void
+observe(STREAMING_HISTOGRAM * h, uint32_t ms)
+{
+  int i;
+
+  for (i = 0; i < STATS_BUCKETS && ms > statsBuckets[i]; i++);
+  h->counts[i]++;
+  h->count++;
+  h->sum += ms / 1000.0;
+}
+
+/* the session's counters are only written by the thread running it,
+ * without locking. /stats reads this copy instead, so it neither races
+ * with that thread nor sees a torn 64-bit counter */
+static void
+publishStats(STREAMING_SOURCE * src)
+{
+  LockStats();
+  memcpy(&src->stats, &src->rtmp.m_stats, sizeof(src->stats));
+  UnlockStats();
+  src->nUnpublished = 0;
+}
+
+/* count the session of a source from now on */
+static void
+openStats(STREAMING_SOURCE * src)
+{
+  LockStats();
+  memcpy(&src->stats, &src->rtmp.m_stats, sizeof(src->stats));
+  src->nUnpublished = 0;
+  src->snext = sessions;
+  sessions = src;
+  src->bCounted = true;
+  UnlockStats();
+}
+
+/* fold the session of a source into the totals */
+static void
+closeStats(STREAMING_SOURCE * src)
+{
+  STREAMING_SOURCE **prev;
+
+  if (!src->bCounted)
+    return;
+  LockStats();
+  for (prev = &sessions; *prev != src; prev = &(*prev)->snext);
+  *prev = src->snext;
+  addStats(&closedStats, &src->rtmp.m_stats);
+  nClosedSessions++;
+  if (src->rtmp.m_stats.st_connects > 1)
+    nReconnects += src->rtmp.m_stats.st_connects - 1;
+  UnlockStats();
+  src->bCounted = false;
+}
+
+static int
+appendf(char *buf, int size, int len, const char *format, ...)
+{
+  va_list args;
+  int n;
+
+  if (len >= size)
+    return len;
+  va_start(args, format);
+  n = vsnprintf(buf + len, size - len, format, args);
+  va_end(args);
+  return n < 0 ? len : len + n;
+}
+
+static int
+appendHistogram(char *buf, int size, int len, const char *name,
+		const char *help, STREAMING_HISTOGRAM * h)
+{
+  unsigned long n = 0;
+  int i;
+
+  len = appendf(buf, size, len, "# HELP %s %s\n# TYPE %s histogram\n",
+		name, help, name);
+  for (i = 0; i < STATS_BUCKETS; i++)
+    {
+      n += h->counts[i];
+      len = appendf(buf, size, len, "%s_bucket{le=\"%g\"} %lu\n", name,
+		    statsBuckets[i] / 1000.0, n);
+    }
+  return appendf(buf, size, len,
+		 "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %g\n%s_count %lu\n",
+		 name, h->count, name, h->sum, name, h->count);
+}
+
+static const char *statsTypes[RTMP_STATS_TYPES] = {
+  "other", "chunk_size", "abort", "ack", "control", "server_bw",
+  "client_bw", NULL, "audio", "video", NULL, NULL, NULL, NULL, NULL,
+  "flex_stream", "flex_shared_object", "flex_message", "info",
+  "shared_object", "invoke", NULL, "aggregate"
+};
+
+/* answer GET /stats with counters of all sessions, in the Prometheus
+ * text format */
+static void
+sendStats(STREAMING_CONN * conn)
+{
+  char buf[16384];
+  int size = sizeof(buf), len, i, dir;
+  RTMPStats total;
+  STREAMING_HISTOGRAM connects, handshakes;
+  unsigned long nOpen = 0, nTotal, reconnects;
+  STREAMING_SOURCE *src;
+
+  LockStats();
+  memcpy(&total, &closedStats, sizeof(total));
+  nTotal = nClosedSessions;
+  reconnects = nReconnects;
+  for (src = sessions; src; src = src->snext)
+    {
+      addStats(&total, &src->stats);
+      if (src->stats.st_connects > 1)
+	reconnects += src->stats.st_connects - 1;
+      nOpen++;
+    }
+  nTotal += nOpen;
+  memcpy(&connects, &connectTimes, sizeof(connects));
+  memcpy(&handshakes, &handshakeTimes, sizeof(handshakes));
+  UnlockStats();
+
+  len = appendf(buf, size, 0,
+		"HTTP/1.0 200 OK\r\nServer:HTTP-RTMP Stream Server \r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n\r\n");
+  len = appendf(buf, size, len,
+		"# HELP rtmpgw_http_connections HTTP connections being served.\n"
+		"# TYPE rtmpgw_http_connections gauge\n"
+		"rtmpgw_http_connections %d\n"
+		"# HELP rtmpgw_sessions RTMP sessions open.\n"
+		"# TYPE rtmpgw_sessions gauge\n"
+		"rtmpgw_sessions %lu\n"
+		"# HELP rtmpgw_sessions_total RTMP sessions opened.\n"
+		"# TYPE rtmpgw_sessions_total counter\n"
+		"rtmpgw_sessions_total %lu\n"
+		"# HELP rtmpgw_reconnects_total Reconnects of RTMP sessions.\n"
+		"# TYPE rtmpgw_reconnects_total counter\n"
+		"rtmpgw_reconnects_total %lu\n",
+		__sync_fetch_and_add(&conn->server->nActive, 0), nOpen,
+		nTotal, reconnects);
+  len = appendf(buf, size, len,
+		"# HELP rtmpgw_bytes_total Bytes received from and sent to RTMP servers.\n"
+		"# TYPE rtmpgw_bytes_total counter\n"
+		"rtmpgw_bytes_total{direction=\"in\"} %llu\n"
+		"rtmpgw_bytes_total{direction=\"out\"} %llu\n"
+		"# HELP rtmpgw_chunks_total RTMP chunks received and sent.\n"
+		"# TYPE rtmpgw_chunks_total counter\n"
+		"rtmpgw_chunks_total{direction=\"in\"} %u\n"
+		"rtmpgw_chunks_total{direction=\"out\"} %u\n"
+		"# HELP rtmpgw_syscalls_total Socket receive and send calls.\n"
+		"# TYPE rtmpgw_syscalls_total counter\n"
+		"rtmpgw_syscalls_total{direction=\"in\"} %u\n"
+		"rtmpgw_syscalls_total{direction=\"out\"} %u\n"
+		"# HELP rtmpgw_acks_total Bytes received reports sent.\n"
+		"# TYPE rtmpgw_acks_total counter\n"
+		"rtmpgw_acks_total %u\n"
+		"# HELP rtmpgw_pauses_total Pause and unpause requests sent.\n"
+		"# TYPE rtmpgw_pauses_total counter\n"
+		"rtmpgw_pauses_total{pause=\"true\"} %u\n"
+		"rtmpgw_pauses_total{pause=\"false\"} %u\n",
+		(unsigned long long) total.st_bytesIn,
+		(unsigned long long) total.st_bytesOut,
+		total.st_chunksIn, total.st_chunksOut,
+		total.st_recvCalls, total.st_sendCalls, total.st_acks,
+		total.st_pauses, total.st_unpauses);
+  len = appendf(buf, size, len,
+		"# HELP rtmpgw_messages_total RTMP messages by type.\n"
+		"# TYPE rtmpgw_messages_total counter\n");
+  for (dir = 0; dir < 2; dir++)
+    for (i = 0; i < RTMP_STATS_TYPES; i++)
+      {
+	uint32_t n = dir ? total.st_msgsOut[i] : total.st_msgsIn[i];
+	char type[16];
+
+	if (!n && !statsTypes[i])
+	  continue;
+	if (statsTypes[i])
+	  strcpy(type, statsTypes[i]);
+	else
+	  sprintf(type, "%d", i);
+	len = appendf(buf, size, len,
+		      "rtmpgw_messages_total{direction=\"%s\",type=\"%s\"} %u\n",
+		      dir ? "out" : "in", type, n);
+      }
+  len = appendHistogram(buf, size, len, "rtmpgw_connect_seconds",
+			"Time to connect to RTMP servers.", &connects);
+  len = appendHistogram(buf, size, len, "rtmpgw_handshake_seconds",
+			"Time for RTMP handshakes.", &handshakes);
+  if (len > size)
+    len = size;
+
+  for (i = 0; i < len;)
+    {
+      int n = send(conn->sockfd, buf + i, len - i, 0);
+      if (n <= 0)
+	break;
+      i += n;
+    }
+}
+
+static STREAMING_CONN *
+newConn(STREAMING_SERVER * server, int sockfd)
+{
+  STREAMING_CONN *conn = calloc(1, sizeof(STREAMING_CONN));
+
+  if (!conn)
+    {
+      Log(LOGERROR, "%s, couldn't allocate connection", __FUNCTION__);
+      closesocket(sockfd);
+      return NULL;
+    }
+  conn->server = server;
+  conn->sockfd = sockfd;
+  conn->state = STREAMING_IN_PROGRESS;
+
+  __sync_fetch_and_add(&server->nActive, 1);
+  return conn;
+}
+
+static void
+closeConn(STREAMING_CONN * conn)
+{
+  if (conn->sockfd)
+    closesocket(conn->sockfd);
+  conn->sockfd = 0;
+
+  conn->state = STREAMING_STOPPED;
+  __sync_fetch_and_sub(&conn->server->nActive, 1);
+}
+
+static STREAMING_SOURCE *
+newSource(STREAMING_SERVER * server, RTMP_REQUEST * req, char *key)
+{
+  STREAMING_SOURCE *src = calloc(1, sizeof(STREAMING_SOURCE));
+
+  if (!src)
+    {
+      Log(LOGERROR, "%s, couldn't allocate source", __FUNCTION__);
+      return NULL;
+    }
+  src->server = server;
+  src->state = STREAMING_CONNECTING;
+  memcpy(&src->req, req, sizeof(RTMP_REQUEST));
+#ifdef STREAMING_EPOLL
+  src->key = key;
+  src->nRing = key ? STREAMING_RING : STREAMING_RING_PRIVATE;
+  src->ring = calloc(src->nRing, sizeof(STREAMING_TAG));
+  if (!src->ring)
+    {
+      Log(LOGERROR, "%s, couldn't allocate source", __FUNCTION__);
+      free(src);
+      return NULL;
+    }
+  src->up.source = src;
+#endif
+  return src;
+}
+
+static void
+closeSource(STREAMING_SOURCE * src)
+{
+  if (src->buffer)
+    {
+      LogPrintf("Closing connection... ");
+      RTMP_Close(&src->rtmp);
+      LogPrintf("done!\n\n");
+      closeStats(src);
+
+      free(src->buffer);
+      src->buffer = NULL;
+    }
+  src->state = STREAMING_STOPPED;
+}
+
+static void
+freeSource(STREAMING_SOURCE * src)
+{
+#ifdef STREAMING_EPOLL
+  unsigned int i;
+
+  for (i = 0; i < src->nRing; i++)
+    free(src->ring[i].data);
+  free(src->ring);
+  free(src->meta.data);
+  free(src->videoHeader.data);
+  free(src->audioHeader.data);
+  free(src->key);
+#endif
+  free(src);
+}
+
+/* read the HTTP request into req and send the response and FLV header.
+ * returns false if the connection is done */
+static bool
+parseRequest(STREAMING_CONN * conn, RTMP_REQUEST * req)
 {
   char buf[512] = { 0 };	// answer buffer
   char header[2048] = { 0 };	// request header
   char *filename = NULL;	// GET request: file name //512 not enuf
-  char *buffer = NULL;		// stream buffer
   char *ptr = NULL;		// header pointer
+  int sockfd = conn->sockfd;
 
   size_t nRead = 0;
+  char *flv = NULL;
 
   char srvhead[] =
     "\r\nServer:HTTP-RTMP Stream Server \r\nContent-Type: Video/MPEG \r\n\r\n";
 
-  server->state = STREAMING_IN_PROGRESS;
-
-  RTMP rtmp = { 0 };
-  uint32_t dSeek = 0;		// can be used to start from a later point in the stream
-
-  // reset RTMP options to defaults specified upon invokation of streams
-  RTMP_REQUEST req;
-  memcpy(&req, &defaultRTMPRequest, sizeof(RTMP_REQUEST));
-
   // timeout for http requests
   fd_set fds;
   struct timeval tv;
@@ -562,7 +1020,7 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
   if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0)
     {
       Log(LOGERROR, "Request timeout/select failed, ignoring request");
-      goto quit;
+      return false;
     }
   else
     {
@@ -578,7 +1036,7 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
 	  sprintf(buf, "HTTP/1.0 416 Requested Range Not Satisfiable%s",
 		  srvhead);
 	  send(sockfd, buf, (int) strlen(buf), 0);
-	  goto quit;
+	  return false;
 	}
 
       if (strncmp(header, "GET", 3) == 0 && nRead > 4)
@@ -600,6 +1058,12 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
     }
   //} while(!isHTTPRequestEOF(header, nRead));
 
+  if (filename != NULL && !strcmp(filename, "/stats"))
+    {
+      sendStats(conn);
+      return false;
+    }
+
   // if we got a filename from the GET method
   if (filename != NULL)
     {
@@ -646,7 +1110,7 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
 		  ptr += nArgLen + 1;
 		  len -= nArgLen + 1;
 
-		  ParseOption(ich, arg, &req);
+		  ParseOption(ich, arg, req);
 		}
 	    }
 	}
@@ -662,213 +1126,900 @@ void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (ou
     }
 
   // do necessary checks right here to make sure the combined request of default values and GET parameters is correct
-  if (req.hostname == 0)
+  if (req->hostname == 0)
     {
       Log(LOGERROR,
 	  "You must specify a hostname (--host) or url (-r \"rtmp://host[:port]/playpath\") containing a hostname");
       goto filenotfound;
     }
-  if (req.playpath.av_len == 0)
+  if (req->playpath.av_len == 0)
     {
       Log(LOGERROR,
 	  "You must specify a playpath (--playpath) or url (-r \"rtmp://host[:port]/playpath\") containing a playpath");
       goto filenotfound;;
     }
 
-  if (req.rtmpport == -1)
+  if (req->rtmpport == -1)
     {
       Log(LOGWARNING,
 	  "You haven't specified a port (--port) or rtmp url (-r), using default port 1935");
-      req.rtmpport = 1935;
+      req->rtmpport = 1935;
     }
-  if (req.protocol == RTMP_PROTOCOL_UNDEFINED)
+  if (req->protocol == RTMP_PROTOCOL_UNDEFINED)
     {
       Log(LOGWARNING,
 	  "You haven't specified a protocol (--protocol) or rtmp url (-r), using default protocol RTMP");
-      req.protocol = RTMP_PROTOCOL_RTMP;
+      req->protocol = RTMP_PROTOCOL_RTMP;
     }
 
-  if (req.flashVer.av_len == 0)
+  if (req->flashVer.av_len == 0)
     {
-      STR2AVAL(req.flashVer, DEFAULT_FLASH_VER);
+      STR2AVAL(req->flashVer, DEFAULT_FLASH_VER);
     }
 
-  if (req.tcUrl.av_len == 0 && req.app.av_len != 0)
+  if (req->tcUrl.av_len == 0 && req->app.av_len != 0)
     {
       char str[512] = { 0 };
-      snprintf(str, 511, "%s://%s/%s", RTMPProtocolStringsLower[req.protocol],
-	       req.hostname, req.app.av_val);
-      req.tcUrl.av_len = strlen(str);
-      req.tcUrl.av_val = (char *) malloc(req.tcUrl.av_len + 1);
-      strcpy(req.tcUrl.av_val, str);
+      int v6 = strchr(req->hostname, ':') != NULL;
+      snprintf(str, 511, "%s://%s%s%s/%s", RTMPProtocolStringsLower[req->protocol],
+	       v6 ? "[" : "", req->hostname, v6 ? "]" : "", req->app.av_val);
+      req->tcUrl.av_len = strlen(str);
+      req->tcUrl.av_val = (char *) malloc(req->tcUrl.av_len + 1);
+      strcpy(req->tcUrl.av_val, str);
     }
 
-  if (req.rtmpport == 0)
-    req.rtmpport = 1935;
+  if (req->rtmpport == 0)
+    req->rtmpport = 1935;
 
-  if (req.swfVfy)
+  // after validation of the http request send response header
+  sprintf(buf, "HTTP/1.0 200 OK%s", srvhead);
+  send(sockfd, buf, (int) strlen(buf), 0);
+
+  // write FLV header first
+  nRead = WriteHeader(&flv, 0);
+  if ((int) nRead <= 0)
     {
-        if (RTMP_HashSWF(req.swfUrl.av_val, &req.swfSize, req.hash, req.swfAge) == 0)
-          {
-            req.swfHash.av_val = (char *)req.hash;
-            req.swfHash.av_len = HASHLEN;
-          }
+      Log(LOGERROR, "%s: Couldn't obtain FLV header, exiting!",
+	  __FUNCTION__);
+      return false;
     }
+  if (send(sockfd, flv, nRead, 0) < 0)
+    {
+      Log(LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
+	  GetSockError());
+      free(flv);
+      return false;
+    }
+  free(flv);
+  return true;
 
-  // after validation of the http request send response header
-  sprintf(buf, "HTTP/1.0 200 OK%s", srvhead);
+filenotfound:
+  LogPrintf("%s, File not found, %s\n", __FUNCTION__, filename);
+  sprintf(buf, "HTTP/1.0 404 File Not Found%s", srvhead);
   send(sockfd, buf, (int) strlen(buf), 0);
+  return false;
+}
+
+/* connect to the RTMP server. returns false if that failed */
+static bool
+openSource(STREAMING_SOURCE * src)
+{
+  RTMP_REQUEST *req = &src->req;
+
+  if (req->swfVfy)
+    {
+        if (RTMP_HashSWF(req->swfUrl.av_val, &req->swfSize, req->hash, req->swfAge) == 0)
+          {
+            req->swfHash.av_val = (char *)req->hash;
+            req->swfHash.av_len = HASHLEN;
+          }
+    }
 
   // send the packets
-  buffer = (char *) calloc(PACKET_SIZE, 1);
+  src->buffer = (char *) calloc(PACKET_SIZE, 1);
 
   // User defined seek offset
-  if (req.dStartOffset > 0)
+  if (req->dStartOffset > 0)
     {
-      if (req.bLiveStream)
+      if (req->bLiveStream)
 	Log(LOGWARNING,
 	    "Can't seek in a live stream, ignoring --seek option");
       else
-	dSeek += req.dStartOffset;
+	src->dSeek += req->dStartOffset;
     }
 
-  if (dSeek != 0)
+  if (src->dSeek != 0)
     {
-      LogPrintf("Starting at TS: %d ms\n", req.nTimeStamp);
+      LogPrintf("Starting at TS: %d ms\n", req->nTimeStamp);
     }
 
-  Log(LOGDEBUG, "Setting buffer time to: %dms", req.bufferTime);
-  RTMP_Init(&rtmp);
-  RTMP_SetBufferMS(&rtmp, req.bufferTime);
-  RTMP_SetupStream(&rtmp, req.protocol, req.hostname, req.rtmpport, req.sockshost,
-		   &req.playpath, &req.tcUrl, &req.swfUrl, &req.pageUrl, &req.app, &req.auth, &req.swfHash, req.swfSize, &req.flashVer, &req.subscribepath, dSeek, -1,	// length
-		   req.bLiveStream, req.timeout);
+  Log(LOGDEBUG, "Setting buffer time to: %dms", req->bufferTime);
+  RTMP_Init(&src->rtmp);
+  RTMP_SetBufferMS(&src->rtmp, req->bufferTime);
+  RTMP_SetupStream(&src->rtmp, req->protocol, req->hostname, req->rtmpport, req->sockshost,
+		   &req->playpath, &req->tcUrl, &req->swfUrl, &req->pageUrl, &req->app, &req->auth, &req->swfHash, req->swfSize, &req->flashVer, &req->subscribepath, src->dSeek, -1,	// length
+		   req->bLiveStream, req->timeout);
   /* backward compatibility, we always sent this as true before */
-  if (req.auth.av_len)
-    rtmp.Link.authflag = true;
+  if (req->auth.av_len)
+    src->rtmp.Link.authflag = true;
 
-  rtmp.Link.extras = req.extras;
-  rtmp.Link.token = req.token;
+  src->rtmp.Link.extras = req->extras;
+  src->rtmp.Link.token = req->token;
+  openStats(src);
 
-  LogPrintf("Connecting ... port: %d, app: %s\n", req.rtmpport, req.app);
-  if (!RTMP_Connect(&rtmp, NULL))
+  LogPrintf("Connecting ... port: %d, app: %s\n", req->rtmpport, req->app);
+  if (!RTMP_Connect(&src->rtmp, NULL))
     {
       LogPrintf("%s, failed to connect!\n", __FUNCTION__);
+      return false;
+    }
+  LockStats();
+  observe(&connectTimes, src->rtmp.m_stats.st_connectTime);
+  observe(&handshakeTimes, src->rtmp.m_stats.st_handshakeTime);
+  memcpy(&src->stats, &src->rtmp.m_stats, sizeof(src->stats));
+  UnlockStats();
+  return true;
+}
+
+/* get the next chunk of the stream into src->buffer. returns its size,
+ * 0 if nothing is to be sent and -1 if no media packet was available */
+static int
+readStream(STREAMING_SOURCE * src)
+{
+  RTMP_REQUEST *req = &src->req;
+  double percent = 0;
+  int nRead;
+
+  nRead = WriteStream(&src->rtmp, &src->buffer, PACKET_SIZE, &req->nTimeStamp);
+  if (++src->nUnpublished >= STATS_PUBLISH_READS)
+    publishStats(src);
+
+  if (nRead > 0)
+    {
+      src->size += nRead;
+
+      //LogPrintf("write %dbytes (%.1f KB)\n", nRead, nRead/1024.0);
+      if (src->duration <= 0)	// if duration unknown try to get it from the stream (onMetaData)
+	src->duration = RTMP_GetDuration(&src->rtmp);
+
+      if (src->duration > 0)
+	{
+	  percent =
+	    ((double) (src->dSeek + req->nTimeStamp)) / (src->duration *
+							 1000.0) * 100.0;
+	  percent = ((double) (int) (percent * 10.0)) / 10.0;
+	  LogStatus("\r%.3f KB / %.2f sec (%.1f%%)",
+		    (double) src->size / 1024.0,
+		    (double) (req->nTimeStamp) / 1000.0, percent);
+	}
+      else
+	{
+	  LogStatus("\r%.3f KB / %.2f sec", (double) src->size / 1024.0,
+		    (double) (req->nTimeStamp) / 1000.0);
+	}
     }
+#ifdef _DEBUG
   else
     {
-      unsigned long size = 0;
-      double percent = 0;
-      double duration = 0.0;
+      Log(LOGDEBUG, "zero read!");
+    }
+#endif
 
-      int nWritten = 0;
-      int nRead = 0;
+  // Force clean close if a specified stop offset is reached
+  if (req->dStopOffset && req->nTimeStamp >= req->dStopOffset)
+    {
+      LogPrintf("\nStop offset has been reached at %.2f seconds\n",
+		(double) req->dStopOffset / 1000.0);
+      nRead = 0;
+      RTMP_Close(&src->rtmp);
+    }
 
-      // write FLV header first
-      nRead = WriteHeader(&buffer, PACKET_SIZE);
-      if (nRead > 0)
+  return nRead;
+}
+
+#ifdef STREAMING_EPOLL
+/* requests for the same live stream share one source */
+static char *
+sourceKey(RTMP_REQUEST * req)
+{
+  int len = strlen(req->hostname) + req->app.av_len + req->playpath.av_len
+    + req->token.av_len + 64;
+  char *key = malloc(len);
+
+  if (key)
+    snprintf(key, len, "%d:%s:%d/%.*s/%.*s?%.*s@%u", req->protocol,
+	     req->hostname, req->rtmpport,
+	     req->app.av_len, req->app.av_val ? req->app.av_val : "",
+	     req->playpath.av_len, req->playpath.av_val,
+	     req->token.av_len, req->token.av_val ? req->token.av_val : "",
+	     req->dStopOffset);
+  return key;
+}
+
+/* caller holds sourcesLock */
+static void
+unlinkSource(STREAMING_SOURCE * src)
+{
+  STREAMING_SOURCE **prev;
+
+  if (!src->bRegistered)
+    return;
+  for (prev = &sources; *prev != src; prev = &(*prev)->next);
+  *prev = src->next;
+  src->bRegistered = false;
+}
+
+static void
+setEvents(STREAMING_WORKER * w, STREAMING_HANDLE * h, int fd, int events)
+{
+  struct epoll_event ev;
+
+  if (h->events == events)
+    return;
+  ev.events = events;
+  ev.data.ptr = h;
+  epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &ev);
+  h->events = events;
+}
+
+static void endSource(STREAMING_WORKER * w, STREAMING_SOURCE * src);
+
+/* the last client left, stop unless another one is on its way */
+static void
+idleSource(STREAMING_WORKER * w, STREAMING_SOURCE * src)
+{
+  bool bIdle;
+
+  pthread_mutex_lock(&sourcesLock);
+  bIdle = src->nPending == 0;
+  if (bIdle)
+    unlinkSource(src);
+  pthread_mutex_unlock(&sourcesLock);
+
+  if (bIdle)
+    endSource(w, src);
+}
+
+static void
+endConn(STREAMING_WORKER * w, STREAMING_CONN * conn)
+{
+  STREAMING_SOURCE *src = conn->source;
+
+  closeConn(conn);		// closing the socket drops it from epoll
+  w->nClosed++;
+
+  if (--src->nSubscribers == 0 && src->state != STREAMING_STOPPED)
+    idleSource(w, src);
+}
+
+/* send the tags the client hasn't seen yet. returns false if it can't
+ * take more right now, or the connection ended */
+static bool
+flushConn(STREAMING_WORKER * w, STREAMING_CONN * conn)
+{
+  STREAMING_SOURCE *src = conn->source;
+
+  while (conn->nRest)
+    {
+      int nWritten = send(conn->sockfd, conn->rest, conn->nRest, 0);
+      if (nWritten < 0)
+	goto error;
+      memmove(conn->rest, conn->rest + nWritten, conn->nRest - nWritten);
+      conn->nRest -= nWritten;
+    }
+
+  while (conn->nTag != src->nTags)
+    {
+      STREAMING_TAG *tag = &src->ring[conn->nTag % src->nRing];
+      int nWritten;
+
+      if (conn->bSkip)
 	{
-	  nWritten = send(sockfd, buffer, nRead, 0);
-	  if (nWritten < 0)
+	  if (!tag->keyframe)
 	    {
-	      Log(LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
-		  GetSockError());
-	      goto cleanup;	// we are in STREAMING_IN_PROGRESS, so we'll go to STREAMING_ACCEPTING
+	      conn->nTag++;
+	      continue;
 	    }
+	  conn->bSkip = false;
+	}
 
-	  size += nRead;
+      nWritten = send(conn->sockfd, tag->data + conn->nSent,
+		      tag->size - conn->nSent, 0);
+      if (nWritten < 0)
+	goto error;
+      conn->nSent += nWritten;
+      if (conn->nSent == tag->size)
+	{
+	  conn->nTag++;
+	  conn->nSent = 0;
 	}
-      else
+    }
+
+  setEvents(w, &conn->down, conn->sockfd, EPOLLRDHUP);
+  if (src->state == STREAMING_STOPPED)
+    {
+      // everything the source had is out
+      endConn(w, conn);
+      return false;
+    }
+  return true;
+
+error:
+  {
+    int sockerr = GetSockError();
+
+    if (sockerr == EINTR)
+      return flushConn(w, conn);
+    if (sockerr == EAGAIN || sockerr == EWOULDBLOCK)
+      {
+	setEvents(w, &conn->down, conn->sockfd, EPOLLOUT | EPOLLRDHUP);
+	return false;
+      }
+    Log(LOGERROR, "%s, sending failed, error: %d", __FUNCTION__, sockerr);
+    endConn(w, conn);
+    return false;
+  }
+}
+
+/* a client whose next tag is about to be overwritten skips ahead to a
+ * keyframe. if it is in the middle of that tag, it keeps the rest of it
+ * so the FLV stays intact. */
+static void
+lagConn(STREAMING_WORKER * w, STREAMING_CONN * conn)
+{
+  STREAMING_SOURCE *src = conn->source;
+
+  if (conn->nSent)
+    {
+      STREAMING_TAG *tag = &src->ring[conn->nTag % src->nRing];
+      int n = tag->size - conn->nSent;
+      char *rest = realloc(conn->rest, n);
+
+      if (!rest || conn->nRest)
 	{
-	  Log(LOGERROR, "%s: Couldn't obtain FLV header, exiting!",
-	      __FUNCTION__);
-	  goto cleanup;
+	  Log(LOGWARNING, "%s, client too slow, dropping it", __FUNCTION__);
+	  if (rest)
+	    conn->rest = rest;
+	  endConn(w, conn);
+	  return;
 	}
+      memcpy(rest, tag->data + conn->nSent, n);
+      conn->rest = rest;
+      conn->nRest = n;
+      conn->nSent = 0;
+    }
+  Log(LOGDEBUG, "%s, client too slow, skipping to next keyframe",
+      __FUNCTION__);
+  conn->nTag = src->nTags;
+  conn->bSkip = true;
+}
 
-      // get the rest of the stream
-      do
+/* true if a private source has to wait for its client */
+static bool
+sourceFull(STREAMING_SOURCE * src)
+{
+  STREAMING_CONN *conn;
+
+  if (src->key)
+    return false;
+  for (conn = src->subscribers; conn; conn = conn->next)
+    if (conn->state == STREAMING_IN_PROGRESS
+	&& src->nTags - conn->nTag >= src->nRing)
+      return true;
+  return false;
+}
+
+static bool
+copyTag(STREAMING_TAG * tag, const char *data, int size)
+{
+  if (tag->alloc < size)
+    {
+      char *p = realloc(tag->data, size);
+      if (!p)
 	{
-	  nRead = WriteStream(&rtmp, &buffer, PACKET_SIZE, &req.nTimeStamp);
+	  Log(LOGERROR, "%s, couldn't allocate tag", __FUNCTION__);
+	  return false;
+	}
+      tag->data = p;
+      tag->alloc = size;
+    }
+  memcpy(tag->data, data, size);
+  tag->size = size;
+  return true;
+}
 
-	  if (nRead > 0)
+static void
+addTag(STREAMING_WORKER * w, STREAMING_SOURCE * src, int size)
+{
+  STREAMING_TAG *tag = &src->ring[src->nTags % src->nRing];
+  STREAMING_CONN *conn;
+  char *data = src->buffer;
+  int type = data[0] & 0x1f;
+  bool bHeader = false;
+
+  if (src->nTags >= src->nRing)
+    for (conn = src->subscribers; conn; conn = conn->next)
+      if (conn->state == STREAMING_IN_PROGRESS
+	  && src->nTags - conn->nTag >= src->nRing)
+	lagConn(w, conn);
+  if (src->state == STREAMING_STOPPED)
+    return;			// that was the last client
+
+  if (!copyTag(tag, data, size))
+    {
+      endSource(w, src);
+      return;
+    }
+
+  // video streams can be joined at keyframes, audio only ones anywhere
+  if (type == 0x09)
+    {
+      src->bHasVideo = true;
+      // AVC sequence header
+      bHeader = size > 12 && (data[11] & 0x0f) == 7 && data[12] == 0;
+      tag->keyframe = size > 11 && (data[11] & 0xf0) == 0x10 && !bHeader;
+    }
+  else
+    {
+      // AAC sequence header
+      bHeader = type == 0x08 && size > 12
+	&& ((data[11] >> 4) & 0x0f) == 10 && data[12] == 0;
+      tag->keyframe = type == 0x08 && !src->bHasVideo && !bHeader;
+    }
+
+  // what a late joiner needs to start playing
+  if (src->key)
+    {
+      if (type == 0x12)
+	copyTag(&src->meta, data, size);
+      else if (bHeader)
+	copyTag(type == 0x09 ? &src->videoHeader : &src->audioHeader,
+		data, size);
+      if (tag->keyframe)
+	{
+	  src->nKeyTag = src->nTags;
+	  src->bHasKey = true;
+	}
+    }
+
+  src->nTags++;
+}
+
+/* flush what upstream didn't take of our acks and pings, and wait for
+ * EPOLLOUT while some of it is left. bRead is false while reading is
+ * held back for slow clients */
+static void
+waitSource(STREAMING_WORKER * w, STREAMING_SOURCE * src, bool bRead)
+{
+  int nPending = RTMP_Flush(&src->rtmp);
+
+  if (nPending < 0)
+    {
+      endSource(w, src);
+      return;
+    }
+  publishStats(src);		// going idle, let /stats catch up
+  setEvents(w, &src->up, src->rtmp.m_socket,
+	    (bRead ? EPOLLIN : 0) | (nPending ? EPOLLOUT : 0));
+}
+
+/* read from the RTMP session and pass the tags on to the clients, until
+ * upstream would block. RTMP_ReadPacket keeps partial chunks, so this
+ * can stop anywhere */
+static void
+pumpSource(STREAMING_WORKER * w, STREAMING_SOURCE * src)
+{
+  while (src->state == STREAMING_IN_PROGRESS)
+    {
+      STREAMING_CONN *conn;
+      int nRead;
+
+      if (w->server->state != STREAMING_ACCEPTING)
+	{
+	  endSource(w, src);
+	  return;
+	}
+      if (sourceFull(src))
+	{
+	  // slow client, stop reading upstream until it caught up
+	  waitSource(w, src, false);
+	  return;
+	}
+
+      nRead = readStream(src);
+      if (nRead > 0)
+	{
+	  addTag(w, src, nRead);
+	  for (conn = src->subscribers; conn; conn = conn->next)
+	    if (conn->state == STREAMING_IN_PROGRESS
+		&& !(conn->down.events & EPOLLOUT))
+	      flushConn(w, conn);
+	}
+      else if (nRead < 0 || !RTMP_IsConnected(&src->rtmp))
+	{
+	  if (RTMP_IsConnected(&src->rtmp) && RTMP_IsTimedout(&src->rtmp))
 	    {
-	      nWritten = send(sockfd, buffer, nRead, 0);
-	      //Log(LOGDEBUG, "written: %d", nWritten);
-	      if (nWritten < 0)
-		{
-		  Log(LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
-		      GetSockError());
-		  goto cleanup;	// we are in STREAMING_IN_PROGRESS, so we'll go to STREAMING_ACCEPTING
-		}
+	      waitSource(w, src, true);	// wait for upstream
+	      return;
+	    }
+	  endSource(w, src);
+	  return;
+	}
+    }
+}
 
-	      size += nRead;
+static void
+resumeSource(STREAMING_WORKER * w, STREAMING_SOURCE * src)
+{
+  if (src->state == STREAMING_IN_PROGRESS && !(src->up.events & EPOLLIN)
+      && !sourceFull(src))
+    pumpSource(w, src);
+}
 
-	      //LogPrintf("write %dbytes (%.1f KB)\n", nRead, nRead/1024.0);
-	      if (duration <= 0)	// if duration unknown try to get it from the stream (onMetaData)
-		duration = RTMP_GetDuration(&rtmp);
+/* upstream is gone. clients get what is left in the ring */
+static void
+endSource(STREAMING_WORKER * w, STREAMING_SOURCE * src)
+{
+  STREAMING_CONN *conn;
 
-	      if (duration > 0)
-		{
-		  percent =
-		    ((double) (dSeek + req.nTimeStamp)) / (duration *
-							   1000.0) * 100.0;
-		  percent = ((double) (int) (percent * 10.0)) / 10.0;
-		  LogStatus("\r%.3f KB / %.2f sec (%.1f%%)",
-			    (double) size / 1024.0,
-			    (double) (req.nTimeStamp) / 1000.0, percent);
-		}
-	      else
-		{
-		  LogStatus("\r%.3f KB / %.2f sec", (double) size / 1024.0,
-			    (double) (req.nTimeStamp) / 1000.0);
-		}
+  if (src->state == STREAMING_STOPPED)
+    return;
+
+  pthread_mutex_lock(&sourcesLock);
+  unlinkSource(src);
+  pthread_mutex_unlock(&sourcesLock);
+
+  closeSource(src);
+  w->nClosed++;
+
+  for (conn = src->subscribers; conn; conn = conn->next)
+    if (conn->state == STREAMING_IN_PROGRESS
+	&& !(conn->down.events & EPOLLOUT))
+      flushConn(w, conn);
+}
+
+/* a late joiner gets the cached metadata and codec headers followed by
+ * the tags since the latest keyframe, so a player can start right away.
+ * if that keyframe is no longer in the ring it waits for the next one */
+static void
+joinConn(STREAMING_SOURCE * src, STREAMING_CONN * conn)
+{
+  STREAMING_TAG *head[3];
+  int i, n = 0;
+
+  if (!src->bHasKey || src->nTags - src->nKeyTag > src->nRing)
+    {
+      conn->bSkip = true;
+      return;
+    }
+
+  head[0] = &src->meta;
+  head[1] = &src->videoHeader;
+  head[2] = &src->audioHeader;
+  for (i = 0; i < 3; i++)
+    n += head[i]->size;
+  if (n && (conn->rest = malloc(n)))
+    {
+      for (i = 0; i < 3; i++)
+	{
+	  memcpy(conn->rest + conn->nRest, head[i]->data, head[i]->size);
+	  conn->nRest += head[i]->size;
+	}
+    }
+  conn->nTag = src->nKeyTag;
+  Log(LOGDEBUG, "%s, replaying %u tags", __FUNCTION__,
+      src->nTags - src->nKeyTag);
+}
+
+static void
+addConn(STREAMING_WORKER * w, STREAMING_CONN * conn)
+{
+  STREAMING_SOURCE *src = conn->source;
+  struct epoll_event ev;
+
+  conn->next = src->subscribers;
+  src->subscribers = conn;
+  src->nSubscribers++;
+
+  conn->down.conn = conn;
+  conn->down.source = src;
+  fcntl(conn->sockfd, F_SETFL, fcntl(conn->sockfd, F_GETFL, 0) | O_NONBLOCK);
+  ev.events = conn->down.events = EPOLLRDHUP;
+  ev.data.ptr = &conn->down;
+  epoll_ctl(w->epfd, EPOLL_CTL_ADD, conn->sockfd, &ev);
+
+  if (src->state == STREAMING_STOPPED)
+    {
+      endConn(w, conn);
+      return;
+    }
+
+  conn->nTag = src->nTags;
+  if (src->nTags > 0)
+    joinConn(src, conn);
+  if (src->state == STREAMING_IN_PROGRESS)
+    flushConn(w, conn);
+}
+
+static void
+startSource(STREAMING_WORKER * w, STREAMING_SOURCE * src)
+{
+  struct epoll_event ev;
+
+  if (!src->bConnected || w->server->state != STREAMING_ACCEPTING)
+    {
+      endSource(w, src);
+      return;
+    }
+
+  src->state = STREAMING_IN_PROGRESS;
+  RTMP_SetNonBlocking(&src->rtmp, true);
+  ev.events = src->up.events = EPOLLIN;
+  ev.data.ptr = &src->up;
+  epoll_ctl(w->epfd, EPOLL_CTL_ADD, src->rtmp.m_socket, &ev);
+
+  if (!src->nSubscribers)
+    idleSource(w, src);
+  else
+    // the handshake may have left data in the socket buffer already
+    pumpSource(w, src);
+}
+
+static void
+readMsgs(STREAMING_WORKER * w)
+{
+  STREAMING_MSG msg;
+
+  while (read(w->pipefd[0], &msg, sizeof(msg)) == sizeof(msg))
+    {
+      STREAMING_SOURCE *src = msg.conn ? msg.conn->source : msg.source;
+
+      pthread_mutex_lock(&sourcesLock);
+      src->nPending--;
+      pthread_mutex_unlock(&sourcesLock);
+
+      if (!src->bListed)
+	{
+	  src->wnext = w->sources;
+	  w->sources = src;
+	  src->bListed = true;
+	}
+      if (msg.conn)
+	addConn(w, msg.conn);
+      else
+	startSource(w, src);
+    }
+}
+
+/* free closed connections and sources, end all of them when the server
+ * stops */
+static void
+sweepConns(STREAMING_WORKER * w)
+{
+  STREAMING_SOURCE **sprev = &w->sources, *src;
+
+  while ((src = *sprev))
+    {
+      STREAMING_CONN **prev = &src->subscribers, *conn;
+
+      if (w->server->state != STREAMING_ACCEPTING)
+	{
+	  /* requestThread is still in openSource with this one, it is
+	   * ended by startSource once the connect returns */
+	  if (src->state != STREAMING_CONNECTING)
+	    endSource(w, src);
+	  for (conn = src->subscribers; conn; conn = conn->next)
+	    if (conn->state == STREAMING_IN_PROGRESS)
+	      endConn(w, conn);
+	}
+
+      while ((conn = *prev))
+	{
+	  if (conn->state == STREAMING_STOPPED)
+	    {
+	      *prev = conn->next;
+	      free(conn->rest);
+	      free(conn);
 	    }
-#ifdef _DEBUG
 	  else
+	    prev = &conn->next;
+	}
+
+      // unregistered, so nPending can only go down by now
+      if (src->state == STREAMING_STOPPED && !src->subscribers
+	  && !src->nPending)
+	{
+	  *sprev = src->wnext;
+	  freeSource(src);
+	}
+      else
+	sprev = &src->wnext;
+    }
+  w->nClosed = 0;
+}
+
+TFTYPE
+workerThread(void *arg)
+{
+  STREAMING_WORKER *w = arg;
+  struct epoll_event events[STREAMING_EVENTS];
+  int i, n;
+
+  while (1)
+    {
+      n = epoll_wait(w->epfd, events, STREAMING_EVENTS, 1000);
+      for (i = 0; i < n; i++)
+	{
+	  STREAMING_HANDLE *h = events[i].data.ptr;
+	  STREAMING_CONN *conn;
+
+	  if (!h)
 	    {
-	      Log(LOGDEBUG, "zero read!");
+	      readMsgs(w);
+	      continue;
 	    }
-#endif
+	  if (!h->conn)
+	    {
+	      if (h->source->state == STREAMING_IN_PROGRESS)
+		pumpSource(w, h->source);
+	      continue;
+	    }
+	  conn = h->conn;
+	  if (conn->state != STREAMING_IN_PROGRESS)
+	    continue;		// ended earlier in this round
 
-	  // Force clean close if a specified stop offset is reached
-	  if (req.dStopOffset && req.nTimeStamp >= req.dStopOffset)
+	  if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
 	    {
-	      LogPrintf("\nStop offset has been reached at %.2f seconds\n",
-			(double) req.dStopOffset / 1000.0);
-	      nRead = 0;
-	      RTMP_Close(&rtmp);
+	      Log(LOGDEBUG, "%s: client closed connection", __FUNCTION__);
+	      endConn(w, conn);
 	    }
+	  else if (flushConn(w, conn))
+	    resumeSource(w, conn->source);
+	}
+      if (w->nClosed || w->server->state != STREAMING_ACCEPTING)
+	sweepConns(w);
+    }
+  TFRET();
+}
+
+static bool
+sendMsg(STREAMING_WORKER * w, STREAMING_CONN * conn, STREAMING_SOURCE * src)
+{
+  STREAMING_MSG msg;
+
+  msg.conn = conn;
+  msg.source = src;
+  if (write(w->pipefd[1], &msg, sizeof(msg)) == sizeof(msg))
+    return true;
+
+  Log(LOGERROR, "%s, couldn't hand over connection", __FUNCTION__);
+  pthread_mutex_lock(&sourcesLock);
+  src = conn ? conn->source : src;
+  src->nPending--;
+  pthread_mutex_unlock(&sourcesLock);
+  return false;
+}
+
+/* does the blocking part of the setup, then hands the client over to the
+ * worker of its source. the first client of a source also connects it */
+TFTYPE
+requestThread(void *arg)
+{
+  STREAMING_CONN *conn = arg;
+  STREAMING_SERVER *server = conn->server;
+  STREAMING_SOURCE *src = NULL;
+  RTMP_REQUEST req;
+  char *key = NULL;
+  bool bCreated = false;
 
+  // reset RTMP options to defaults specified upon invokation of streams
+  memcpy(&req, &defaultRTMPRequest, sizeof(RTMP_REQUEST));
+
+  if (!parseRequest(conn, &req) || server->state != STREAMING_ACCEPTING)
+    goto fail;
+
+  if (req.bLiveStream)
+    key = sourceKey(&req);
+
+  pthread_mutex_lock(&sourcesLock);
+  if (key)
+    for (src = sources; src; src = src->next)
+      if (!strcmp(src->key, key))
+	break;
+  if (src)
+    {
+      Log(LOGDEBUG, "%s, joining stream %s", __FUNCTION__, key);
+      src->nPending++;
+      free(key);
+    }
+  else if ((src = newSource(server, &req, key)))
+    {
+      src->worker = &server->workers[
+	(unsigned int) server->nextWorker++ % server->nWorkers];
+      src->nPending = 2;	// this client and the source itself
+      if (key)
+	{
+	  src->next = sources;
+	  sources = src;
+	  src->bRegistered = true;
 	}
-      while (server->state == STREAMING_IN_PROGRESS && nRead > -1
-	     && RTMP_IsConnected(&rtmp) && nWritten >= 0);
+      bCreated = true;
+    }
+  else
+    free(key);
+  pthread_mutex_unlock(&sourcesLock);
+
+  if (!src)
+    goto fail;
+
+  conn->source = src;
+  if (!sendMsg(src->worker, conn, NULL))
+    {
+      closeConn(conn);
+      free(conn);
     }
-cleanup:
-  LogPrintf("Closing connection... ");
-  RTMP_Close(&rtmp);
-  LogPrintf("done!\n\n");
 
-quit:
-  if (buffer)
+  if (bCreated)
     {
-      free(buffer);
-      buffer = NULL;
+      src->bConnected = openSource(src);
+      if (!sendMsg(src->worker, NULL, src))
+	{
+	  // can't happen short of running out of descriptors
+	  closeSource(src);
+	}
     }
+  TFRET();
 
-  if (sockfd)
-    closesocket(sockfd);
+fail:
+  closeConn(conn);
+  free(conn);
+  TFRET();
+}
 
-  if (server->state == STREAMING_IN_PROGRESS)
-    server->state = STREAMING_ACCEPTING;
+#else
 
-  return;
+void
+processTCPrequest(STREAMING_CONN * conn)
+{
+  STREAMING_SOURCE *src = NULL;
+  RTMP_REQUEST req;
+  int nRead = 0;
 
-filenotfound:
-  LogPrintf("%s, File not found, %s\n", __FUNCTION__, filename);
-  sprintf(buf, "HTTP/1.0 404 File Not Found%s", srvhead);
-  send(sockfd, buf, (int) strlen(buf), 0);
-  goto quit;
+  // reset RTMP options to defaults specified upon invokation of streams
+  memcpy(&req, &defaultRTMPRequest, sizeof(RTMP_REQUEST));
+
+  if (parseRequest(conn, &req) && (src = newSource(conn->server, &req, NULL))
+      && openSource(src))
+    {
+      // get the rest of the stream
+      do
+	{
+	  nRead = readStream(src);
+
+	  if (nRead > 0)
+	    {
+	      int nWritten = send(conn->sockfd, src->buffer, nRead, 0);
+	      //Log(LOGDEBUG, "written: %d", nWritten);
+	      if (nWritten < 0)
+		{
+		  Log(LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
+		      GetSockError());
+		  break;
+		}
+	    }
+	}
+      while (conn->server->state == STREAMING_ACCEPTING && nRead > -1
+	     && RTMP_IsConnected(&src->rtmp));
+    }
+  if (src)
+    {
+      closeSource(src);
+      freeSource(src);
+    }
+  closeConn(conn);
+  free(conn);
 }
+#endif
 
 TFTYPE
 serverThread(void *arg)
@@ -885,23 +2036,29 @@ serverThread(void *arg)
 
       if (sockfd > 0)
 	{
-	  // Create a new process and transfer the control to that
+	  STREAMING_CONN *conn;
+
 	  Log(LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
 	      inet_ntoa(addr.sin_addr));
-	  processTCPrequest(server, sockfd);
+	  if (!(conn = newConn(server, sockfd)))
+	    continue;
+#ifdef STREAMING_EPOLL
+	  ThreadCreate(requestThread, conn);
+#else
+	  processTCPrequest(conn);
 	  Log(LOGDEBUG, "%s: processed request\n", __FUNCTION__);
+#endif
 	}
-      else
+      else if (server->state == STREAMING_ACCEPTING)
 	{
 	  Log(LOGERROR, "%s: accept failed", __FUNCTION__);
 	}
     }
-  server->state = STREAMING_STOPPED;
   TFRET();
 }
 
 STREAMING_SERVER *
-startStreaming(const char *address, int port)
+startStreaming(const char *address, int port, int nWorkers)
 {
   struct sockaddr_in addr;
   int sockfd;
@@ -936,6 +2093,31 @@ startStreaming(const char *address, int port)
   server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
   server->socket = sockfd;
 
+#ifdef STREAMING_EPOLL
+  int i;
+
+  server->workers = calloc(nWorkers, sizeof(STREAMING_WORKER));
+  server->nWorkers = nWorkers;
+  for (i = 0; i < nWorkers; i++)
+    {
+      STREAMING_WORKER *w = &server->workers[i];
+      struct epoll_event ev;
+
+      w->server = server;
+      w->epfd = epoll_create(STREAMING_EVENTS);
+      if (w->epfd == -1 || pipe(w->pipefd) == -1)
+	{
+	  Log(LOGERROR, "%s, couldn't set up worker %d", __FUNCTION__, i);
+	  return 0;
+	}
+      fcntl(w->pipefd[0], F_SETFL, O_NONBLOCK);
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;
+      epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->pipefd[0], &ev);
+      ThreadCreate(workerThread, w);
+    }
+#endif
+
   ThreadCreate(serverThread, server);
 
   return server;
@@ -948,14 +2130,11 @@ stopStreaming(STREAMING_SERVER * server)
 
   if (server->state != STREAMING_STOPPED)
     {
-      if (server->state == STREAMING_IN_PROGRESS)
-	{
-	  server->state = STREAMING_STOPPING;
+      server->state = STREAMING_STOPPING;
 
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
-	    msleep(1);
-	}
+      // wait for streaming threads to exit
+      while (server->nActive > 0)
+	msleep(1);
 
       if (closesocket(server->socket))
 	Log(LOGERROR, "%s: Failed to close listening socket, error %d",
@@ -1175,6 +2354,10 @@ main(int argc, char **argv)
 
   char *httpStreamingDevice = DEFAULT_HTTP_STREAMING_DEVICE;	// streaming device, default 0.0.0.0
   int nHttpStreamingPort = 80;	// port
+  int nStreamingWorkers = 1;	// worker threads
+#ifdef STREAMING_EPOLL
+  nStreamingWorkers = STREAMING_WORKERS;
+#endif
 
   LogPrintf("HTTP-RTMP Stream Gateway %s\n", RTMPDUMP_VERSION);
   LogPrintf("(c) 2010 Andrej Stepanchuk, Howard Chu; license: GPL\n\n");
@@ -1221,6 +2404,9 @@ main(int argc, char **argv)
     //{"skip",    1, NULL, 'k'},
     {"device", 1, NULL, 'D'},
     {"sport", 1, NULL, 'g'},
+#ifdef STREAMING_EPOLL
+    {"threads", 1, NULL, 'j'},
+#endif
     {"subscribe", 1, NULL, 'd'},
     {"start", 1, NULL, 'A'},
     {"stop", 1, NULL, 'B'},
@@ -1240,7 +2426,7 @@ main(int argc, char **argv)
 
   while ((opt =
 	  getopt_long(argc, argv,
-		      "hvqVzr:s:t:p:a:f:u:n:c:l:y:m:d:D:A:B:T:g:w:x:W:X:S:", longopts,
+		      "hvqVzr:s:t:p:a:f:u:n:c:l:y:m:d:D:A:B:T:g:j:w:x:W:X:S:", longopts,
 		      NULL)) != -1)
     {
       switch (opt)
@@ -1308,8 +2494,14 @@ main(int argc, char **argv)
 	    ("--device|-D             Streaming device ip address (default: %s)\n",
 	     DEFAULT_HTTP_STREAMING_DEVICE);
 	  LogPrintf
-	    ("--sport|-g              Streaming port (default: %d)\n\n",
+	    ("--sport|-g              Streaming port (default: %d)\n",
 	     nHttpStreamingPort);
+#ifdef STREAMING_EPOLL
+	  LogPrintf
+	    ("--threads|-j num        Number of streaming worker threads (default: %d)\n",
+	     STREAMING_WORKERS);
+#endif
+	  LogPrintf("\n");
 	  LogPrintf
 	    ("--quiet|-q              Suppresses all command output.\n");
 	  LogPrintf("--verbose|-V            Verbose command output.\n");
@@ -1347,6 +2539,23 @@ main(int argc, char **argv)
 	      }
 	    break;
 	  }
+#ifdef STREAMING_EPOLL
+	case 'j':
+	  {
+	    int n = atoi(optarg);
+	    if (n < 1)
+	      {
+		Log(LOGERROR,
+		    "Invalid number of worker threads (requested %d), ignoring\n",
+		    n);
+	      }
+	    else
+	      {
+		nStreamingWorkers = n;
+	      }
+	    break;
+	  }
+#endif
 	default:
 	  //LogPrintf("unknown option: %c\n", opt);
 	  ParseOption(opt, optarg, &defaultRTMPRequest);
@@ -1359,12 +2568,23 @@ main(int argc, char **argv)
   netstackdump_read = fopen("netstackdump_read", "wb");
 #endif
 
+  // write log output from its own thread, a slow stderr mustn't stall the workers
+  LogSetAsync(true);
+
+#ifdef CRYPTO
+  // keep RTMPE keypairs ready so a reconnect storm doesn't queue on bignum math
+  RTMP_SetDHPool(RTMP_DH_POOL);
+  // revalidate SWF hashes before they expire instead of on a client's time
+  RTMP_SetSWFRefresh(true);
+#endif
+
   // start text UI
   ThreadCreate(controlServerThread, 0);
 
   // start http streaming
   if ((httpServer =
-       startStreaming(httpStreamingDevice, nHttpStreamingPort)) == 0)
+       startStreaming(httpStreamingDevice, nHttpStreamingPort,
+			 nStreamingWorkers)) == 0)
     {
       Log(LOGERROR, "Failed to start HTTP server, exiting!");
       return RD_FAILED;
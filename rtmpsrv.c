@@ -163,10 +163,53 @@ static bool
 SendConnectResult(RTMP *r, double txn)
 {
   RTMPPacket packet;
-  char pbuf[384], *pend = pbuf+sizeof(pbuf);
-  AMFObject obj;
-  AMFObjectProperty p, op;
-  AVal av;
+  AMFObjectProperty srv[3], info[5], ver;
+  AMFObject srvobj, infoobj;
+  char *enc, *pend;
+  int size;
+  bool ret;
+
+  srv[0].p_name = av_fmsVer;
+  srv[0].p_type = AMF_STRING;
+  STR2AVAL(srv[0].p_vu.p_aval, "FMS/3,5,1,525");
+  srv[1].p_name = av_capabilities;
+  srv[1].p_type = AMF_NUMBER;
+  srv[1].p_vu.p_number = 31.0;
+  srv[2].p_name = av_mode;
+  srv[2].p_type = AMF_NUMBER;
+  srv[2].p_vu.p_number = 1.0;
+  srvobj.o_num = 3;
+  srvobj.o_props = srv;
+  srvobj.o_index = NULL;
+
+  info[0].p_name = av_level;
+  info[0].p_type = AMF_STRING;
+  STR2AVAL(info[0].p_vu.p_aval, "status");
+  info[1].p_name = av_code;
+  info[1].p_type = AMF_STRING;
+  STR2AVAL(info[1].p_vu.p_aval, "NetConnection.Connect.Success");
+  info[2].p_name = av_description;
+  info[2].p_type = AMF_STRING;
+  STR2AVAL(info[2].p_vu.p_aval, "Connection succeeded.");
+  info[3].p_name = av_objectEncoding;
+  info[3].p_type = AMF_NUMBER;
+  info[3].p_vu.p_number = r->m_fEncoding;
+  STR2AVAL(ver.p_name, "version");
+  STR2AVAL(ver.p_vu.p_aval, "3,5,1,525");
+  ver.p_type = AMF_STRING;
+  STR2AVAL(info[4].p_name, "data");
+  info[4].p_type = AMF_OBJECT;
+  info[4].p_vu.p_object.o_num = 1;
+  info[4].p_vu.p_object.o_props = &ver;
+  info[4].p_vu.p_object.o_index = NULL;
+  infoobj.o_num = 5;
+  infoobj.o_props = info;
+  infoobj.o_index = NULL;
+
+  size = AMF_STRING_SIZE(av__result.av_len) + AMF_NUMBER_SIZE
+    + AMF_EncodedSize(&srvobj) + AMF_EncodedSize(&infoobj);
+  if (!RTMPPacket_Alloc(&packet, size))
+    return false;
 
   packet.m_nChannel = 0x03;     // control channel (invoke)
   packet.m_headerType = 1; /* RTMP_PACKET_SIZE_MEDIUM; */
@@ -174,53 +217,19 @@ SendConnectResult(RTMP *r, double txn)
   packet.m_nInfoField1 = 0;
   packet.m_nInfoField2 = 0;
   packet.m_hasAbsTimestamp = 0;
-  packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-  char *enc = packet.m_body;
+  enc = packet.m_body;
+  pend = enc + size;
   enc = AMF_EncodeString(enc, pend, &av__result);
   enc = AMF_EncodeNumber(enc, pend, txn);
-  *enc++ = AMF_OBJECT;
-
-  STR2AVAL(av, "FMS/3,5,1,525");
-  enc = AMF_EncodeNamedString(enc, pend, &av_fmsVer, &av);
-  enc = AMF_EncodeNamedNumber(enc, pend, &av_capabilities, 31.0);
-  enc = AMF_EncodeNamedNumber(enc, pend, &av_mode, 1.0);
-  *enc++ = 0;
-  *enc++ = 0;
-  *enc++ = AMF_OBJECT_END;
-
-  *enc++ = AMF_OBJECT;
-
-  STR2AVAL(av, "status");
-  enc = AMF_EncodeNamedString(enc, pend, &av_level, &av);
-  STR2AVAL(av, "NetConnection.Connect.Success");
-  enc = AMF_EncodeNamedString(enc, pend, &av_code, &av);
-  STR2AVAL(av, "Connection succeeded.");
-  enc = AMF_EncodeNamedString(enc, pend, &av_description, &av);
-  enc = AMF_EncodeNamedNumber(enc, pend, &av_objectEncoding, r->m_fEncoding);
-#if 0
-  STR2AVAL(av, "58656322c972d6cdf2d776167575045f8484ea888e31c086f7b5ffbd0baec55ce442c2fb");
-  enc = AMF_EncodeNamedString(enc, pend, &av_secureToken, &av);
-#endif
-  STR2AVAL(p.p_name, "version");
-  STR2AVAL(p.p_vu.p_aval, "3,5,1,525");
-  p.p_type = AMF_STRING;
-  obj.o_num = 1;
-  obj.o_props = &p;
-  op.p_type = AMF_OBJECT;
-  STR2AVAL(op.p_name, "data");
-  op.p_vu.p_object = obj;
-  enc = AMFProp_Encode(&op, enc, pend);
-  *enc++ = 0;
-  *enc++ = 0;
-  *enc++ = AMF_OBJECT_END;
-  *enc++ = 0;
-  *enc++ = 0;
-  *enc++ = AMF_OBJECT_END;
+  enc = AMF_Encode(&srvobj, enc, pend);
+  enc = AMF_Encode(&infoobj, enc, pend);
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, false);
+  ret = RTMP_SendPacket(r, &packet, false);
+  RTMPPacket_Free(&packet);
+  return ret;
 }
 
 static bool
@@ -384,6 +393,15 @@ countAMF(AMFObject *obj, int *argc)
           len += countAMF(&p->p_vu.p_object, argc);
           (*argc) += 2;
           break;
+        case AMF_STRICT_ARRAY:
+          /* passed on as an object of unnamed numbers */
+          {
+            int n;
+            AMFProp_GetNumberArray(p, &n);
+            len += 9 + n * (4 + 2 + 40);
+            (*argc) += 2 + n * 2;
+          }
+          break;
         case AMF_NULL:
         default:
           break;
@@ -407,7 +425,10 @@ dumpAMF(AMFObject *obj, char *ptr, AVal *argv, int *argc)
       argv[ac].av_val = ptr;
       if (p->p_name.av_val)
         *ptr++ = 'N';
-      *ptr++ = opt[p->p_type];
+      if (p->p_type == AMF_STRICT_ARRAY)
+        *ptr++ = 'O';
+      else
+        *ptr++ = p->p_type < sizeof(opt) - 1 ? opt[p->p_type] : ' ';
       *ptr++ = ':';
       if (p->p_name.av_val)
         ptr += sprintf(ptr, "%.*s:", p->p_name.av_len, p->p_name.av_val);
@@ -439,6 +460,31 @@ dumpAMF(AMFObject *obj, char *ptr, AVal *argv, int *argc)
           argv[ac].av_len = 3;
           ptr += sprintf(ptr, " -C O:0");
           break;
+        case AMF_STRICT_ARRAY:
+          {
+            double *vals;
+            int j, n;
+            vals = AMFProp_GetNumberArray(p, &n);
+            *ptr++ = '1';
+            argv[ac].av_len = ptr - argv[ac].av_val;
+            for (j = 0; j < n; j++)
+              {
+                ac++;
+                argv[ac].av_val = ptr+1;
+                argv[ac++].av_len = 2;
+                ptr += sprintf(ptr, " -C ");
+                argv[ac].av_val = ptr;
+                ptr += sprintf(ptr, "N:%f", vals[j]);
+                argv[ac].av_len = ptr - argv[ac].av_val;
+              }
+            ac++;
+            argv[ac].av_val = ptr+1;
+            argv[ac++].av_len = 2;
+            argv[ac].av_val = ptr+4;
+            argv[ac].av_len = 3;
+            ptr += sprintf(ptr, " -C O:0");
+          }
+          break;
         case AMF_NULL:
         default:
           argv[ac].av_len = ptr - argv[ac].av_val;
@@ -793,7 +793,7 @@ void doServe(STREAMING_SERVER * server,	// server socket and state (our listenin
 	    {
               if (server->f_cur && server->rc.m_mediaChannel && !paused)
                 {
-                  server->rc.m_pauseStamp = server->rc.m_channelTimestamp[server->rc.m_mediaChannel];
+                  server->rc.m_pauseStamp = RTMP_GetChannelTimestamp(&server->rc, server->rc.m_mediaChannel);
                   if (RTMP_ToggleStream(&server->rc))
                     {
                       paused = true;